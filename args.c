@@ -16,6 +16,28 @@ DWORD find_flag(LPWSTR* argv, int* argc, LPCWSTR flag, LPCWSTR long_flag) {
     return count;
 }
 
+DWORD find_flag_value(LPWSTR* argv, int* argc, LPCWSTR flag, LPCWSTR long_flag, LPWSTR* value) {
+    DWORD count = 0;
+    for (int i = 1; i < *argc; ++i) {
+        if (wcscmp(argv[i], flag) == 0 || wcscmp(argv[i], long_flag) == 0) {
+            int removed = 1;
+            count += 1;
+            if (i + 1 < *argc) {
+                *value = argv[i + 1];
+                removed = 2;
+            } else {
+                *value = NULL;
+            }
+            for (int j = i + removed; j < *argc; ++j) {
+                argv[j - removed] = argv[j];
+            }
+            *argc -= removed;
+            --i;
+        }
+    }
+    return count;
+}
+
 LPWSTR* parse_command_line_with(const LPCWSTR args, int* argc, BOOL escape_backslash, BOOL escape_quotes) {
     HANDLE heap = GetProcessHeap();
     *argc = 0;
@@ -4,6 +4,10 @@
 
 DWORD find_flag(LPWSTR* argv, int* argc, LPCWSTR flag, LPCWSTR long_flag);
 
+// Removes flag and the argument after it, value is set to the last such
+// argument, or NULL if the flag was the last argument.
+DWORD find_flag_value(LPWSTR* argv, int* argc, LPCWSTR flag, LPCWSTR long_flag, LPWSTR* value);
+
 LPWSTR* parse_command_line(LPCWSTR args, int* argc);
 
 LPWSTR* parse_command_line_with(LPCWSTR args, int* argc, BOOL escape_backslash, BOOL escape_quotes);
@@ -0,0 +1,829 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashmap.h"
+#include "index.h"
+#include "corpus.h"
+
+// Mirrors what symbols.exe does with the Win32 calls replaced by POSIX
+// ones, so it runs wherever GCC or Clang does. Results go to stdout and,
+// with --json, to a file.
+
+typedef struct Options {
+    CorpusOptions corpus;
+    uint32_t keys; // HashMap benchmark size
+    uint32_t queries;
+    uint32_t cold; // Lookups with the index evicted from the page cache
+    uint32_t repeat;
+    uint32_t threads;
+    uint32_t flags;
+    const char* dir;
+    const char* json;
+} Options;
+
+typedef struct Result {
+    const char* group;
+    char name[32];
+    double value;
+    const char* unit;
+} Result;
+
+#define MAX_RESULTS 128
+
+Result results[MAX_RESULTS];
+uint32_t result_count = 0;
+
+void report(const char* group, const char* name, double value, const char* unit) {
+    if (result_count < MAX_RESULTS) {
+        Result* result = &results[result_count++];
+        result->group = group;
+        snprintf(result->name, sizeof(result->name), "%s", name);
+        result->value = value;
+        result->unit = unit;
+    }
+    printf("  %-28s %14.3f %s\n", name, value, unit);
+}
+
+double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int double_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+double median(double* samples, uint32_t count) {
+    qsort(samples, count, sizeof(double), double_cmp);
+    return samples[count / 2];
+}
+
+// samples must be sorted
+double percentile(const double* samples, uint32_t count, double p) {
+    uint32_t ix = (uint32_t)(p * (count - 1) + 0.5);
+    return samples[ix];
+}
+
+void report_latency(const char* group, const char* prefix, double* samples, uint32_t count) {
+    static const double points[] = {0.5, 0.9, 0.99, 0.999};
+    static const char* const names[] = {"p50", "p90", "p99", "p999"};
+    char name[32];
+    qsort(samples, count, sizeof(double), double_cmp);
+    double total = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        total += samples[i];
+    }
+    for (uint32_t i = 0; i < 4; ++i) {
+        snprintf(name, sizeof(name), "%s_%s", prefix, names[i]);
+        report(group, name, percentile(samples, count, points[i]) / 1e3, "us");
+    }
+    snprintf(name, sizeof(name), "%s_max", prefix);
+    report(group, name, samples[count - 1] / 1e3, "us");
+    snprintf(name, sizeof(name), "%s_mean", prefix);
+    report(group, name, total / count / 1e3, "us");
+}
+
+typedef struct ParallelRange {
+    IndexTask task;
+    void* ctx;
+    uint32_t begin;
+    uint32_t end;
+} ParallelRange;
+
+uint32_t thread_count = 1;
+
+void* parallel_worker(void* param) {
+    ParallelRange* range = param;
+    range->task(range->ctx, range->begin, range->end);
+    return NULL;
+}
+
+#define MAX_THREADS 64
+
+// Same split as run_parallel in symbols.c
+void run_parallel(IndexTask task, void* ctx, uint32_t count, uint32_t grain) {
+    uint32_t threads = thread_count;
+    if (threads > count / grain) {
+        threads = count / grain;
+    }
+    if (threads <= 1) {
+        task(ctx, 0, count);
+        return;
+    }
+    ParallelRange ranges[MAX_THREADS];
+    pthread_t handles[MAX_THREADS];
+    bool started[MAX_THREADS] = {false};
+    for (uint32_t i = 0; i < threads; ++i) {
+        ranges[i].task = task;
+        ranges[i].ctx = ctx;
+        ranges[i].begin = (uint64_t)count * i / threads;
+        ranges[i].end = (uint64_t)count * (i + 1) / threads;
+    }
+    for (uint32_t i = 1; i < threads; ++i) {
+        if (pthread_create(&handles[i], NULL, parallel_worker, &ranges[i]) != 0) {
+            task(ctx, ranges[i].begin, ranges[i].end);
+            continue;
+        }
+        started[i] = true;
+    }
+    task(ctx, ranges[0].begin, ranges[0].end);
+    for (uint32_t i = 1; i < threads; ++i) {
+        if (started[i]) {
+            pthread_join(handles[i], NULL);
+        }
+    }
+}
+
+// Names of the corpus, each NUL terminated
+typedef struct KeySet {
+    char* data;
+    uint64_t* offsets;
+    uint32_t count;
+} KeySet;
+
+bool keys_create(KeySet* keys, const CorpusOptions* options, uint64_t first_id, uint32_t count) {
+    keys->data = malloc((uint64_t)count * CORPUS_NAME_MAX);
+    keys->offsets = malloc(count * sizeof(uint64_t));
+    keys->count = count;
+    if (keys->data == NULL || keys->offsets == NULL) {
+        return false;
+    }
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        keys->offsets[i] = pos;
+        pos += corpus_name(options, first_id + i, keys->data + pos) + 1;
+    }
+    return true;
+}
+
+void keys_free(KeySet* keys) {
+    free(keys->data);
+    free(keys->offsets);
+}
+
+const char* key_at(const KeySet* keys, uint32_t i) {
+    return keys->data + keys->offsets[i];
+}
+
+void bench_hashmap(const Options* options) {
+    printf("hashmap, %u keys\n", options->keys);
+    KeySet keys, misses;
+    uint64_t first = options->corpus.pool;
+    if (!keys_create(&keys, &options->corpus, first, options->keys) ||
+        !keys_create(&misses, &options->corpus, first + options->keys, options->keys)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    uint32_t* order = malloc(options->keys * sizeof(uint32_t));
+    uint64_t state = options->corpus.seed;
+    for (uint32_t i = 0; i < options->keys; ++i) {
+        order[i] = i;
+    }
+    for (uint32_t i = options->keys - 1; i > 0; --i) {
+        uint32_t j = rng_next(&state) % (i + 1);
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    double insert[options->repeat], reserved[options->repeat], find[options->repeat], miss[options->repeat];
+    double rehash[options->repeat], freeze[options->repeat], perfect[options->repeat];
+    // Hit and miss lookups in the chained and perfect frozen layouts
+    double frozen_find[2][2][options->repeat];
+    uint64_t found = 0;
+    uint32_t rehashes = 0;
+    for (uint32_t r = 0; r < options->repeat; ++r) {
+        // The same keys into a table sized for them up front
+        HashMap map;
+        HashMap_CreateWithCapacity(&map, keys.count);
+        double t = now();
+        for (uint32_t i = 0; i < keys.count; ++i) {
+            HashMap_Insert(&map, key_at(&keys, i), NULL);
+        }
+        reserved[r] = (now() - t) / keys.count;
+        HashMap_Free(&map);
+
+        HashMap_Create(&map);
+        t = now();
+        for (uint32_t i = 0; i < keys.count; ++i) {
+            HashMap_Insert(&map, key_at(&keys, i), NULL);
+        }
+        insert[r] = (now() - t) / keys.count;
+        rehashes = map.rehash_count;
+        t = now();
+        for (uint32_t i = 0; i < keys.count; ++i) {
+            found += HashMap_Find(&map, key_at(&keys, order[i])) != NULL;
+        }
+        find[r] = (now() - t) / keys.count;
+        t = now();
+        for (uint32_t i = 0; i < misses.count; ++i) {
+            found += HashMap_Find(&map, key_at(&misses, i)) != NULL;
+        }
+        miss[r] = (now() - t) / misses.count;
+        t = now();
+        HashMap_Rehash(&map);
+        rehash[r] = (now() - t) / keys.count;
+        for (uint32_t layout = 0; layout < 2; ++layout) {
+            HashMapFrozen frozen;
+            t = now();
+            bool success = layout == 0 ? HashMap_Freeze(&map, &frozen) : HashMap_FreezePerfectShards(&map, 1, run_parallel, &frozen);
+            double* time = layout == 0 ? freeze : perfect;
+            time[r] = success ? (now() - t) / keys.count : 0;
+            frozen_find[layout][0][r] = 0;
+            frozen_find[layout][1][r] = 0;
+            if (!success) {
+                continue;
+            }
+            uint32_t frozen_found = 0;
+            t = now();
+            for (uint32_t i = 0; i < keys.count; ++i) {
+                frozen_found += HashMap_FrozenFind(&frozen, key_at(&keys, order[i])) != NULL;
+            }
+            frozen_find[layout][0][r] = (now() - t) / keys.count;
+            t = now();
+            for (uint32_t i = 0; i < misses.count; ++i) {
+                frozen_found += HashMap_FrozenFind(&frozen, key_at(&misses, i)) != NULL;
+            }
+            frozen_find[layout][1][r] = (now() - t) / misses.count;
+            if (frozen_found != keys.count) {
+                fprintf(stderr, "HashMap_FrozenFind found %u keys, expected %u\n", frozen_found, keys.count);
+            }
+            HashMap_FreeFrozen(&frozen);
+        }
+        HashMap_Free(&map);
+    }
+    if (found != (uint64_t)keys.count * options->repeat) {
+        fprintf(stderr, "HashMap_Find found %llu keys, expected %llu\n", (unsigned long long)found,
+                (unsigned long long)keys.count * options->repeat);
+    }
+    report("hashmap", "insert", median(insert, options->repeat), "ns/key");
+    report("hashmap", "insert_rehashes", rehashes, "");
+    report("hashmap", "insert_reserved", median(reserved, options->repeat), "ns/key");
+    report("hashmap", "find_hit", median(find, options->repeat), "ns/key");
+    report("hashmap", "find_miss", median(miss, options->repeat), "ns/key");
+    report("hashmap", "rehash", median(rehash, options->repeat), "ns/key");
+    report("hashmap", "freeze", median(freeze, options->repeat), "ns/key");
+    report("hashmap", "freeze_perfect", median(perfect, options->repeat), "ns/key");
+    report("hashmap", "frozen_chained_hit", median(frozen_find[0][0], options->repeat), "ns/key");
+    report("hashmap", "frozen_chained_miss", median(frozen_find[0][1], options->repeat), "ns/key");
+    report("hashmap", "frozen_perfect_hit", median(frozen_find[1][0], options->repeat), "ns/key");
+    report("hashmap", "frozen_perfect_miss", median(frozen_find[1][1], options->repeat), "ns/key");
+    free(order);
+    keys_free(&keys);
+    keys_free(&misses);
+}
+
+// Same layout as write_index in symbols.c
+bool write_output(const IndexOutput* index, int fd) {
+    static const char padding[INDEX_SECTION_ALIGN] = {0};
+    uint64_t written = 0;
+    for (uint32_t i = 0; i <= index->header.section_count; ++i) {
+        const unsigned char* data;
+        uint64_t start, size;
+        if (i == 0) {
+            data = (const unsigned char*)&index->header;
+            start = 0;
+            size = sizeof(IndexHeader);
+        } else {
+            data = index->data[i - 1];
+            start = index->header.sections[i - 1].offset;
+            size = index->header.sections[i - 1].size;
+        }
+        if (written < start) {
+            if (write(fd, padding, start - written) != (ssize_t)(start - written)) {
+                return false;
+            }
+            written = start;
+        }
+        uint64_t pos = 0;
+        while (pos < size) {
+            ssize_t w = write(fd, data + pos, size - pos);
+            if (w <= 0) {
+                return false;
+            }
+            pos += w;
+        }
+        written += size;
+    }
+    return ftruncate(fd, written) == 0;
+}
+
+typedef struct Mapping {
+    void* data;
+    uint64_t size;
+} Mapping;
+
+bool read_output(const char* path, Mapping* m, Index* index) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    m->data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(IndexHeader)) {
+        m->size = st.st_size;
+        m->data = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m->data == MAP_FAILED) {
+            m->data = NULL;
+        }
+    }
+    close(fd);
+    if (m->data == NULL) {
+        return false;
+    }
+    if (!index_open(index, m->data, m->size)) {
+        munmap(m->data, m->size);
+        return false;
+    }
+    return true;
+}
+
+void evict(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+const char* const section_names[] = {
+    NULL, "symbols", "paths", "sorted", "trigrams", "undecorated", "delta", "blocks", "filter"
+};
+
+// Parses and builds the index, returns false if any step failed
+bool bench_create(const Options* options, const Corpus* sources, uint32_t kinds, const char* path) {
+    printf("create, %u thread%s\n", thread_count, thread_count == 1 ? "" : "s");
+    uint64_t input = 0;
+    for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+        if (kinds & (1 << kind)) {
+            input += sources[kind].size;
+        }
+    }
+    double parse[options->repeat], build[options->repeat], write_time[options->repeat];
+    uint32_t rehashes = 0;
+    IndexOutput out;
+    for (uint32_t r = 0; r < options->repeat; ++r) {
+        IndexBuilder builder;
+        if (!index_builder_init(&builder)) {
+            return false;
+        }
+        builder.flags = options->flags;
+        builder.parallel = run_parallel;
+        double t = now();
+        for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+            if ((kinds & (1 << kind)) && !index_parse_yaml(&builder, sources[kind].data, sources[kind].size, 1 << kind)) {
+                index_builder_free(&builder);
+                return false;
+            }
+        }
+        parse[r] = now() - t;
+        rehashes = 0;
+        for (uint32_t s = 0; s < INDEX_SHARD_COUNT; ++s) {
+            rehashes += builder.symbols[s].rehash_count;
+        }
+        t = now();
+        bool success = index_build(&builder, &out);
+        build[r] = now() - t;
+        index_builder_free(&builder);
+        if (!success) {
+            return false;
+        }
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            index_output_free(&out);
+            return false;
+        }
+        t = now();
+        success = write_output(&out, fd);
+        write_time[r] = now() - t;
+        success = fsync(fd) == 0 && success;
+        close(fd);
+        if (r + 1 < options->repeat) {
+            index_output_free(&out);
+        }
+        if (!success) {
+            return false;
+        }
+    }
+    double parse_ms = median(parse, options->repeat) / 1e6;
+    report("create", "input", input / 1048576.0, "MiB");
+    report("create", "parse", parse_ms, "ms");
+    report("create", "parse_throughput", input / 1e6 / parse_ms, "GB/s");
+    report("create", "parse_rehashes", rehashes, "");
+    report("create", "build", median(build, options->repeat) / 1e6, "ms");
+    report("create", "write", median(write_time, options->repeat) / 1e6, "ms");
+    report("create", "index_size", out.header.size / 1048576.0, "MiB");
+    for (uint32_t i = 0; i < out.header.section_count; ++i) {
+        uint32_t type = out.header.sections[i].type;
+        if (type < sizeof(section_names) / sizeof(section_names[0])) {
+            char name[32];
+            snprintf(name, sizeof(name), "section_%s", section_names[type]);
+            report("create", name, out.header.sections[i].size / 1048576.0, "MiB");
+        }
+    }
+    index_output_free(&out);
+    return true;
+}
+
+// Looks up symbol and writes the short names, like find_symbols
+uint64_t query(const Index* index, const char* symbol, char* out) {
+    IndexHit hit;
+    index_lookup(index, symbol, &hit);
+    uint64_t size = 0;
+    for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+        uint32_t last = UINT32_MAX;
+        IndexHitIterator it;
+        uint32_t id;
+        index_hit_begin(&hit, &it);
+        while (index_hit_next(&it, &id)) {
+            uint32_t len, path_kinds;
+            const char* path = index_path(index, id, &len, &path_kinds);
+            if (path == NULL || !(path_kinds & (1 << kind))) {
+                continue;
+            }
+            uint32_t basename = index_path_basename(index, id);
+            if (basename == last) {
+                continue;
+            }
+            last = basename;
+            const char* base = index_basename(path, len);
+            memcpy(out + size, base, path + len - base);
+            size += path + len - base;
+            out[size++] = '\n';
+        }
+    }
+    return size;
+}
+
+// Every key of the prefix, as find_matching does for --prefix
+uint64_t query_prefix(const Index* index, const char* prefix) {
+    IndexCursor cursor;
+    IndexHit hit;
+    uint64_t count = 0;
+    index_match_prefix(index, prefix, &cursor);
+    while (index_next(&cursor, &hit) != NULL) {
+        ++count;
+    }
+    return count;
+}
+
+bool bench_read(const Options* options, const char* path, uint64_t next_id) {
+    printf("read\n");
+    double open_time[options->repeat];
+    Mapping m;
+    Index index;
+    for (uint32_t r = 0; r < options->repeat; ++r) {
+        double t = now();
+        if (!read_output(path, &m, &index)) {
+            return false;
+        }
+        open_time[r] = now() - t;
+        munmap(m.data, m.size);
+    }
+    report("read", "open", median(open_time, options->repeat) / 1e3, "us");
+    if (!read_output(path, &m, &index)) {
+        return false;
+    }
+
+    // Pool names, drawn with the same skew as the corpus, other names and
+    // names that are not in the index
+    const CorpusOptions* corpus = &options->corpus;
+    uint64_t state = corpus->seed * 17;
+    char* names = malloc((uint64_t)options->queries * CORPUS_NAME_MAX);
+    double* samples = malloc(options->queries * sizeof(double));
+    char* out = malloc(1 << 24);
+    uint32_t hits = 0;
+    uint64_t output = 0;
+    for (uint32_t i = 0; i < options->queries; ++i) {
+        uint32_t pick = rng_next(&state) % 20;
+        uint64_t id;
+        double u = rng_unit(&state);
+        if (pick < 9) {
+            id = (uint64_t)(corpus->pool * u * u * u);
+        } else if (pick < 18) {
+            id = corpus->pool + (uint64_t)((next_id - corpus->pool) * u);
+        } else {
+            id = next_id + rng_next(&state) % 1000000;
+        }
+        corpus_name(corpus, id, names + (uint64_t)i * CORPUS_NAME_MAX);
+    }
+    for (uint32_t i = 0; i < options->queries; ++i) {
+        const char* name = names + (uint64_t)i * CORPUS_NAME_MAX;
+        double t = now();
+        uint64_t size = query(&index, name, out);
+        samples[i] = now() - t;
+        hits += size > 0;
+        output += size;
+    }
+    report("query", "queries", options->queries, "");
+    report("query", "hits", hits, "");
+    report("query", "output", output / 1024.0, "KiB");
+    report_latency("query", "lookup", samples, options->queries);
+
+    uint32_t prefixes = options->queries < 1000 ? options->queries : 1000;
+    uint64_t matched = 0;
+    for (uint32_t i = 0; i < prefixes; ++i) {
+        char prefix[8];
+        const char* name = names + (uint64_t)i * CORPUS_NAME_MAX;
+        // The word and the first digits of the id
+        uint32_t len = strlen(name) < 6 ? strlen(name) : 6;
+        memcpy(prefix, name, len);
+        prefix[len] = '\0';
+        double t = now();
+        matched += query_prefix(&index, prefix);
+        samples[i] = now() - t;
+    }
+    report("query", "prefix_keys", matched / (double)prefixes, "keys/query");
+    report_latency("query", "prefix", samples, prefixes);
+    munmap(m.data, m.size);
+
+    // Opening the index and the first lookup, which is what a single
+    // symbols invocation pays when the index is not cached
+    if (options->cold > 0) {
+        uint32_t cold = options->cold < options->queries ? options->cold : options->queries;
+        for (uint32_t i = 0; i < cold; ++i) {
+            evict(path);
+            double t = now();
+            if (!read_output(path, &m, &index)) {
+                return false;
+            }
+            query(&index, names + (uint64_t)i * CORPUS_NAME_MAX, out);
+            samples[i] = now() - t;
+            munmap(m.data, m.size);
+        }
+        report_latency("query", "cold", samples, cold);
+    }
+    free(names);
+    free(samples);
+    free(out);
+    return true;
+}
+
+// Substrings of names in the index and of names that are not, found with
+// the trigram section and by checking every key
+bool bench_substring(const Options* options, const char* path, uint64_t next_id) {
+    Mapping m;
+    Index index;
+    if (!read_output(path, &m, &index)) {
+        return false;
+    }
+    printf("substring\n");
+    uint32_t count = options->queries < 200 ? options->queries : 200;
+    uint64_t state = options->corpus.seed * 29;
+    double* samples[2] = {malloc(count * sizeof(double)), malloc(count * sizeof(double))};
+    char name[CORPUS_NAME_MAX + 1];
+    char needle[16];
+    // Short needles match many keys, longer ones match a few
+    const uint32_t lengths[] = {4, 8};
+    for (uint32_t l = 0; l < 2; ++l) {
+        uint64_t matched = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t id = rng_next(&state) % next_id;
+            if (i % 10 == 9) {
+                id = next_id + rng_next(&state) % 1000000;
+            }
+            uint32_t len = corpus_name(&options->corpus, id, name);
+            uint32_t n = lengths[l] < len ? lengths[l] : len;
+            uint32_t offset = rng_next(&state) % (len - n + 1);
+            memcpy(needle, name + offset, n);
+            needle[n] = '\0';
+            uint32_t found[2];
+            for (uint32_t k = 0; k < 2; ++k) {
+                const char** keys;
+                double t = now();
+                bool ok = k == 0 ? index_substring(&index, needle, &keys, &found[k])
+                                 : index_substring_scan(&index, needle, &keys, &found[k]);
+                samples[k][i] = now() - t;
+                free(keys);
+                if (!ok) {
+                    fprintf(stderr, "Substring search failed for '%s'\n", needle);
+                    return false;
+                }
+            }
+            if (found[0] != found[1]) {
+                fprintf(stderr, "'%s': %u keys from the trigrams, %u from the scan\n",
+                        needle, found[0], found[1]);
+            }
+            matched += found[1];
+        }
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "keys_%u", lengths[l]);
+        report("substring", prefix, matched / (double)count, "keys/query");
+        snprintf(prefix, sizeof(prefix), "trigram_%u", lengths[l]);
+        report_latency("substring", prefix, samples[0], count);
+        snprintf(prefix, sizeof(prefix), "scan_%u", lengths[l]);
+        report_latency("substring", prefix, samples[1], count);
+    }
+    munmap(m.data, m.size);
+    free(samples[0]);
+    free(samples[1]);
+    return true;
+}
+
+// Names that are not in the index, the case the filter is for
+bool bench_filter(const Options* options, const char* path, uint64_t next_id) {
+    Mapping m;
+    Index index;
+    if (!read_output(path, &m, &index)) {
+        return false;
+    }
+    if (index.filter == NULL) {
+        munmap(m.data, m.size);
+        return true;
+    }
+    printf("filter\n");
+    uint32_t count = options->queries < 100000 ? 100000 : options->queries;
+    char* names = malloc((uint64_t)count * CORPUS_NAME_MAX);
+    double* samples = malloc(count * sizeof(double));
+    uint32_t passed = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        char* name = names + (uint64_t)i * CORPUS_NAME_MAX;
+        corpus_name(&options->corpus, next_id + i, name);
+        passed += index_may_contain(&index, name, strlen(name));
+    }
+    uint32_t size;
+    index_section(&index, INDEX_SECTION_FILTER, &size);
+    report("filter", "size", size / 1024.0, "KiB");
+    report("filter", "bits_per_key", size * 8.0 / index.key_count, "bits");
+    report("filter", "false_positives", 100.0 * passed / count, "%");
+
+    // The same misses with the filter ignored, for what it saves
+    Index unfiltered = index;
+    unfiltered.filter = NULL;
+    const Index* indexes[] = {&index, &unfiltered};
+    const char* prefixes[] = {"miss", "miss_unfiltered"};
+    uint32_t queries = options->queries < count ? options->queries : count;
+    for (uint32_t k = 0; k < 2; ++k) {
+        uint32_t found = 0;
+        for (uint32_t i = 0; i < queries; ++i) {
+            IndexHit hit;
+            double t = now();
+            found += index_lookup(indexes[k], names + (uint64_t)i * CORPUS_NAME_MAX, &hit);
+            samples[i] = now() - t;
+        }
+        if (found != 0) {
+            fprintf(stderr, "%u names found that are not in the index\n", found);
+        }
+        report_latency("filter", prefixes[k], samples, queries);
+    }
+    munmap(m.data, m.size);
+
+    if (options->cold > 0) {
+        uint32_t cold = options->cold < count ? options->cold : count;
+        for (uint32_t i = 0; i < cold; ++i) {
+            evict(path);
+            double t = now();
+            if (!read_output(path, &m, &index)) {
+                return false;
+            }
+            IndexHit hit;
+            index_lookup(&index, names + (uint64_t)i * CORPUS_NAME_MAX, &hit);
+            samples[i] = now() - t;
+            munmap(m.data, m.size);
+        }
+        report_latency("filter", "miss_cold", samples, cold);
+    }
+    free(names);
+    free(samples);
+    return true;
+}
+
+void json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+        }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+bool write_json(const Options* options) {
+    FILE* f = fopen(options->json, "w");
+    if (f == NULL) {
+        return false;
+    }
+    const CorpusOptions* c = &options->corpus;
+    fprintf(f, "{\n  \"corpus\": {\"libraries\": %u, \"symbols\": %u, \"min_length\": %u, \"max_length\": %u, "
+               "\"duplication\": %g, \"pool\": %u, \"decorated\": %g, \"directories\": %u, \"seed\": %llu},\n",
+            c->libraries, c->symbols, c->min_length, c->max_length, c->duplication, c->pool, c->decorated,
+            c->directories, (unsigned long long)c->seed);
+    fprintf(f, "  \"threads\": %u,\n  \"flags\": %u,\n  \"results\": [", thread_count, options->flags);
+    for (uint32_t i = 0; i < result_count; ++i) {
+        fprintf(f, "%s\n    {\"group\": ", i == 0 ? "" : ",");
+        json_string(f, results[i].group);
+        fprintf(f, ", \"name\": ");
+        json_string(f, results[i].name);
+        fprintf(f, ", \"value\": %.6g, \"unit\": ", results[i].value);
+        json_string(f, results[i].unit);
+        fputc('}', f);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+void usage(void) {
+    fprintf(stderr, "Usage: bench [options]\n"
+                    "  --keys N          keys in the HashMap benchmarks, 0 skips them (1000000)\n"
+                    "  --queries N       lookups in the query benchmark (20000)\n"
+                    "  --cold N          lookups with the index evicted from the page cache (50)\n"
+                    "  --repeat N        runs of each step, the median is reported (5)\n"
+                    "  --threads N       build threads (processor count)\n"
+                    "  --flags N         IndexBuilder flags (11, as symbols.exe, add 4 for --compress)\n"
+                    "  --dir DIR         where to write the index (.)\n"
+                    "  --json FILE       also write the results as JSON\n");
+    corpus_usage();
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    corpus_defaults(&options.corpus);
+    options.keys = 1000000;
+    options.queries = 20000;
+    options.cold = 50;
+    options.repeat = 5;
+    options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    options.flags = INDEX_BUILD_TRIGRAMS | INDEX_BUILD_UNDECORATED | INDEX_BUILD_FILTER;
+    options.dir = ".";
+    options.json = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 == argc) {
+            usage();
+            return 1;
+        }
+        const char* name = argv[i];
+        const char* value = argv[++i];
+        int res = corpus_option(&options.corpus, name, value);
+        if (res > 0) {
+            continue;
+        }
+        char* end;
+        unsigned long n = strtoul(value, &end, 10);
+        bool number = end != value && *end == '\0' && n <= UINT32_MAX;
+        if (res == 0 && strcmp(name, "--dir") == 0) {
+            options.dir = value;
+        } else if (res == 0 && strcmp(name, "--json") == 0) {
+            options.json = value;
+        } else if (res == 0 && number && strcmp(name, "--keys") == 0) {
+            options.keys = n;
+        } else if (res == 0 && number && n > 0 && strcmp(name, "--queries") == 0) {
+            options.queries = n;
+        } else if (res == 0 && number && strcmp(name, "--cold") == 0) {
+            options.cold = n;
+        } else if (res == 0 && number && n > 0 && strcmp(name, "--repeat") == 0) {
+            options.repeat = n;
+        } else if (res == 0 && number && n > 0 && strcmp(name, "--threads") == 0) {
+            options.threads = n;
+        } else if (res == 0 && number && strcmp(name, "--flags") == 0) {
+            options.flags = n;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    thread_count = options.threads < MAX_THREADS ? options.threads : MAX_THREADS;
+
+    if (options.keys > 0) {
+        bench_hashmap(&options);
+    }
+
+    // Libraries and DLLs export many of the same names, as the import
+    // libraries of the DLLs do
+    Corpus sources[INDEX_KIND_COUNT] = {0};
+    uint64_t next_id = 0;
+    if (!corpus_generate(&options.corpus, 1, &next_id, &sources[0]) ||
+        !corpus_generate(&options.corpus, 2, &next_id, &sources[1])) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_index.bin", options.dir);
+    if (!bench_create(&options, sources, 3, path)) {
+        fprintf(stderr, "Could not create '%s'\n", path);
+        return 1;
+    }
+    for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+        corpus_free(&sources[kind]);
+    }
+    if (!bench_read(&options, path, next_id) || !bench_substring(&options, path, next_id) ||
+        !bench_filter(&options, path, next_id)) {
+        fprintf(stderr, "Could not read '%s'\n", path);
+        return 1;
+    }
+    unlink(path);
+    if (options.json != NULL && !write_json(&options)) {
+        fprintf(stderr, "Could not write '%s'\n", options.json);
+        return 1;
+    }
+    return 0;
+}
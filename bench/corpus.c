@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "corpus.h"
+
+const char* const words[] = {
+    "Create", "Open", "Close", "Read", "Write", "Get", "Set", "Query", "Reg", "Nt",
+    "Rtl", "Crypt", "Wsa", "Heap", "File", "Thread", "Process", "Window", "Message", "Device",
+    "str", "mem", "wcs", "_imp_", "__std", "vk", "gl", "D3D", "Dxgi", "Mf"
+};
+
+const char* const kind_extensions[] = {"lib", "dll", "obj"};
+
+const char* const directories[] = {"x64", "x86", "arm64", "arm", "onecore", "ucrt", "um", "shared"};
+
+// splitmix64
+uint64_t rng_next(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double rng_unit(uint64_t* state) {
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void corpus_defaults(CorpusOptions* options) {
+    options->libraries = 2000;
+    options->symbols = 300;
+    options->min_length = 8;
+    options->max_length = 64;
+    options->duplication = 0.3;
+    options->pool = 20000;
+    options->decorated = 0.2;
+    options->directories = 2;
+    options->seed = 1;
+}
+
+bool parse_number(const char* value, uint64_t max, uint64_t* out) {
+    char* end;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || n > max) {
+        return false;
+    }
+    *out = n;
+    return true;
+}
+
+bool parse_ratio(const char* value, double* out) {
+    char* end;
+    double d = strtod(value, &end);
+    if (end == value || *end != '\0' || !(d >= 0.0 && d <= 1.0)) {
+        return false;
+    }
+    *out = d;
+    return true;
+}
+
+int corpus_option(CorpusOptions* options, const char* name, const char* value) {
+    uint64_t n;
+    if (strcmp(name, "--duplication") == 0) {
+        return parse_ratio(value, &options->duplication) ? 1 : -1;
+    }
+    if (strcmp(name, "--decorated") == 0) {
+        return parse_ratio(value, &options->decorated) ? 1 : -1;
+    }
+    if (strcmp(name, "--seed") == 0) {
+        return parse_number(value, UINT64_MAX, &options->seed) ? 1 : -1;
+    }
+    uint32_t* field;
+    uint64_t min = 1;
+    uint64_t max = 1 << 24;
+    if (strcmp(name, "--libraries") == 0) {
+        field = &options->libraries;
+    } else if (strcmp(name, "--symbols") == 0) {
+        field = &options->symbols;
+    } else if (strcmp(name, "--min-length") == 0) {
+        field = &options->min_length;
+        max = CORPUS_NAME_MAX / 2;
+    } else if (strcmp(name, "--max-length") == 0) {
+        field = &options->max_length;
+        max = CORPUS_NAME_MAX / 2;
+    } else if (strcmp(name, "--pool") == 0) {
+        field = &options->pool;
+    } else if (strcmp(name, "--directories") == 0) {
+        field = &options->directories;
+        max = sizeof(directories) / sizeof(directories[0]);
+    } else {
+        return 0;
+    }
+    if (!parse_number(value, max, &n) || n < min) {
+        return -1;
+    }
+    *field = n;
+    if (options->max_length < options->min_length) {
+        options->max_length = options->min_length;
+    }
+    return 1;
+}
+
+void corpus_usage(void) {
+    CorpusOptions d;
+    corpus_defaults(&d);
+    fprintf(stderr,
+            "  --libraries N     libraries per kind (%u)\n"
+            "  --symbols N       average symbols per library (%u)\n"
+            "  --min-length N    shortest symbol name (%u)\n"
+            "  --max-length N    longest symbol name (%u)\n"
+            "  --duplication R   share of symbols from the shared pool (%.2f)\n"
+            "  --pool N          names in the shared pool (%u)\n"
+            "  --decorated R     share of MSVC decorated names (%.2f)\n"
+            "  --directories N   directories each file name occurs in (%u)\n"
+            "  --seed N          random seed (%llu)\n",
+            d.libraries, d.symbols, d.min_length, d.max_length, d.duplication, d.pool, d.decorated,
+            d.directories, (unsigned long long)d.seed);
+}
+
+// The name only depends on the seed and id, so every library that draws
+// an id from the pool gets the same name.
+uint32_t corpus_name(const CorpusOptions* options, uint64_t id, char* out) {
+    uint64_t state = options->seed ^ (id * 0xd6e8feb86659fd93ULL);
+    double u = rng_unit(&state);
+    uint32_t len = options->min_length + (uint32_t)((options->max_length - options->min_length) * u * u);
+    bool decorated = rng_unit(&state) < options->decorated;
+    char* p = out;
+    if (decorated) {
+        *p++ = '?';
+    }
+    const char* word = words[rng_next(&state) % (sizeof(words) / sizeof(words[0]))];
+    p += sprintf(p, "%s%llx", word, (unsigned long long)id);
+    char* end = out + len;
+    // Keeps the padding from running into the hex digits of the id
+    if (p < end) {
+        *p++ = '_';
+    }
+    while (p < end) {
+        uint64_t r = rng_next(&state);
+        for (uint32_t i = 0; i < 8 && p < end; ++i, r >>= 8) {
+            *p++ = 'a' + (r & 0xff) % 26;
+        }
+    }
+    if (decorated) {
+        // int __cdecl name(void*)
+        memcpy(p, "@@YAHPEAX@Z", 11);
+        p += 11;
+    }
+    *p = '\0';
+    return p - out;
+}
+
+bool corpus_reserve(Corpus* corpus, uint64_t size) {
+    if (corpus->capacity - corpus->size >= size) {
+        return true;
+    }
+    uint64_t capacity = corpus->capacity == 0 ? 1 << 20 : corpus->capacity;
+    while (capacity - corpus->size < size) {
+        capacity *= 2;
+    }
+    char* data = realloc(corpus->data, capacity);
+    if (data == NULL) {
+        return false;
+    }
+    corpus->data = data;
+    corpus->capacity = capacity;
+    return true;
+}
+
+bool corpus_generate(const CorpusOptions* options, uint32_t kind, uint64_t* next_id, Corpus* corpus) {
+    uint32_t kind_ix = kind == 1 ? 0 : kind == 2 ? 1 : 2;
+    uint64_t state = options->seed * 31 + kind;
+    char name[CORPUS_NAME_MAX];
+    if (*next_id < options->pool) {
+        *next_id = options->pool;
+    }
+    for (uint32_t lib = 0; lib < options->libraries; ++lib) {
+        const char* dir = directories[lib % options->directories];
+        uint32_t number = lib / options->directories;
+        const char* ext = kind_extensions[kind_ix];
+        if (!corpus_reserve(corpus, 256)) {
+            return false;
+        }
+        // scrape.py keys records by file name, and by full path when the
+        // file name is taken
+        char* p = corpus->data + corpus->size;
+        if (lib % options->directories == 0) {
+            p += sprintf(p, "lib%u.%s:\n", number, ext);
+        } else {
+            p += sprintf(p, "C:\\sdk\\%s\\lib%u.%s:\n", dir, number, ext);
+        }
+        p += sprintf(p, "  fullpath: C:\\sdk\\%s\\lib%u.%s\n  name: lib%u.%s\n  symbols:\n", dir, number, ext, number, ext);
+        corpus->size = p - corpus->data;
+
+        uint32_t count = (uint32_t)(options->symbols * (0.5 + rng_unit(&state)));
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t id;
+            if (options->pool > 0 && rng_unit(&state) < options->duplication) {
+                double u = rng_unit(&state);
+                id = (uint64_t)(options->pool * u * u * u);
+            } else {
+                id = (*next_id)++;
+            }
+            uint32_t len = corpus_name(options, id, name);
+            if (!corpus_reserve(corpus, len + 5)) {
+                return false;
+            }
+            memcpy(corpus->data + corpus->size, "  - ", 4);
+            memcpy(corpus->data + corpus->size + 4, name, len);
+            corpus->data[corpus->size + 4 + len] = '\n';
+            corpus->size += len + 5;
+        }
+    }
+    return true;
+}
+
+void corpus_free(Corpus* corpus) {
+    free(corpus->data);
+    corpus->data = NULL;
+    corpus->size = 0;
+    corpus->capacity = 0;
+}
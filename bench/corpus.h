@@ -0,0 +1,51 @@
+#ifndef CORPUS_H_00
+#define CORPUS_H_00
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deterministic source files in the format scrape.py writes. The same
+// options and seed always give the same bytes.
+typedef struct CorpusOptions {
+    uint32_t libraries; // Per kind
+    uint32_t symbols; // Average per library
+    uint32_t min_length;
+    uint32_t max_length; // Name lengths are skewed towards min_length
+    double duplication; // Share of symbols drawn from the shared pool
+    uint32_t pool; // Names in the shared pool, drawn with a skew so a few occur in most libraries
+    double decorated; // Share of names with MSVC decoration
+    uint32_t directories; // Each file name occurs once per directory
+    uint64_t seed;
+} CorpusOptions;
+
+typedef struct Corpus {
+    char* data;
+    uint64_t size;
+    uint64_t capacity;
+} Corpus;
+
+void corpus_defaults(CorpusOptions* options);
+
+// Sets the option of a --name value pair. Returns 1 on success, 0 if name
+// is not a corpus option and -1 if value is not valid.
+int corpus_option(CorpusOptions* options, const char* name, const char* value);
+
+void corpus_usage(void);
+
+// Symbol names are numbered, ids below options->pool are the shared pool.
+// Writes at most CORPUS_NAME_MAX bytes and returns the length.
+#define CORPUS_NAME_MAX 256
+uint32_t corpus_name(const CorpusOptions* options, uint64_t id, char* out);
+
+// Appends the libraries of kind (1 lib, 2 dll, 4 object) to corpus.
+// Unique names are numbered from *next_id, which is advanced past them.
+bool corpus_generate(const CorpusOptions* options, uint32_t kind, uint64_t* next_id, Corpus* corpus);
+
+void corpus_free(Corpus* corpus);
+
+uint64_t rng_next(uint64_t* state);
+
+// Uniform in [0, 1)
+double rng_unit(uint64_t* state);
+
+#endif
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+#include "corpus.h"
+
+// Writes the sources symbols would read from index\, one file per kind
+int main(int argc, char** argv) {
+    CorpusOptions options;
+    corpus_defaults(&options);
+    const char* dir = ".";
+    uint32_t kinds = 3;
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 == argc) {
+            fprintf(stderr, "Missing value for '%s'\n", argv[i]);
+            return 1;
+        }
+        const char* name = argv[i];
+        const char* value = argv[++i];
+        int res = corpus_option(&options, name, value);
+        if (res < 0) {
+            fprintf(stderr, "Invalid value '%s' for '%s'\n", value, name);
+            return 1;
+        }
+        if (res > 0) {
+            continue;
+        }
+        if (strcmp(name, "--out") == 0) {
+            dir = value;
+        } else if (strcmp(name, "--kinds") == 0) {
+            kinds = 0;
+            for (const char* k = value; *k != '\0'; ++k) {
+                kinds |= *k == 'l' ? 1 : *k == 'd' ? 2 : *k == 'o' ? 4 : 0;
+            }
+        } else {
+            fprintf(stderr, "Usage: gen [options]\n"
+                            "  --out DIR         where to write symbols_*.yaml (.)\n"
+                            "  --kinds [ldo]     lib, dll and object sources to write (ld)\n");
+            corpus_usage();
+            return 1;
+        }
+    }
+    static const char* const files[] = {"symbols_lib.yaml", "symbols_dll.yaml", "symbols_obj.yaml"};
+    uint64_t next_id = 0;
+    for (uint32_t kind = 0; kind < 3; ++kind) {
+        if (!(kinds & (1 << kind))) {
+            continue;
+        }
+        Corpus corpus = {0};
+        if (!corpus_generate(&options, 1 << kind, &next_id, &corpus)) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[kind]);
+        FILE* f = fopen(path, "wb");
+        if (f == NULL || fwrite(corpus.data, 1, corpus.size, f) != corpus.size || fclose(f) != 0) {
+            fprintf(stderr, "Could not write '%s'\n", path);
+            return 1;
+        }
+        printf("%s: %llu bytes\n", path, (unsigned long long)corpus.size);
+        corpus_free(&corpus);
+    }
+    return 0;
+}
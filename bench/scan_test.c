@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+#include "undname.h"
+
+// Builds small archives, DLLs and objects in memory and checks what the
+// scanners find in them, and in every truncated and some mutated copies,
+// then checks the names undecorate gives for some symbols.
+// Files given on the command line are scanned and their symbols printed.
+
+typedef struct Buffer {
+    unsigned char data[4096];
+    uint32_t size;
+} Buffer;
+
+typedef struct Fixture {
+    const char* name;
+    bool (*scan)(const void* data, uint64_t size, ScanSymbolFn add, void* ctx);
+    Buffer file;
+    const char* expected[8]; // NULL terminated
+} Fixture;
+
+typedef struct Found {
+    char names[8][64];
+    uint32_t count;
+    bool overflow;
+} Found;
+
+uint32_t failures = 0;
+
+void put(Buffer* b, uint32_t at, const void* data, uint32_t len) {
+    memcpy(b->data + at, data, len);
+    if (at + len > b->size) {
+        b->size = at + len;
+    }
+}
+
+void put_u16(Buffer* b, uint32_t at, uint32_t v) {
+    unsigned char p[2] = {v, v >> 8};
+    put(b, at, p, 2);
+}
+
+void put_u32(Buffer* b, uint32_t at, uint32_t v) {
+    unsigned char p[4] = {v, v >> 8, v >> 16, v >> 24};
+    put(b, at, p, 4);
+}
+
+void put_be(Buffer* b, uint32_t at, uint64_t v, uint32_t width) {
+    for (uint32_t i = 0; i < width; ++i) {
+        b->data[at + i] = v >> (8 * (width - 1 - i));
+    }
+    if (at + width > b->size) {
+        b->size = at + width;
+    }
+}
+
+// Appends each name with its NUL, returns the end
+uint32_t put_names(Buffer* b, uint32_t at, const char* const* names) {
+    for (; *names != NULL; ++names) {
+        put(b, at, *names, strlen(*names) + 1);
+        at += strlen(*names) + 1;
+    }
+    return at;
+}
+
+uint32_t name_count(const char* const* names) {
+    uint32_t count = 0;
+    while (names[count] != NULL) {
+        ++count;
+    }
+    return count;
+}
+
+// A linker member in the MSVC "/" form (width 4) or GNU "/SYM64/" form,
+// with every symbol in the one member that follows it
+void make_archive(Fixture* f, uint32_t width) {
+    Buffer* b = &f->file;
+    put(b, 0, "!<arch>\n", 8);
+    char header[61];
+    uint32_t count = name_count(f->expected);
+    uint32_t size = width + count * width;
+    for (uint32_t i = 0; i < count; ++i) {
+        size += strlen(f->expected[i]) + 1;
+    }
+    // Members start at even offsets
+    uint32_t member = 68 + size + (size & 1);
+    snprintf(header, sizeof(header), "%-16s%-12s%-6s%-6s%-8s%-10u`\n", width == 4 ? "/" : "/SYM64/", "0", "0", "0", "0",
+             size);
+    put(b, 8, header, 60);
+    put_be(b, 68, count, width);
+    for (uint32_t i = 0; i < count; ++i) {
+        put_be(b, 68 + width + i * width, member, width);
+    }
+    put_names(b, 68 + width + count * width, f->expected);
+    if (size & 1) {
+        put(b, 68 + size, "\n", 1);
+    }
+    snprintf(header, sizeof(header), "%-16s%-12s%-6s%-6s%-8s%-10u`\n", "a.o/", "0", "0", "0", "644", 4);
+    put(b, member, header, 60);
+    put(b, member + 60, "data", 4);
+}
+
+// One section at file offset 0x200 and rva 0x1000 holding the export
+// directory and its tables. The last function is only exported by
+// ordinal, so it has no name to find.
+void make_dll(Fixture* f, bool pe32plus) {
+    Buffer* b = &f->file;
+    uint32_t directories = pe32plus ? 108 : 92;
+    uint32_t optional_size = directories + 4 + 16 * 8;
+    put(b, 0, "MZ", 2);
+    put_u32(b, 0x3c, 0x40);
+    put(b, 0x40, "PE\0\0", 4);
+    put_u16(b, 0x44, pe32plus ? 0x8664 : 0x14c);
+    put_u16(b, 0x46, 1);
+    put_u16(b, 0x54, optional_size);
+    put_u16(b, 0x56, pe32plus ? 0x2022 : 0x2102);
+    uint32_t optional = 0x58;
+    put_u16(b, optional, pe32plus ? 0x20b : 0x10b);
+    put_u32(b, optional + 32, 0x1000);
+    put_u32(b, optional + 36, 0x200);
+    put_u32(b, optional + 56, 0x2000);
+    put_u32(b, optional + 60, 0x200);
+    put_u32(b, optional + directories, 16);
+    put_u32(b, optional + directories + 4, 0x1000);
+
+    uint32_t count = name_count(f->expected);
+    uint32_t functions = 40;
+    uint32_t names = functions + 4 * (count + 1);
+    uint32_t ordinals = names + 4 * count;
+    uint32_t strings = ordinals + 2 * count;
+    put(b, 0x200 + strings, "test.dll", 9);
+    put_u32(b, 0x200 + 12, 0x1000 + strings);
+    strings += 9;
+    put_u32(b, 0x200 + 16, 1);
+    put_u32(b, 0x200 + 20, count + 1);
+    put_u32(b, 0x200 + 24, count);
+    put_u32(b, 0x200 + 28, 0x1000 + functions);
+    put_u32(b, 0x200 + 32, 0x1000 + names);
+    put_u32(b, 0x200 + 36, 0x1000 + ordinals);
+    for (uint32_t i = 0; i <= count; ++i) {
+        put_u32(b, 0x200 + functions + 4 * i, 0x1800 + 16 * i);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        put_u32(b, 0x200 + names + 4 * i, 0x1000 + strings);
+        put_u16(b, 0x200 + ordinals + 2 * i, i);
+        put(b, 0x200 + strings, f->expected[i], strlen(f->expected[i]) + 1);
+        strings += strlen(f->expected[i]) + 1;
+    }
+    put_u32(b, optional + directories + 8, strings);
+    uint32_t section = optional + optional_size;
+    put(b, section, ".edata\0\0", 8);
+    put_u32(b, section + 8, strings);
+    put_u32(b, section + 12, 0x1000);
+    put_u32(b, section + 16, strings);
+    put_u32(b, section + 20, 0x200);
+    put_u32(b, section + 36, 0x40000040);
+}
+
+// Symbol table of a regular or /bigobj object. Short names are stored
+// inline, longer ones in the string table. Names scrape.py excluded are
+// mixed in, and the first symbol has an auxiliary record that looks like
+// a name.
+void make_object(Fixture* f, bool bigobj) {
+    static const unsigned char bigobj_class[16] = {
+        0xc7, 0xa1, 0xba, 0xd1, 0xee, 0xba, 0xa9, 0x4b, 0xaf, 0x20, 0xfa, 0xf6, 0x6a, 0xa4, 0xdc, 0xb8
+    };
+    static const char* const excluded[] = {"@comp.id", ".text$mn", ".debug$S", NULL};
+    Buffer* b = &f->file;
+    uint32_t symbol_size = bigobj ? 20 : 18;
+    uint32_t table = bigobj ? 56 : 20;
+    uint32_t count = name_count(f->expected) + name_count(excluded) + 1;
+    if (bigobj) {
+        put_u16(b, 0, 0);
+        put_u16(b, 2, 0xffff);
+        put_u16(b, 4, 2);
+        put_u16(b, 6, 0x8664);
+        put(b, 12, bigobj_class, 16);
+        put_u32(b, 48, table);
+        put_u32(b, 52, count);
+    } else {
+        put_u16(b, 0, 0x8664);
+        put_u32(b, 8, table);
+        put_u32(b, 12, count);
+    }
+    uint32_t strings = table + count * symbol_size;
+    uint32_t string_end = strings + 4;
+    uint32_t symbol = table;
+    for (uint32_t list = 0; list < 2; ++list) {
+        const char* const* names = list == 0 ? f->expected : excluded;
+        for (; *names != NULL; ++names) {
+            uint32_t len = strlen(*names);
+            memset(b->data + symbol, 0, symbol_size);
+            if (len <= 8) {
+                put(b, symbol, *names, len);
+            } else {
+                put_u32(b, symbol, 0);
+                put_u32(b, symbol + 4, string_end - strings);
+                put(b, string_end, *names, len + 1);
+                string_end += len + 1;
+            }
+            put(b, symbol + symbol_size - 2, "\x02", 1);
+            if (symbol == table) {
+                // The auxiliary record follows
+                b->data[symbol + symbol_size - 1] = 1;
+                put(b, symbol + symbol_size, "auxdata\0", 8);
+                symbol += symbol_size;
+            }
+            symbol += symbol_size;
+        }
+    }
+    put_u32(b, strings, string_end - strings);
+    b->size = string_end;
+}
+
+bool collect(void* ctx, const char* name, uint32_t len) {
+    Found* found = ctx;
+    if (found->count == 8 || len >= 64) {
+        found->overflow = true;
+        return false;
+    }
+    memcpy(found->names[found->count], name, len);
+    found->names[found->count++][len] = '\0';
+    return true;
+}
+
+// Runs the scanner on an exact size copy, so reads past the end are
+// caught by ASan
+bool scan_copy(const Fixture* f, const unsigned char* data, uint32_t size, Found* found) {
+    unsigned char* copy = malloc(size + 1);
+    memcpy(copy, data, size);
+    memset(found, 0, sizeof(Found));
+    bool result = f->scan(copy, size, collect, found);
+    free(copy);
+    return result;
+}
+
+// Every name found must be the expected one at its position
+bool prefix_of_expected(const Fixture* f, const Found* found) {
+    for (uint32_t i = 0; i < found->count; ++i) {
+        if (f->expected[i] == NULL || strcmp(f->expected[i], found->names[i]) != 0) {
+            return false;
+        }
+    }
+    return !found->overflow;
+}
+
+void check(bool ok, const Fixture* f, const char* what, uint32_t size) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s: %s (size %u)\n", f->name, what, size);
+        ++failures;
+    }
+}
+
+void run_fixture(Fixture* f) {
+    Found found;
+    bool result = scan_copy(f, f->file.data, f->file.size, &found);
+    check(result && found.count == name_count(f->expected) && prefix_of_expected(f, &found), f, "full file", f->file.size);
+    for (uint32_t size = 0; size < f->file.size; ++size) {
+        scan_copy(f, f->file.data, size, &found);
+        check(prefix_of_expected(f, &found), f, "truncated copy found other names", size);
+    }
+    // Single byte changes may find other names, but must stay in bounds
+    uint64_t state = 1;
+    unsigned char mutated[sizeof(f->file.data)];
+    for (uint32_t i = 0; i < 20000; ++i) {
+        memcpy(mutated, f->file.data, f->file.size);
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        mutated[(state >> 33) % f->file.size] = state >> 13;
+        scan_copy(f, mutated, f->file.size, &found);
+    }
+    printf("%-14s %4u bytes, %u names\n", f->name, f->file.size, name_count(f->expected));
+}
+
+typedef struct Undecorated {
+    const char* symbol;
+    const char* expected; // NULL if it is not undecorated
+    uint32_t name_offset;
+} Undecorated;
+
+void run_undecorate(void) {
+    static const Undecorated cases[] = {
+        {"?foo@bar@@YAXH@Z", "bar::foo", 5},
+        {"?f@@YAHXZ", "f", 0},
+        {"??0Widget@ui@@QEAA@XZ", "ui::Widget::Widget", 12},
+        {"??1Widget@@QEAA@XZ", "Widget::~Widget", 8},
+        {"??4Widget@@QEAAAEAV0@AEBV0@@Z", "Widget::operator=", 8},
+        {"??_GWidget@@UEAAPEAXI@Z", "Widget::`scalar deleting destructor'", 8},
+        {"?get@0@@YAXXZ", "get::get", 5},
+        {"?x@?A0x1f2e@@YAXXZ", "`anonymous namespace'::x", 23},
+        // The anonymous namespace takes back reference 2, so 3 is z
+        {"?x@y@?A0xab@z@w@3@@", "z::w::z::`anonymous namespace'::y::x", 35},
+        {"?x@?A0xab@1@@", "`anonymous namespace'::`anonymous namespace'::x", 46},
+        {"?x@y@5@@", NULL, 0},
+        {"?x@?A0xab", NULL, 0},
+        {"??$max@H@@YAHHH@Z", NULL, 0},
+        {"main", NULL, 0},
+    };
+    for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const Undecorated* c = &cases[i];
+        char out[256];
+        uint32_t name_offset = 0;
+        uint32_t len = undecorate(c->symbol, strlen(c->symbol), out, sizeof(out), &name_offset);
+        bool ok = c->expected == NULL ? len == 0 :
+                  len == strlen(c->expected) && memcmp(out, c->expected, len) == 0 && name_offset == c->name_offset;
+        // A name that does not fit is not undecorated
+        if (ok && len > 0) {
+            ok = undecorate(c->symbol, strlen(c->symbol), out, len - 1, &name_offset) == 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "FAIL undecorate %s: %.*s\n", c->symbol, (int)len, out);
+            ++failures;
+        }
+    }
+    printf("%-14s %4u symbols\n", "undecorate", (uint32_t)(sizeof(cases) / sizeof(cases[0])));
+}
+
+bool print_symbol(void* ctx, const char* name, uint32_t len) {
+    printf("  %.*s\n", (int)len, name);
+    return true;
+}
+
+int scan_files(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        FILE* file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open '%s'\n", argv[i]);
+            return 1;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        unsigned char* data = malloc(size + 1);
+        size = fread(data, 1, size, file);
+        fclose(file);
+        const char* ext = strrchr(argv[i], '.');
+        bool result;
+        printf("%s:\n", argv[i]);
+        if (size >= 8 && memcmp(data, "!<arch>\n", 8) == 0) {
+            result = scan_archive(data, size, print_symbol, NULL);
+        } else if (ext != NULL && (strcmp(ext, ".dll") == 0 || strcmp(ext, ".exe") == 0)) {
+            result = scan_exports(data, size, print_symbol, NULL);
+        } else {
+            result = scan_object(data, size, print_symbol, NULL);
+        }
+        free(data);
+        if (!result) {
+            fprintf(stderr, "Malformed file '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        return scan_files(argc, argv);
+    }
+    static Fixture fixtures[] = {
+        {"archive", scan_archive, {{0}, 0}, {"CreateFileW", "__imp_CreateFileW", "?f@@YAHXZ", NULL}},
+        {"archive64", scan_archive, {{0}, 0}, {"sym64", "__imp_sym64", NULL}},
+        {"dll32", scan_exports, {{0}, 0}, {"Alpha", "Beta", "_Gamma@4", NULL}},
+        {"dll64", scan_exports, {{0}, 0}, {"Alpha", "Beta", "LongerExportName", NULL}},
+        {"object", scan_object, {{0}, 0}, {"main", "?long_function_name@@YAXXZ", "short", NULL}},
+        {"bigobj", scan_object, {{0}, 0}, {"main", "?big_object_name@@YAXXZ", NULL}},
+        {"import_object", scan_object, {{0}, 0}, {NULL}},
+    };
+    make_archive(&fixtures[0], 4);
+    make_archive(&fixtures[1], 8);
+    make_dll(&fixtures[2], false);
+    make_dll(&fixtures[3], true);
+    make_object(&fixtures[4], false);
+    make_object(&fixtures[5], true);
+    // Import objects start like /bigobj, with version 0
+    Buffer* import = &fixtures[6].file;
+    put_u16(import, 2, 0xffff);
+    put_u16(import, 6, 0x8664);
+    put(import, 20, "CreateFileW\0kernel32.dll\0", 25);
+    for (uint32_t i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); ++i) {
+        run_fixture(&fixtures[i]);
+    }
+    run_undecorate();
+    if (failures > 0) {
+        fprintf(stderr, "%u failures\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -2,6 +2,7 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #endif
+#include <string.h>
 #include "hashmap.h"
 
 #ifdef HASHMAP_ALLOC_ERROR
@@ -12,157 +13,349 @@
 #define CHECKED_ALLOC(name, size) name = HASHMAP_ALLOC_FN(size)
 #endif
 
+uint64_t HashMap_Djb2(const void* data, uint32_t len) {
+    const unsigned char* str = data;
+    uint64_t hash = 5381;
+    for (uint32_t i = 0; i < len; ++i) {
+        hash = ((hash << 5) + hash) + str[i];
+    }
+    return hash;
+}
+
+#ifdef _MSC_VER
+#include <intrin.h>
+uint64_t wymix(uint64_t a, uint64_t b) {
+    uint64_t hi;
+    uint64_t lo = _umul128(a, b, &hi);
+    return lo ^ hi;
+}
+#else
+uint64_t wymix(uint64_t a, uint64_t b) {
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+#endif
+
+uint64_t wyr8(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+uint64_t wyr4(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// wyhash (final version 4) with the default secret and a zero seed. Reads
+// the key 8 or 16 bytes at a time instead of one byte per step.
+uint64_t HashMap_WyHash(const void* data, uint32_t len) {
+    const uint64_t s0 = 0xa0761d6478bd642fULL, s1 = 0xe7037ed1a0b428dbULL;
+    const uint64_t s2 = 0x8ebc6af09c88c6e3ULL, s3 = 0x589965cc75374cc3ULL;
+    const unsigned char* p = data;
+    uint64_t seed = wymix(s0, s1);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        uint32_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ s1, wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ s2, wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ s3, wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ s1, wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+    a ^= s1;
+    b ^= seed;
+    uint64_t hi;
+#ifdef _MSC_VER
+    a = _umul128(a, b, &hi);
+#else
+    unsigned __int128 r = (unsigned __int128)a * b;
+    a = (uint64_t)r;
+    hi = (uint64_t)(r >> 64);
+#endif
+    return wymix(a ^ s0 ^ len, hi ^ s1);
+}
+
+void* HashArena_Alloc(HashArena* arena, uint32_t size, uint32_t align) {
+    HashArenaChunk* chunk = arena->last;
+    uint32_t capacity = HASHMAP_ARENA_MIN_CHUNK;
+    if (chunk != NULL) {
+        uint32_t offset = (chunk->size + align - 1) & ~(align - 1);
+        if (offset <= chunk->capacity && size <= chunk->capacity - offset) {
+            chunk->size = offset + size;
+            return (unsigned char*)(chunk + 1) + offset;
+        }
+        if (chunk->capacity < HASHMAP_ARENA_MAX_CHUNK) {
+            capacity = chunk->capacity * 2;
+        } else {
+            capacity = chunk->capacity;
+        }
+    }
+    if (capacity < size) {
+        capacity = size;
+    }
+    HashArenaChunk* new_chunk = HASHMAP_ALLOC_FN(sizeof(HashArenaChunk) + capacity);
+    if (new_chunk == NULL) {
+        return NULL;
+    }
+    new_chunk->next = NULL;
+    new_chunk->size = size;
+    new_chunk->capacity = capacity;
+    if (chunk == NULL) {
+        arena->first = new_chunk;
+    } else {
+        chunk->next = new_chunk;
+    }
+    arena->last = new_chunk;
+    return new_chunk + 1;
+}
+
+void HashArena_Free(HashArena* arena) {
+    HashArenaChunk* chunk = arena->first;
+    while (chunk != NULL) {
+        HashArenaChunk* next = chunk->next;
+        HASHMAP_FREE_FN(chunk);
+        chunk = next;
+    }
+    arena->first = NULL;
+    arena->last = NULL;
+}
+
+char* HashMap_AllocKey(HashMap* map, uint32_t size) {
+    if (map->arena != NULL) {
+        return HashArena_Alloc(map->arena, size, 1);
+    }
+    return HASHMAP_ALLOC_FN(size);
+}
+
+void* HashMap_ArenaAlloc(HashMap* map, uint32_t size) {
+    return HashArena_Alloc(map->arena, size, 8);
+}
+
+uint32_t HashMap_PowerOfTwo(uint64_t n) {
+    uint32_t capacity = 1;
+    while (capacity < n && capacity < 0x80000000) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+// Buckets needed to insert count elements into an empty table without
+// reaching max_load
+uint32_t HashMap_CapacityFor(uint32_t count, uint32_t max_load) {
+    return HashMap_PowerOfTwo((uint64_t)count * 100 / max_load + 1);
+}
+
+#ifndef HASHMAP_OPEN_ADDRESSING
+
+void HashMap_FreeBuckets(HashMap* map) {
+    if (map->arena != NULL) {
+        HashArena_Free(&map->table);
+    } else {
+        for (uint32_t i = 0; i < map->bucket_count; ++i) {
+            if (map->buckets[i].data != NULL) {
+                HASHMAP_FREE_FN(map->buckets[i].data);
+            }
+        }
+    }
+    map->element_count = 0;
+    map->bucket_count = 0;
+    HASHMAP_FREE_FN(map->buckets);
+    map->buckets = NULL;
+}
+
 void HashMap_Free(HashMap* map) {
+    if (map->arena != NULL) {
+        HashMap_FreeBuckets(map);
+        HashArena_Free(map->arena);
+        HASHMAP_FREE_FN(map->arena);
+        map->arena = NULL;
+        return;
+    }
     for (uint32_t i = 0; i < map->bucket_count; ++i) {
         for (uint32_t j = 0; j < map->buckets[i].size; ++j) {
             HASHMAP_FREE_FN((char*)map->buckets[i].data[j].key);
         } 
-        HASHMAP_FREE_FN(map->buckets[i].data);
     }
-    map->element_count = 0;
-    map->bucket_count = 0;
-    HASHMAP_FREE_FN(map->buckets);
-    map->buckets = NULL;
+    HashMap_FreeBuckets(map);
 }
 
-int HashMap_Allocate(HashMap* map, uint32_t bucket_count) {
+HashElement* HashMap_AllocBucket(HashMap* map, uint32_t capacity) {
+    if (map->arena != NULL) {
+        return HashArena_Alloc(&map->table, capacity * sizeof(HashElement), 8);
+    }
+    return HASHMAP_ALLOC_FN(capacity * sizeof(HashElement));
+}
+
+int HashMap_AllocateWith(HashMap* map, uint32_t bucket_count, HashArena* arena) {
+    uint32_t capacity = HashMap_PowerOfTwo(bucket_count);
     map->element_count = 0;
-    map->bucket_count = bucket_count;
-    map->buckets = HASHMAP_ALLOC_FN(bucket_count * sizeof(HashBucket));
+    map->max_load = HASHMAP_MAX_LOAD;
+    map->rehash_count = 0;
+    map->bucket_count = capacity;
+    map->arena = arena;
+    map->table.first = NULL;
+    map->table.last = NULL;
+    map->buckets = HASHMAP_ALLOC_FN(capacity * sizeof(HashBucket));
 #ifdef HASHMAP_ALLOC_ERROR
     if (map->buckets == NULL) {
         map->bucket_count = 0;
         return 0;
     }
 #endif
-    for (uint32_t i = 0; i < bucket_count; ++i) {
-        map->buckets[i].size = 0;
-        map->buckets[i].capacity = HASHMAP_INIT_BUCKET_CAP;
-        map->buckets[i].data = HASHMAP_ALLOC_FN(HASHMAP_INIT_BUCKET_CAP * sizeof(HashElement));
-#ifdef HASHMAP_ALLOC_ERROR
-        if (map->buckets[i].data == NULL) {
-            map->bucket_count = i;
-            HashMap_Free(map);
-            return 0;
-        }
-#endif
-    }
+    memset(map->buckets, 0, capacity * sizeof(HashBucket));
     return 1;
 }
 
 void HashMap_Clear(HashMap* map) {
     for (uint32_t i = 0; i < map->bucket_count; ++i) {
-        for (uint32_t j = 0; j < map->buckets[i].size; ++j) {
-            HASHMAP_FREE_FN((char*)map->buckets[i].data[j].key);
+        if (map->arena == NULL) {
+            for (uint32_t j = 0; j < map->buckets[i].size; ++j) {
+                HASHMAP_FREE_FN((char*)map->buckets[i].data[j].key);
+            }
         }
         map->buckets[i].size = 0;
     }
+    if (map->arena != NULL) {
+        HashArena_Free(map->arena);
+    }
     map->element_count = 0;
 }
 
-int HashMap_Create(HashMap* map) {
-    return HashMap_Allocate(map, HASHMAP_INIT_BUCKETS);
-}
-
-uint64_t hash(const char* str) {
-    uint64_t hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c;
+HashElement* HashMap_GetElement(HashMap* map, const char* key, uint64_t h, uint32_t len, HashBucket** bucket) {
+    *bucket = &map->buckets[h & (map->bucket_count - 1)];
+    for (uint32_t i = 0; i < (*bucket)->size; ++i) {
+        HashElement* elem = &(*bucket)->data[i];
+        if (elem->hash == h && elem->key_len == len && memcmp(key, elem->key, len) == 0) {
+            return elem;
+        }
     }
-    return hash;
+    return NULL;
 }
 
-HashElement* HashMap_GetElement(HashMap* map, const char* key, HashBucket** bucket) {
-    uint64_t h = hash(key);
-    *bucket = &map->buckets[h % map->bucket_count];
-    for (uint32_t i = 0; i < (*bucket)->size; ++i) {
-        if (strcmp(key, (*bucket)->data[i].key) == 0) {
-            return &((*bucket)->data[i]);
+int HashMap_AddElement(HashMap* map, HashBucket* bucket, HashElement element) {
+    if (bucket->size == bucket->capacity) {
+        uint32_t capacity = bucket->capacity == 0 ? HASHMAP_INIT_BUCKET_CAP : bucket->capacity * 2;
+        HashElement* new_data;
+        CHECKED_CALL(new_data = HashMap_AllocBucket(map, capacity));
+        if (bucket->data != NULL) {
+            memcpy(new_data, bucket->data, bucket->size * sizeof(HashElement));
+            if (map->arena == NULL) {
+                HASHMAP_FREE_FN(bucket->data);
+            }
         }
+        bucket->data = new_data;
+        bucket->capacity = capacity;
     }
-    return NULL;
+    memcpy(bucket->data + bucket->size, &element, sizeof(HashElement));
+    ++(bucket->size);
+    ++(map->element_count);
+    return 1;
 }
 
-int HashMap_Rehash(HashMap* map) {
+int HashMap_Resize(HashMap* map, uint32_t bucket_count) {
     HashMap tmp;
-    CHECKED_CALL(HashMap_Allocate(&tmp, map->bucket_count * 2));
+    CHECKED_CALL(HashMap_AllocateWith(&tmp, bucket_count, map->arena));
     for (uint32_t b = 0; b < map->bucket_count; ++b) {
         for (uint32_t ix = 0; ix < map->buckets[b].size; ++ix) {
-            int status = HashMap_Insert(&tmp, map->buckets[b].data[ix].key, map->buckets[b].data[ix].value);
+            // Keys are unique and hashed already, move the elements as is
+            HashElement* elem = &map->buckets[b].data[ix];
+            int status = HashMap_AddElement(&tmp, &tmp.buckets[elem->hash & (tmp.bucket_count - 1)], *elem);
 #ifdef HASHMAP_ALLOC_ERROR
             if (!status) {
-                HashMap_Free(&tmp);
+                HashMap_FreeBuckets(&tmp);
                 return 0;
             }
 #endif
         }
     }
-    HashMap_Free(map);
+    tmp.max_load = map->max_load;
+    tmp.rehash_count = map->rehash_count + 1;
+    HashMap_FreeBuckets(map);
     *map = tmp;
     return 1;
 }
 
-int HashMap_AddElement(HashMap* map, HashBucket* bucket, HashElement element) {
-    if (bucket->size == bucket->capacity) {
-        HashElement* new_data;
-        CHECKED_ALLOC(new_data, bucket->size * 2 * sizeof(HashElement));
-        memcpy(new_data, bucket->data, bucket->size * sizeof(HashElement));
-        HASHMAP_FREE_FN(bucket->data);
-        bucket->data = new_data;
-        bucket->capacity = bucket->size * 2;
-    }
-    memcpy(bucket->data + bucket->size, &element, sizeof(HashElement));
-    ++(bucket->size);
-    ++(map->element_count);
-    return 1;
+int HashMap_Rehash(HashMap* map) {
+    return HashMap_Resize(map, map->bucket_count * 2);
+}
+
+int HashMap_Full(const HashMap* map) {
+    return (uint64_t)map->element_count * 100 >= (uint64_t)map->bucket_count * map->max_load;
 }
 
 int HashMap_Insert(HashMap* map, const char* key, char* value) {
-    if (map->bucket_count == map->element_count) {
+    if (HashMap_Full(map)) {
         CHECKED_CALL(HashMap_Rehash(map));
     }
+    uint32_t len = strlen(key);
+    uint64_t h = HASHMAP_HASH_FN(key, len);
     HashBucket* bucket;
-    HashElement* elem = HashMap_GetElement(map, key, &bucket);
+    HashElement* elem = HashMap_GetElement(map, key, h, len, &bucket);
     if (elem != NULL) {
         elem->value = value;
         return 1;
     }
-    uint32_t len = strlen(key);
     char* buf;
-    CHECKED_ALLOC(buf, len + 1);
+    CHECKED_CALL(buf = HashMap_AllocKey(map, len + 1));
     memcpy(buf, key, len + 1);
-    HashElement he = {buf, value};
+    HashElement he = {buf, value, h, len, 0};
     CHECKED_CALL(HashMap_AddElement(map, bucket, he));
     return 1;
 }
 
-HashElement* HashMap_Get(HashMap* map, const char* key) {
-    if (map->bucket_count == map->element_count) {
+HashElement* HashMap_GetHash(HashMap* map, const char* key, uint32_t len, uint64_t h) {
+    if (HashMap_Full(map)) {
         CHECKED_CALL(HashMap_Rehash(map));
     }
     HashBucket* bucket;
-    HashElement* elem = HashMap_GetElement(map, key, &bucket);
+    HashElement* elem = HashMap_GetElement(map, key, h, len, &bucket);
     if (elem != NULL) {
         return elem;
     }
-    uint32_t len = strlen(key);
     char* buf;
-    CHECKED_ALLOC(buf, len + 1);
-    memcpy(buf, key, len + 1);
-    HashElement he = {buf, NULL};
+    CHECKED_CALL(buf = HashMap_AllocKey(map, len + 1));
+    memcpy(buf, key, len);
+    buf[len] = '\0';
+    HashElement he = {buf, NULL, h, len, 0};
     CHECKED_CALL(HashMap_AddElement(map, bucket, he));
     return &(bucket->data[bucket->size - 1]);
 }
 
 HashElement* HashMap_Find(HashMap* map, const char* key) {
+    uint32_t len = strlen(key);
     HashBucket* bucket;
-    return HashMap_GetElement(map, key, &bucket);
+    return HashMap_GetElement(map, key, HASHMAP_HASH_FN(key, len), len, &bucket);
 }
 
 char* HashMap_Value(HashMap* map, const char* key) {
+    uint32_t len = strlen(key);
     HashBucket *bucket;
-    HashElement* element = HashMap_GetElement(map, key, &bucket);
+    HashElement* element = HashMap_GetElement(map, key, HASHMAP_HASH_FN(key, len), len, &bucket);
     if (element == NULL) {
         return NULL;
     }
@@ -170,12 +363,15 @@ char* HashMap_Value(HashMap* map, const char* key) {
 }
 
 int HashMap_Remove(HashMap* map, const char* key) {
+    uint32_t len = strlen(key);
     HashBucket* bucket;
-    HashElement* element = HashMap_GetElement(map, key, &bucket);
+    HashElement* element = HashMap_GetElement(map, key, HASHMAP_HASH_FN(key, len), len, &bucket);
     if (element == NULL) {
         return 0;
     }
-    HASHMAP_FREE_FN((char*)element->key);
+    if (map->arena == NULL) {
+        HASHMAP_FREE_FN((char*)element->key);
+    }
     uint32_t ix = element - bucket->data;
     memmove(element, element + 1, (bucket->size - ix - 1) * sizeof(HashElement));
     --bucket->size;
@@ -183,55 +379,946 @@ int HashMap_Remove(HashMap* map, const char* key) {
     return 1;
 }
 
-int HashMap_Freeze(const HashMap* map, HashMapFrozen *out) {
-    uint64_t size = sizeof(HashBucket) * map->bucket_count + sizeof(HashElement) * map->element_count;
-    for (uint32_t i = 0; i < map->bucket_count; ++i) {
-        for (uint32_t j = 0; j < map->buckets[i].size; ++j) {
-            HashElement* elem = &map->buckets[i].data[j];
-            size += strlen(elem->key) + 1;
-            if (elem->value != NULL) {
-                size += strlen(elem->value) + 1;
+HashElement* HashMap_Next(const HashMap* map, HashIterator* it) {
+    while (it->bucket < map->bucket_count) {
+        if (it->index < map->buckets[it->bucket].size) {
+            return &map->buckets[it->bucket].data[it->index++];
+        }
+        ++it->bucket;
+        it->index = 0;
+    }
+    return NULL;
+}
+
+void HashMap_SetMaxLoad(HashMap* map, uint32_t percent) {
+    map->max_load = percent < 25 ? 25 : percent > 800 ? 800 : percent;
+}
+
+#else
+#include <emmintrin.h>
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_FULL(c) (((c) & 0x80) == 0)
+#define H1(h) ((h) >> 7)
+#define H2(h) ((h) & 0x7f)
+
+#ifdef _MSC_VER
+uint32_t lowest_bit(uint32_t mask) {
+    unsigned long ix;
+    _BitScanForward(&ix, mask);
+    return ix;
+}
+#else
+#define lowest_bit(mask) ((uint32_t)__builtin_ctz(mask))
+#endif
+
+uint32_t group_match(const uint8_t* group, uint8_t c) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+}
+
+uint32_t group_match_free(const uint8_t* group) {
+    // Both empty and deleted slots have the high bit set
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+void HashMap_Free(HashMap* map) {
+    if (map->arena != NULL) {
+        HashArena_Free(map->arena);
+        HASHMAP_FREE_FN(map->arena);
+        map->arena = NULL;
+    } else {
+        for (uint32_t i = 0; i < map->bucket_count; ++i) {
+            if (CTRL_FULL(map->ctrl[i])) {
+                HASHMAP_FREE_FN((char*)map->slots[i].key);
             }
         }
     }
+    map->element_count = 0;
+    map->bucket_count = 0;
+    map->tombstone_count = 0;
+    HASHMAP_FREE_FN(map->slots);
+    map->slots = NULL;
+    map->ctrl = NULL;
+}
+
+int HashMap_AllocateWith(HashMap* map, uint32_t bucket_count, HashArena* arena) {
+    uint32_t capacity = HashMap_PowerOfTwo(bucket_count);
+    if (capacity < HASHMAP_GROUP_WIDTH) {
+        capacity = HASHMAP_GROUP_WIDTH;
+    }
+    map->arena = arena;
+    map->element_count = 0;
+    map->tombstone_count = 0;
+    map->max_load = HASHMAP_MAX_LOAD;
+    map->rehash_count = 0;
+    map->bucket_count = capacity;
+    map->slots = HASHMAP_ALLOC_FN(capacity * (sizeof(HashElement) + 1));
+#ifdef HASHMAP_ALLOC_ERROR
+    if (map->slots == NULL) {
+        map->bucket_count = 0;
+        return 0;
+    }
+#endif
+    map->ctrl = (uint8_t*)(map->slots + capacity);
+    memset(map->ctrl, CTRL_EMPTY, capacity);
+    return 1;
+}
 
-    char* ptr;
-    CHECKED_ALLOC(ptr, size);
-    char* bucket_ptr = ptr;
-    char* elem_ptr = ptr + map->bucket_count * sizeof(HashBucket);
-    char* str_ptr = elem_ptr + map->element_count * sizeof(HashElement);
+void HashMap_Clear(HashMap* map) {
+    if (map->arena != NULL) {
+        HashArena_Free(map->arena);
+    } else {
+        for (uint32_t i = 0; i < map->bucket_count; ++i) {
+            if (CTRL_FULL(map->ctrl[i])) {
+                HASHMAP_FREE_FN((char*)map->slots[i].key);
+            }
+        }
+    }
+    memset(map->ctrl, CTRL_EMPTY, map->bucket_count);
+    map->element_count = 0;
+    map->tombstone_count = 0;
+}
+
+HashElement* HashMap_GetElement(const HashMap* map, const char* key, uint64_t h, uint32_t len) {
+    uint32_t group_mask = map->bucket_count / HASHMAP_GROUP_WIDTH - 1;
+    uint32_t group = H1(h) & group_mask;
+    for (uint32_t step = 1;; ++step) {
+        const uint8_t* ctrl = map->ctrl + group * HASHMAP_GROUP_WIDTH;
+        uint32_t match = group_match(ctrl, H2(h));
+        while (match) {
+            HashElement* elem = &map->slots[group * HASHMAP_GROUP_WIDTH + lowest_bit(match)];
+            if (elem->hash == h && elem->key_len == len && memcmp(key, elem->key, len) == 0) {
+                return elem;
+            }
+            match &= match - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            return NULL;
+        }
+        // Triangular probing visits every group once for power of two counts
+        group = (group + step) & group_mask;
+    }
+}
+
+uint32_t HashMap_FreeSlot(const HashMap* map, uint64_t h) {
+    uint32_t group_mask = map->bucket_count / HASHMAP_GROUP_WIDTH - 1;
+    uint32_t group = H1(h) & group_mask;
+    for (uint32_t step = 1;; ++step) {
+        uint32_t match = group_match_free(map->ctrl + group * HASHMAP_GROUP_WIDTH);
+        if (match) {
+            return group * HASHMAP_GROUP_WIDTH + lowest_bit(match);
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+int HashMap_Resize(HashMap* map, uint32_t bucket_count) {
+    HashMap tmp;
+    CHECKED_CALL(HashMap_AllocateWith(&tmp, bucket_count, map->arena));
     for (uint32_t i = 0; i < map->bucket_count; ++i) {
-        HashBucket* old_bucket = &map->buckets[i];
-        HashBucket bucket = {(HashElement*)elem_ptr, old_bucket->size, old_bucket->size};
-        memcpy(bucket_ptr, &bucket, sizeof(HashBucket));
-        bucket_ptr += sizeof(HashBucket);
-        for (uint32_t j = 0; j < old_bucket->size; ++j) {
-            uint32_t key_len = strlen(old_bucket->data[j].key) + 1;
-            memcpy(str_ptr, old_bucket->data[j].key, key_len);
-            uint32_t val_len = 0;
-            HashElement e = {str_ptr, NULL};
-            if (old_bucket->data[j].value != NULL) {
-                val_len = strlen(old_bucket->data[j].value) + 1;
-                memcpy(str_ptr + key_len, old_bucket->data[j].value, val_len);
-                e.value = str_ptr + key_len;
-            }
-            memcpy(elem_ptr, &e, sizeof(e));
-            elem_ptr += sizeof(e);
-            str_ptr += key_len + val_len;
-        }
-    }
-
-    out->map.buckets = (HashBucket*)ptr;
-    out->map.bucket_count = map->bucket_count;
-    out->map.element_count = map->element_count;
+        if (CTRL_FULL(map->ctrl[i])) {
+            uint64_t h = map->slots[i].hash;
+            uint32_t ix = HashMap_FreeSlot(&tmp, h);
+            tmp.ctrl[ix] = H2(h);
+            memcpy(&tmp.slots[ix], &map->slots[i], sizeof(HashElement));
+        }
+    }
+    tmp.element_count = map->element_count;
+    tmp.max_load = map->max_load;
+    tmp.rehash_count = map->rehash_count + 1;
+    HASHMAP_FREE_FN(map->slots);
+    *map = tmp;
+    return 1;
+}
+
+int HashMap_Rehash(HashMap* map) {
+    uint32_t capacity = map->bucket_count;
+    // Mostly tombstones, which a rehash at the same size clears
+    if ((uint64_t)map->element_count * 200 >= (uint64_t)capacity * map->max_load) {
+        capacity *= 2;
+    }
+    return HashMap_Resize(map, capacity);
+}
+
+HashElement* HashMap_AddElement(HashMap* map, const char* key, uint64_t h, uint32_t len, char* value) {
+    if ((uint64_t)(map->element_count + map->tombstone_count) * 100 >= (uint64_t)map->bucket_count * map->max_load) {
+        CHECKED_CALL(HashMap_Rehash(map));
+    }
+    char* buf;
+    CHECKED_CALL(buf = HashMap_AllocKey(map, len + 1));
+    memcpy(buf, key, len);
+    buf[len] = '\0';
+    uint32_t ix = HashMap_FreeSlot(map, h);
+    if (map->ctrl[ix] == CTRL_DELETED) {
+        --map->tombstone_count;
+    }
+    map->ctrl[ix] = H2(h);
+    HashElement he = {buf, value, h, len, 0};
+    memcpy(&map->slots[ix], &he, sizeof(HashElement));
+    ++map->element_count;
+    return &map->slots[ix];
+}
+
+int HashMap_Insert(HashMap* map, const char* key, char* value) {
+    uint32_t len = strlen(key);
+    uint64_t h = HASHMAP_HASH_FN(key, len);
+    HashElement* elem = HashMap_GetElement(map, key, h, len);
+    if (elem != NULL) {
+        elem->value = value;
+        return 1;
+    }
+    CHECKED_CALL(HashMap_AddElement(map, key, h, len, value));
+    return 1;
+}
+
+HashElement* HashMap_GetHash(HashMap* map, const char* key, uint32_t len, uint64_t h) {
+    HashElement* elem = HashMap_GetElement(map, key, h, len);
+    if (elem != NULL) {
+        return elem;
+    }
+    return HashMap_AddElement(map, key, h, len, NULL);
+}
+
+HashElement* HashMap_Find(HashMap* map, const char* key) {
+    uint32_t len = strlen(key);
+    return HashMap_GetElement(map, key, HASHMAP_HASH_FN(key, len), len);
+}
+
+char* HashMap_Value(HashMap* map, const char* key) {
+    uint32_t len = strlen(key);
+    HashElement* element = HashMap_GetElement(map, key, HASHMAP_HASH_FN(key, len), len);
+    if (element == NULL) {
+        return NULL;
+    }
+    return element->value;
+}
+
+int HashMap_Remove(HashMap* map, const char* key) {
+    uint32_t len = strlen(key);
+    HashElement* element = HashMap_GetElement(map, key, HASHMAP_HASH_FN(key, len), len);
+    if (element == NULL) {
+        return 0;
+    }
+    if (map->arena == NULL) {
+        HASHMAP_FREE_FN((char*)element->key);
+    }
+    uint32_t ix = element - map->slots;
+    // A probe stops at the first group with an empty slot, so no probe
+    // continues past a group that already has one.
+    if (group_match(map->ctrl + (ix & ~(HASHMAP_GROUP_WIDTH - 1)), CTRL_EMPTY)) {
+        map->ctrl[ix] = CTRL_EMPTY;
+    } else {
+        map->ctrl[ix] = CTRL_DELETED;
+        ++map->tombstone_count;
+    }
+    --map->element_count;
+    return 1;
+}
+
+HashElement* HashMap_Next(const HashMap* map, HashIterator* it) {
+    while (it->bucket < map->bucket_count) {
+        uint32_t ix = it->bucket++;
+        if (CTRL_FULL(map->ctrl[ix])) {
+            return &map->slots[ix];
+        }
+    }
+    return NULL;
+}
+
+// Probes end at an empty slot, so a table is never allowed to fill up
+void HashMap_SetMaxLoad(HashMap* map, uint32_t percent) {
+    map->max_load = percent < 25 ? 25 : percent > 93 ? 93 : percent;
+}
+
+#endif
+
+int HashMap_Allocate(HashMap* map, uint32_t bucket_count) {
+    return HashMap_AllocateWith(map, bucket_count, NULL);
+}
+
+int HashMap_Create(HashMap* map) {
+    return HashMap_Allocate(map, HASHMAP_INIT_BUCKETS);
+}
+
+int HashMap_CreateWithCapacity(HashMap* map, uint32_t count) {
+    return HashMap_Allocate(map, HashMap_CapacityFor(count, HASHMAP_MAX_LOAD));
+}
+
+int HashMap_Reserve(HashMap* map, uint32_t count) {
+    uint32_t capacity = HashMap_CapacityFor(count, map->max_load);
+    if (capacity <= map->bucket_count) {
+        return 1;
+    }
+    return HashMap_Resize(map, capacity);
+}
+
+int HashMap_CreateArena(HashMap* map) {
+    HashArena* arena;
+    CHECKED_ALLOC(arena, sizeof(HashArena));
+    arena->first = NULL;
+    arena->last = NULL;
+    if (!HashMap_AllocateWith(map, HASHMAP_INIT_BUCKETS, arena)) {
+        HASHMAP_FREE_FN(arena);
+        return 0;
+    }
+    return 1;
+}
+
+HashElement* HashMap_GetLen(HashMap* map, const char* key, uint32_t len) {
+    return HashMap_GetHash(map, key, len, HASHMAP_HASH_FN(key, len));
+}
+
+HashElement* HashMap_Get(HashMap* map, const char* key) {
+    return HashMap_GetLen(map, key, strlen(key));
+}
+
+typedef struct FrozenChunk {
+    const unsigned char* data;
+    uint32_t size;
+    uint32_t offset;
+} FrozenChunk;
+
+// String pool of a frozen map. For arena maps the used part of every chunk
+// is copied in one piece, and only strings outside the arena are copied
+// one at a time after them.
+typedef struct FrozenPool {
+    FrozenChunk* chunks;
+    uint32_t chunk_count;
+    uint64_t size;
+    uint64_t cursor;
+} FrozenPool;
+
+const FrozenChunk* frozen_pool_chunk(const FrozenPool* pool, const void* ptr) {
+    const unsigned char* p = ptr;
+    uint32_t low = 0, high = pool->chunk_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (pool->chunks[mid].data <= p) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0 || p >= pool->chunks[low - 1].data + pool->chunks[low - 1].size) {
+        return NULL;
+    }
+    return &pool->chunks[low - 1];
+}
+
+uint32_t frozen_value_len(const HashElement* elem) {
+    if (elem->value_len != 0) {
+        return elem->value_len;
+    }
+    return strlen(elem->value) + 1;
+}
+
+// Iterates the elements of all shards in order
+typedef struct ShardIterator {
+    const HashMap* shards;
+    uint32_t shard_count;
+    uint32_t shard;
+    HashIterator it;
+} ShardIterator;
+
+void shard_iterator_init(ShardIterator* it, const HashMap* shards, uint32_t shard_count) {
+    it->shards = shards;
+    it->shard_count = shard_count;
+    it->shard = 0;
+    it->it.bucket = 0;
+    it->it.index = 0;
+}
+
+HashElement* shard_iterator_next(ShardIterator* it) {
+    while (it->shard < it->shard_count) {
+        HashElement* elem = HashMap_Next(&it->shards[it->shard], &it->it);
+        if (elem != NULL) {
+            return elem;
+        }
+        ++it->shard;
+        it->it.bucket = 0;
+        it->it.index = 0;
+    }
+    return NULL;
+}
+
+int frozen_pool_init(FrozenPool* pool, const HashMap* shards, uint32_t shard_count) {
+    pool->chunks = NULL;
+    pool->chunk_count = 0;
+    pool->size = 0;
+    for (uint32_t s = 0; s < shard_count; ++s) {
+        if (shards[s].arena != NULL) {
+            for (HashArenaChunk* c = shards[s].arena->first; c != NULL; c = c->next) {
+                ++pool->chunk_count;
+            }
+        }
+    }
+    if (pool->chunk_count > 0) {
+        CHECKED_ALLOC(pool->chunks, pool->chunk_count * sizeof(FrozenChunk));
+        uint32_t count = 0;
+        for (uint32_t s = 0; s < shard_count; ++s) {
+            if (shards[s].arena == NULL) {
+                continue;
+            }
+            for (HashArenaChunk* c = shards[s].arena->first; c != NULL; c = c->next) {
+                // Insertion sort by address, there are only a few chunks
+                uint32_t ix = count++;
+                while (ix > 0 && pool->chunks[ix - 1].data > (unsigned char*)(c + 1)) {
+                    pool->chunks[ix] = pool->chunks[ix - 1];
+                    --ix;
+                }
+                pool->chunks[ix].data = (unsigned char*)(c + 1);
+                pool->chunks[ix].size = c->size;
+            }
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            pool->chunks[i].offset = pool->size;
+            pool->size += (pool->chunks[i].size + 7) & ~7ULL;
+        }
+    }
+    for (uint32_t s = 0; s < shard_count; ++s) {
+        const HashMap* map = &shards[s];
+        HashIterator it = {0, 0};
+        HashElement* elem;
+        while ((elem = HashMap_Next(map, &it)) != NULL) {
+            if (map->arena == NULL) {
+                pool->size += elem->key_len + 1;
+            }
+            if (elem->value != NULL && (map->arena == NULL || frozen_pool_chunk(pool, elem->value) == NULL)) {
+                pool->size += frozen_value_len(elem);
+            }
+        }
+    }
+    return 1;
+}
+
+uint32_t shard_element_count(const HashMap* shards, uint32_t shard_count) {
+    uint32_t count = 0;
+    for (uint32_t s = 0; s < shard_count; ++s) {
+        count += shards[s].element_count;
+    }
+    return count;
+}
+
+void frozen_pool_copy(FrozenPool* pool, unsigned char* ptr, uint64_t strings_offset) {
+    pool->cursor = strings_offset;
+    for (uint32_t i = 0; i < pool->chunk_count; ++i) {
+        pool->chunks[i].offset += strings_offset;
+        memcpy(ptr + pool->chunks[i].offset, pool->chunks[i].data, pool->chunks[i].size);
+        pool->cursor = pool->chunks[i].offset + pool->chunks[i].size;
+    }
+    pool->cursor = (pool->cursor + 7) & ~7ULL;
+}
+
+uint32_t frozen_pool_place(FrozenPool* pool, unsigned char* ptr, const void* str, uint32_t len) {
+    const FrozenChunk* chunk = frozen_pool_chunk(pool, str);
+    if (chunk != NULL) {
+        return chunk->offset + ((const unsigned char*)str - chunk->data);
+    }
+    uint32_t offset = pool->cursor;
+    memcpy(ptr + offset, str, len);
+    pool->cursor += len;
+    return offset;
+}
+
+void frozen_pool_element(FrozenPool* pool, unsigned char* ptr, const HashElement* elem, HashFrozenElement* e) {
+    e->hash = elem->hash;
+    e->key = frozen_pool_place(pool, ptr, elem->key, elem->key_len + 1);
+    e->key_len = elem->key_len;
+    e->value = 0;
+    e->value_len = 0;
+    if (elem->value != NULL) {
+        e->value_len = frozen_value_len(elem);
+        e->value = frozen_pool_place(pool, ptr, elem->value, e->value_len);
+    }
+}
+
+void frozen_pool_free(FrozenPool* pool) {
+    if (pool->chunks != NULL) {
+        HASHMAP_FREE_FN(pool->chunks);
+    }
+}
+
+int HashMap_FreezeShards(const HashMap* shards, uint32_t shard_count, HashMapFrozen *out) {
+    uint32_t element_count = shard_element_count(shards, shard_count);
+    uint32_t bucket_count = 1;
+    while (bucket_count < element_count) {
+        bucket_count <<= 1;
+    }
+    uint64_t elements_offset = sizeof(HashFrozenHeader) + sizeof(HashFrozenBucket) * bucket_count;
+    uint64_t strings_offset = elements_offset + sizeof(HashFrozenElement) * element_count;
+    FrozenPool pool;
+    CHECKED_CALL(frozen_pool_init(&pool, shards, shard_count));
+    uint64_t size = strings_offset + pool.size;
+    uint32_t* elem_bucket = NULL;
+    unsigned char* ptr = NULL;
+    if (size > UINT32_MAX || (elem_bucket = HASHMAP_ALLOC_FN(element_count * sizeof(uint32_t) + 1)) == NULL ||
+        (ptr = HASHMAP_ALLOC_FN(size)) == NULL) {
+        if (elem_bucket != NULL) {
+            HASHMAP_FREE_FN(elem_bucket);
+        }
+        frozen_pool_free(&pool);
+        return 0;
+    }
+    ShardIterator it;
+    shard_iterator_init(&it, shards, shard_count);
+    HashElement* elem;
+    uint32_t elem_ix = 0;
+    while ((elem = shard_iterator_next(&it)) != NULL) {
+        elem_bucket[elem_ix++] = elem->hash & (bucket_count - 1);
+    }
+
+    HashFrozenHeader header = {HASHMAP_FROZEN_MAGIC, HASHMAP_FROZEN_VERSION, HASHMAP_HASH_ID, HASHMAP_FROZEN_CHAINED,
+                               bucket_count, element_count,
+                               sizeof(HashFrozenHeader), elements_offset, strings_offset, size};
+    memcpy(ptr, &header, sizeof(header));
+    HashFrozenBucket* buckets = (HashFrozenBucket*)(ptr + sizeof(HashFrozenHeader));
+    HashFrozenElement* elements = (HashFrozenElement*)(ptr + elements_offset);
+    memset(buckets, 0, bucket_count * sizeof(HashFrozenBucket));
+    for (uint32_t i = 0; i < element_count; ++i) {
+        ++buckets[elem_bucket[i]].size;
+    }
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < bucket_count; ++i) {
+        buckets[i].first = first;
+        first += buckets[i].size;
+        buckets[i].size = 0;
+    }
+
+    frozen_pool_copy(&pool, ptr, strings_offset);
+    shard_iterator_init(&it, shards, shard_count);
+    elem_ix = 0;
+    while ((elem = shard_iterator_next(&it)) != NULL) {
+        HashFrozenBucket* bucket = &buckets[elem_bucket[elem_ix++]];
+        frozen_pool_element(&pool, ptr, elem, &elements[bucket->first + bucket->size++]);
+    }
+    HASHMAP_FREE_FN(elem_bucket);
+    frozen_pool_free(&pool);
+
+    out->data = ptr;
+    out->data_size = size;
+
+    return 1;
+}
+
+uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// The partition is taken from the top bits of the mixed hash and the
+// bucket within it from the low bits
+uint32_t perfect_bucket(uint64_t x, uint32_t bucket_count) {
+    uint32_t per = bucket_count / HASHMAP_PERFECT_PARTITIONS;
+    return (uint32_t)(x >> HASHMAP_PERFECT_PARTITION_SHIFT) * per + (uint32_t)x % per;
+}
+
+uint32_t perfect_slot(uint64_t h, uint32_t displacement, uint32_t first, uint32_t count) {
+    if (displacement & HASHMAP_PERFECT_DIRECT) {
+        return displacement & ~HASHMAP_PERFECT_DIRECT;
+    }
+    return first + hash_mix(h + (displacement + 1) * 0x9e3779b97f4a7c15ULL) % count;
+}
+
+uint32_t perfect_find(const unsigned char* data, uint64_t h) {
+    const HashFrozenHeader* header = (const HashFrozenHeader*)data;
+    const uint32_t* displacement = (const uint32_t*)(data + header->buckets_offset);
+    const uint32_t* start = displacement + header->bucket_count;
+    uint64_t x = hash_mix(h);
+    uint32_t p = x >> HASHMAP_PERFECT_PARTITION_SHIFT;
+    return perfect_slot(h, displacement[perfect_bucket(x, header->bucket_count)], start[p], start[p + 1] - start[p]);
+}
+
+typedef struct PerfectTask {
+    const uint64_t* hashes;
+    const uint32_t* order;
+    const uint32_t* bucket_start;
+    uint32_t* bucket_order;
+    uint32_t* displacement;
+    uint32_t* slot_item;
+    unsigned char* taken;
+    uint32_t per;
+    const HashMapFrozen* out;
+    unsigned char failed[HASHMAP_PERFECT_PARTITIONS];
+} PerfectTask;
+
+int perfect_place_partition(PerfectTask* task, uint32_t p) {
+    const uint32_t* bucket_start = task->bucket_start;
+    uint32_t* displacement = task->displacement;
+    unsigned char* taken = task->taken;
+    uint32_t begin = p * task->per;
+    uint32_t end = begin + task->per;
+    uint32_t first = bucket_start[begin];
+    uint32_t count = bucket_start[end] - first;
+    uint32_t max_size = 0;
+    for (uint32_t b = begin; b < end; ++b) {
+        if (bucket_start[b + 1] - bucket_start[b] > max_size) {
+            max_size = bucket_start[b + 1] - bucket_start[b];
+        }
+    }
+    // Place the largest buckets first, while most slots are still free
+    uint32_t* bucket_order = task->bucket_order + begin;
+    uint32_t placed = 0;
+    for (uint32_t s = max_size; s > 1; --s) {
+        for (uint32_t b = begin; b < end; ++b) {
+            if (bucket_start[b + 1] - bucket_start[b] == s) {
+                bucket_order[placed++] = b;
+            }
+        }
+    }
+    memset(taken + first, 0, count);
+    for (uint32_t i = 0; i < placed; ++i) {
+        uint32_t b = bucket_order[i];
+        const uint32_t* items = task->order + bucket_start[b];
+        uint32_t size = bucket_start[b + 1] - bucket_start[b];
+        uint32_t d = 0;
+        for (; d < HASHMAP_PERFECT_MAX_DISPLACEMENT; ++d) {
+            uint32_t k = 0;
+            for (; k < size; ++k) {
+                uint32_t slot = perfect_slot(task->hashes[items[k]], d, first, count);
+                if (taken[slot]) {
+                    break;
+                }
+                taken[slot] = 1;
+                task->slot_item[slot] = items[k];
+            }
+            if (k == size) {
+                break;
+            }
+            while (k > 0) {
+                --k;
+                taken[perfect_slot(task->hashes[items[k]], d, first, count)] = 0;
+            }
+        }
+        if (d == HASHMAP_PERFECT_MAX_DISPLACEMENT) {
+            // Most likely two keys with identical hashes
+            return 0;
+        }
+        displacement[b] = d;
+    }
+    // Single key buckets point straight at one of the remaining slots,
+    // empty ones at any slot so that a miss needs no partition size
+    uint32_t free_slot = first;
+    for (uint32_t b = begin; b < end; ++b) {
+        uint32_t size = bucket_start[b + 1] - bucket_start[b];
+        if (size == 0) {
+            displacement[b] = HASHMAP_PERFECT_DIRECT;
+        } else if (size == 1) {
+            while (taken[free_slot]) {
+                ++free_slot;
+            }
+            taken[free_slot] = 1;
+            task->slot_item[free_slot] = task->order[bucket_start[b]];
+            displacement[b] = HASHMAP_PERFECT_DIRECT | free_slot;
+        }
+    }
+    return 1;
+}
+
+void perfect_place(void* ctx, uint32_t begin, uint32_t end) {
+    PerfectTask* task = ctx;
+    for (uint32_t p = begin; p < end; ++p) {
+        task->failed[p] = !perfect_place_partition(task, p);
+    }
+}
+
+// Looks up every key of the finished map
+void perfect_check(void* ctx, uint32_t begin, uint32_t end) {
+    PerfectTask* task = ctx;
+    const unsigned char* data = task->out->data;
+    const HashFrozenHeader* header = (const HashFrozenHeader*)data;
+    const HashFrozenElement* elements = (const HashFrozenElement*)(data + header->elements_offset);
+    for (uint32_t p = begin; p < end; ++p) {
+        uint32_t last = task->bucket_start[(p + 1) * task->per];
+        for (uint32_t slot = task->bucket_start[p * task->per]; slot < last; ++slot) {
+            const char* key = (const char*)data + elements[slot].key;
+            if (HashMap_FrozenFind(task->out, key) != &elements[slot]) {
+                task->failed[p] = 1;
+            }
+        }
+    }
+}
+
+void perfect_run(HashMapParallelFn parallel, HashMapTask fn, PerfectTask* task) {
+    if (parallel != NULL) {
+        parallel(fn, task, HASHMAP_PERFECT_PARTITIONS, 1);
+    } else {
+        fn(task, 0, HASHMAP_PERFECT_PARTITIONS);
+    }
+}
+
+int perfect_failed(const PerfectTask* task) {
+    for (uint32_t p = 0; p < HASHMAP_PERFECT_PARTITIONS; ++p) {
+        if (task->failed[p]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int HashMap_FreezePerfectShards(const HashMap* shards, uint32_t shard_count, HashMapParallelFn parallel, HashMapFrozen* out) {
+    uint32_t n = shard_element_count(shards, shard_count);
+    uint32_t per = n / (HASHMAP_PERFECT_BUCKET_SIZE * HASHMAP_PERFECT_PARTITIONS) + 1;
+    uint32_t r = per * HASHMAP_PERFECT_PARTITIONS;
+    uint64_t displacement_offset = sizeof(HashFrozenHeader);
+    uint64_t elements_offset = displacement_offset + (((r + HASHMAP_PERFECT_PARTITIONS + 1) * sizeof(uint32_t) + 7) & ~7ULL);
+    uint64_t strings_offset = elements_offset + sizeof(HashFrozenElement) * n;
+
+    FrozenPool pool;
+    CHECKED_CALL(frozen_pool_init(&pool, shards, shard_count));
+    uint64_t size = strings_offset + pool.size;
+    uint64_t scratch_size = n * (sizeof(HashElement*) + sizeof(uint64_t) + 3 * sizeof(uint32_t)) +
+                            (r + 1) * 3 * sizeof(uint32_t) + n + 1;
+    unsigned char* scratch = NULL;
+    if (size > UINT32_MAX || (scratch = HASHMAP_ALLOC_FN(scratch_size)) == NULL) {
+        frozen_pool_free(&pool);
+        return 0;
+    }
+    const HashElement** items = (const HashElement**)scratch;
+    uint64_t* hashes = (uint64_t*)(items + n);
+    uint32_t* item_bucket = (uint32_t*)(hashes + n);
+    uint32_t* order = item_bucket + n;
+    uint32_t* slot_item = order + n;
+    uint32_t* bucket_start = slot_item + n;
+    uint32_t* bucket_order = bucket_start + r + 1;
+    uint32_t* displacement = bucket_order + r + 1;
+    unsigned char* taken = (unsigned char*)(displacement + r + 1);
+
+    // Group keys by bucket with a counting sort. The keys of a partition
+    // end up next to each other and own the slots they are sorted into.
+    uint32_t ix = 0;
+    memset(bucket_start, 0, (r + 1) * sizeof(uint32_t));
+    ShardIterator it;
+    shard_iterator_init(&it, shards, shard_count);
+    const HashElement* elem;
+    while ((elem = shard_iterator_next(&it)) != NULL) {
+        items[ix] = elem;
+        hashes[ix] = elem->hash;
+        item_bucket[ix] = perfect_bucket(hash_mix(hashes[ix]), r);
+        ++bucket_start[item_bucket[ix] + 1];
+        ++ix;
+    }
+    for (uint32_t b = 0; b < r; ++b) {
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        order[bucket_start[item_bucket[i]]++] = i;
+    }
+    for (uint32_t b = r; b > 0; --b) {
+        bucket_start[b] = bucket_start[b - 1];
+    }
+    bucket_start[0] = 0;
+
+    PerfectTask task = {hashes, order, bucket_start, bucket_order, displacement, slot_item, taken, per, out, {0}};
+    perfect_run(parallel, perfect_place, &task);
+    unsigned char* ptr = NULL;
+    if (perfect_failed(&task) || (ptr = HASHMAP_ALLOC_FN(size)) == NULL) {
+        HASHMAP_FREE_FN(scratch);
+        frozen_pool_free(&pool);
+        return 0;
+    }
+    HashFrozenHeader header = {HASHMAP_FROZEN_MAGIC, HASHMAP_FROZEN_VERSION, HASHMAP_HASH_ID, HASHMAP_FROZEN_PERFECT,
+                               r, n, displacement_offset, elements_offset, strings_offset, size};
+    memcpy(ptr, &header, sizeof(header));
+    memset(ptr + displacement_offset, 0, elements_offset - displacement_offset);
+    memcpy(ptr + displacement_offset, displacement, r * sizeof(uint32_t));
+    uint32_t* start = (uint32_t*)(ptr + displacement_offset) + r;
+    for (uint32_t p = 0; p <= HASHMAP_PERFECT_PARTITIONS; ++p) {
+        start[p] = bucket_start[p * per];
+    }
+    HashFrozenElement* elements = (HashFrozenElement*)(ptr + elements_offset);
+    frozen_pool_copy(&pool, ptr, strings_offset);
+    for (uint32_t slot = 0; slot < n; ++slot) {
+        frozen_pool_element(&pool, ptr, items[slot_item[slot]], &elements[slot]);
+    }
+    frozen_pool_free(&pool);
+
+    out->data = ptr;
     out->data_size = size;
+    perfect_run(parallel, perfect_check, &task);
+    HASHMAP_FREE_FN(scratch);
+    if (perfect_failed(&task)) {
+        HashMap_FreeFrozen(out);
+        return 0;
+    }
 
     return 1;
 }
 
+int HashMap_Freeze(const HashMap* map, HashMapFrozen* out) {
+    return HashMap_FreezeShards(map, 1, out);
+}
+
+int HashMap_FreezePerfect(const HashMap* map, HashMapFrozen* out) {
+    return HashMap_FreezePerfectShards(map, 1, NULL, out);
+}
+
 void HashMap_FreeFrozen(HashMapFrozen *map) {
-    HASHMAP_FREE_FN(map->map.buckets);
-    map->map.element_count = 0;
-    map->map.bucket_count = 0;
+    HASHMAP_FREE_FN((unsigned char*)map->data);
+    map->data = NULL;
     map->data_size = 0;
 }
+
+int HashMap_FrozenOpen(HashMapFrozen* map, const void* data, uint64_t size) {
+    const HashFrozenHeader* header = data;
+    if (size < sizeof(HashFrozenHeader) || header->magic != HASHMAP_FROZEN_MAGIC ||
+        header->version != HASHMAP_FROZEN_VERSION || header->hash_id != HASHMAP_HASH_ID || header->size > size || header->bucket_count == 0) {
+        return 0;
+    }
+    uint64_t buckets_size = (uint64_t)header->bucket_count * sizeof(HashFrozenBucket);
+    if (header->layout == HASHMAP_FROZEN_PERFECT) {
+        buckets_size = ((uint64_t)header->bucket_count + HASHMAP_PERFECT_PARTITIONS + 1) * sizeof(uint32_t);
+    }
+    // Chained buckets are found by masking the hash, perfect ones are
+    // split evenly between the partitions
+    if (header->layout > HASHMAP_FROZEN_PERFECT ||
+        (header->layout == HASHMAP_FROZEN_CHAINED && (header->bucket_count & (header->bucket_count - 1)) != 0) ||
+        (header->layout == HASHMAP_FROZEN_PERFECT && header->bucket_count % HASHMAP_PERFECT_PARTITIONS != 0) ||
+        header->buckets_offset + buckets_size > header->size ||
+        header->elements_offset + (uint64_t)header->element_count * sizeof(HashFrozenElement) > header->size ||
+        header->strings_offset > header->size) {
+        return 0;
+    }
+    if (header->layout == HASHMAP_FROZEN_PERFECT) {
+        const uint32_t* start = (const uint32_t*)((const unsigned char*)data + header->buckets_offset) + header->bucket_count;
+        for (uint32_t p = 0; p < HASHMAP_PERFECT_PARTITIONS; ++p) {
+            if (start[p] > start[p + 1]) {
+                return 0;
+            }
+        }
+        if (start[0] != 0 || start[HASHMAP_PERFECT_PARTITIONS] != header->element_count) {
+            return 0;
+        }
+    }
+    map->data = data;
+    map->data_size = header->size;
+    return 1;
+}
+
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#define HASHMAP_PREFETCH(ptr) _mm_prefetch((const char*)(ptr), _MM_HINT_T0)
+#else
+#define HASHMAP_PREFETCH(ptr) __builtin_prefetch((ptr))
+#endif
+
+void HashMap_FrozenPrefetch(const HashMapFrozen* map, uint64_t h) {
+    const HashFrozenHeader* header = (const HashFrozenHeader*)map->data;
+    if (header->layout == HASHMAP_FROZEN_PERFECT) {
+        HASHMAP_PREFETCH((const uint32_t*)(map->data + header->buckets_offset) + perfect_bucket(hash_mix(h), header->bucket_count));
+    } else {
+        HASHMAP_PREFETCH((const HashFrozenBucket*)(map->data + header->buckets_offset) + (h & (header->bucket_count - 1)));
+    }
+}
+
+void HashMap_FrozenPrefetchElement(const HashMapFrozen* map, uint64_t h) {
+    const HashFrozenHeader* header = (const HashFrozenHeader*)map->data;
+    const HashFrozenElement* elements = (const HashFrozenElement*)(map->data + header->elements_offset);
+    if (header->layout == HASHMAP_FROZEN_PERFECT) {
+        if (header->element_count == 0) {
+            return;
+        }
+        HASHMAP_PREFETCH(elements + perfect_find(map->data, h));
+    } else {
+        const HashFrozenBucket* bucket = (const HashFrozenBucket*)(map->data + header->buckets_offset) +
+                                         (h & (header->bucket_count - 1));
+        HASHMAP_PREFETCH(elements + bucket->first);
+    }
+}
+
+const HashFrozenElement* HashMap_FrozenFindHash(const HashMapFrozen* map, const char* key, uint32_t len, uint64_t h) {
+    const HashFrozenHeader* header = (const HashFrozenHeader*)map->data;
+    if (header->layout == HASHMAP_FROZEN_PERFECT) {
+        if (header->element_count == 0) {
+            return NULL;
+        }
+        const HashFrozenElement* elem = (const HashFrozenElement*)(map->data + header->elements_offset) + perfect_find(map->data, h);
+        if (elem->hash == h && elem->key_len == len && memcmp(key, map->data + elem->key, len) == 0) {
+            return elem;
+        }
+        return NULL;
+    }
+    const HashFrozenBucket* bucket = (const HashFrozenBucket*)(map->data + header->buckets_offset) +
+                                     (h & (header->bucket_count - 1));
+    const HashFrozenElement* elements = (const HashFrozenElement*)(map->data + header->elements_offset);
+    for (uint32_t i = 0; i < bucket->size; ++i) {
+        const HashFrozenElement* elem = &elements[bucket->first + i];
+        // The key string is only touched when the full hash matches
+        if (elem->hash == h && elem->key_len == len && memcmp(key, map->data + elem->key, len) == 0) {
+            return elem;
+        }
+    }
+    return NULL;
+}
+
+const HashFrozenElement* HashMap_FrozenFind(const HashMapFrozen* map, const char* key) {
+    uint32_t len = strlen(key);
+    return HashMap_FrozenFindHash(map, key, len, HASHMAP_HASH_FN(key, len));
+}
+
+const char* HashMap_FrozenValue(const HashMapFrozen* map, const char* key) {
+    const HashFrozenElement* elem = HashMap_FrozenFind(map, key);
+    if (elem == NULL || elem->value == 0) {
+        return NULL;
+    }
+    return (const char*)map->data + elem->value;
+}
+
+const HashFrozenElement* HashMap_FrozenElements(const HashMapFrozen* map, uint32_t* count) {
+    const HashFrozenHeader* header = (const HashFrozenHeader*)map->data;
+    *count = header->element_count;
+    return (const HashFrozenElement*)(map->data + header->elements_offset);
+}
+
+void HashMap_FrozenStats(const HashMapFrozen* map, HashFrozenStats* stats) {
+    const HashFrozenHeader* header = (const HashFrozenHeader*)map->data;
+    const HashFrozenElement* elements = (const HashFrozenElement*)(map->data + header->elements_offset);
+    memset(stats, 0, sizeof(HashFrozenStats));
+    stats->layout = header->layout;
+    stats->bucket_count = header->bucket_count;
+    stats->element_count = header->element_count;
+    if (header->layout == HASHMAP_FROZEN_PERFECT) {
+        // Every lookup compares the key in its slot once
+        stats->compares = header->element_count;
+        if (header->bucket_count == 0) {
+            return;
+        }
+        uint32_t* sizes = HASHMAP_ALLOC_FN(header->bucket_count * sizeof(uint32_t));
+        if (sizes == NULL) {
+            return;
+        }
+        memset(sizes, 0, header->bucket_count * sizeof(uint32_t));
+        for (uint32_t i = 0; i < header->element_count; ++i) {
+            ++sizes[perfect_bucket(hash_mix(elements[i].hash), header->bucket_count)];
+        }
+        for (uint32_t b = 0; b < header->bucket_count; ++b) {
+            uint32_t size = sizes[b];
+            ++stats->chains[size < HASHMAP_STATS_CHAINS ? size : HASHMAP_STATS_CHAINS - 1];
+            if (size > stats->longest) {
+                stats->longest = size;
+            }
+        }
+        HASHMAP_FREE_FN(sizes);
+        return;
+    }
+    const HashFrozenBucket* buckets = (const HashFrozenBucket*)(map->data + header->buckets_offset);
+    for (uint32_t b = 0; b < header->bucket_count; ++b) {
+        uint32_t size = buckets[b].size;
+        ++stats->chains[size < HASHMAP_STATS_CHAINS ? size : HASHMAP_STATS_CHAINS - 1];
+        if (size > stats->longest) {
+            stats->longest = size;
+        }
+        // Keys are only compared when the hash and length match
+        const HashFrozenElement* chain = elements + buckets[b].first;
+        for (uint32_t i = 0; i < size; ++i) {
+            for (uint32_t j = 0; j <= i; ++j) {
+                stats->compares += chain[j].hash == chain[i].hash && chain[j].key_len == chain[i].key_len;
+            }
+        }
+    }
+}
@@ -5,6 +5,15 @@
 #include <stdlib.h>
 #define HASHMAP_INIT_BUCKETS 4
 #define HASHMAP_INIT_BUCKET_CAP 4
+// Default for the largest share of elements to buckets, in percent, before
+// a table grows. HashMap_SetMaxLoad changes it for a single map.
+#ifndef HASHMAP_MAX_LOAD
+#ifdef HASHMAP_OPEN_ADDRESSING
+#define HASHMAP_MAX_LOAD 87
+#else
+#define HASHMAP_MAX_LOAD 100
+#endif
+#endif
 #ifndef HASHMAP_ALLOC_FN
 #ifdef HASHMAP_PROCESS_HEAP
 #define HASHMAP_ALLOC_FN(size) HeapAlloc(GetProcessHeap(), 0, (size))
@@ -27,50 +36,237 @@
 #endif
 #endif
 
+#define HASHMAP_HASH_ID_DJB2 1
+#define HASHMAP_HASH_ID_WYHASH 2
+// HASHMAP_HASH_ID is stored in frozen maps, which are rejected when read
+// by a build that hashes differently.
+#ifndef HASHMAP_HASH_FN
+#ifdef HASHMAP_HASH_DJB2
+#define HASHMAP_HASH_FN(data, len) HashMap_Djb2((data), (len))
+#define HASHMAP_HASH_ID HASHMAP_HASH_ID_DJB2
+#else
+#define HASHMAP_HASH_FN(data, len) HashMap_WyHash((data), (len))
+#define HASHMAP_HASH_ID HASHMAP_HASH_ID_WYHASH
+#endif
+#endif
+
+#define HASHMAP_ARENA_MIN_CHUNK (64 * 1024)
+#define HASHMAP_ARENA_MAX_CHUNK (16 * 1024 * 1024)
+
+typedef struct HashArenaChunk {
+    struct HashArenaChunk* next;
+    uint32_t size;
+    uint32_t capacity;
+} HashArenaChunk;
+
+typedef struct HashArena {
+    HashArenaChunk* first;
+    HashArenaChunk* last;
+} HashArena;
+
 typedef struct HashElement {
     const char* const key;
     char* value;
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t value_len; // 0 for NUL terminated values
 } HashElement;
 
+#ifndef HASHMAP_OPEN_ADDRESSING
 typedef struct HashBucket {
     HashElement* data;
     uint32_t size;
     uint32_t capacity;
 } HashBucket;
 
+// Bucket arrays are allocated on first insert, and bucket_count is a
+// power of two.
 typedef struct HashMap {
     HashBucket* buckets;
     uint32_t bucket_count;
     uint32_t element_count;
+    uint32_t max_load;
+    uint32_t rehash_count;
+    HashArena* arena;
+    HashArena table;
 } HashMap;
+#else
+#define HASHMAP_GROUP_WIDTH 16
 
-typedef struct HashMapFrozen {
-    HashMap map;
+// Flat open addressing table. Each slot has a control byte holding 7 bits
+// of its hash, or an empty / deleted marker, and lookups compare a whole
+// group of HASHMAP_GROUP_WIDTH control bytes at once.
+typedef struct HashMap {
+    HashElement* slots;
+    uint8_t* ctrl;
+    uint32_t bucket_count;
+    uint32_t element_count;
+    uint32_t tombstone_count;
+    uint32_t max_load;
+    uint32_t rehash_count;
+    HashArena* arena;
+} HashMap;
+#endif
 
+typedef struct HashIterator {
+    uint32_t bucket;
+    uint32_t index;
+} HashIterator;
+
+#define HASHMAP_FROZEN_MAGIC 0x5a524648 // "HFRZ"
+#define HASHMAP_FROZEN_VERSION 5
+#define HASHMAP_FROZEN_CHAINED 0
+#define HASHMAP_FROZEN_PERFECT 1
+// Average number of keys per displacement bucket in a perfect frozen map
+#define HASHMAP_PERFECT_BUCKET_SIZE 4
+#define HASHMAP_PERFECT_MAX_DISPLACEMENT (1 << 24)
+#define HASHMAP_PERFECT_DIRECT 0x80000000
+// Keys of a perfect frozen map are split by hash into partitions with
+// their own buckets and slots, which are placed independently
+#define HASHMAP_PERFECT_PARTITIONS 64
+#define HASHMAP_PERFECT_PARTITION_SHIFT 58
+
+// A frozen map is a single position independent blob, all references
+// inside it are 32-bit offsets from the start of the header.
+typedef struct HashFrozenHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hash_id;
+    uint32_t layout;
+    uint32_t bucket_count;
+    uint32_t element_count;
+    uint32_t buckets_offset;
+    uint32_t elements_offset;
+    uint32_t strings_offset;
+    uint32_t size;
+} HashFrozenHeader;
+
+// For HASHMAP_FROZEN_CHAINED buckets_offset points to an array of
+// HashFrozenBucket. For HASHMAP_FROZEN_PERFECT it points to one uint32_t
+// displacement per bucket, followed by the first slot of each partition
+// and the element count. Elements are stored by slot, so a lookup needs a
+// single key comparison.
+typedef struct HashFrozenBucket {
+    uint32_t first;
+    uint32_t size;
+} HashFrozenBucket;
+
+typedef struct HashFrozenElement {
+    uint64_t hash;
+    uint32_t key;
+    uint32_t key_len;
+    uint32_t value; // 0 for NULL values
+    uint32_t value_len; // Including the NUL terminator
+} HashFrozenElement;
+
+typedef struct HashMapFrozen {
+    const unsigned char* data;
     uint64_t data_size;
 } HashMapFrozen;
 
+#define HASHMAP_STATS_CHAINS 8
+
+typedef struct HashFrozenStats {
+    uint32_t layout;
+    uint32_t bucket_count;
+    uint32_t element_count;
+    // Buckets by number of keys, the last entry counts all longer chains.
+    // A perfect map places the keys of a bucket with one displacement.
+    uint32_t chains[HASHMAP_STATS_CHAINS];
+    uint32_t longest;
+    uint64_t compares; // Key comparisons to look up every key once
+} HashFrozenStats;
+
+
+uint64_t HashMap_Djb2(const void* data, uint32_t len);
+
+uint64_t HashMap_WyHash(const void* data, uint32_t len);
 
 void HashMap_Free(HashMap* map);
 
+// bucket_count is rounded up to a power of two
 int HashMap_Allocate(HashMap* map, uint32_t bucket_count);
 
 void HashMap_Clear(HashMap* map);
 
+// Moves the elements into a new table, grown when the map is full enough
+int HashMap_Rehash(HashMap* map);
+
 int HashMap_Create(HashMap* map);
 
+// Sized so count elements can be inserted without a rehash
+int HashMap_CreateWithCapacity(HashMap* map, uint32_t count);
+
+// Grows the table so that it holds count elements in total without a
+// rehash. Never shrinks it.
+int HashMap_Reserve(HashMap* map, uint32_t count);
+
+// Clamped to what the layout supports, takes effect at the next insert
+void HashMap_SetMaxLoad(HashMap* map, uint32_t percent);
+
+// Keys, and values from HashMap_ArenaAlloc, are bump allocated and only
+// released together by HashMap_Free or HashMap_Clear.
+int HashMap_CreateArena(HashMap* map);
+
+void* HashMap_ArenaAlloc(HashMap* map, uint32_t size);
+
+// A zero initialized HashArena is empty
+void* HashArena_Alloc(HashArena* arena, uint32_t size, uint32_t align);
+
+void HashArena_Free(HashArena* arena);
+
 int HashMap_Insert(HashMap* map, const char* key, char* value);
 
 HashElement* HashMap_Find(HashMap* map, const char* key);
 
 HashElement* HashMap_Get(HashMap* map, const char* key);
 
+HashElement* HashMap_GetLen(HashMap* map, const char* key, uint32_t len);
+
+// h must be HASHMAP_HASH_FN(key, len)
+HashElement* HashMap_GetHash(HashMap* map, const char* key, uint32_t len, uint64_t h);
+
 char* HashMap_Value(HashMap* map, const char* key);
 
 int HashMap_Remove(HashMap* map, const char* key);
 
+HashElement* HashMap_Next(const HashMap* map, HashIterator* it);
+
+typedef void (*HashMapTask)(void* ctx, uint32_t begin, uint32_t end);
+
+// Runs task over [0, count), split into ranges of at least grain items
+// that may run concurrently.
+typedef void (*HashMapParallelFn)(HashMapTask task, void* ctx, uint32_t count, uint32_t grain);
+
 int HashMap_Freeze(const HashMap* map, HashMapFrozen* out);
 
+int HashMap_FreezePerfect(const HashMap* map, HashMapFrozen* out);
+
+// Freezes the union of several maps, which must not share any keys.
+int HashMap_FreezeShards(const HashMap* shards, uint32_t shard_count, HashMapFrozen* out);
+
+// Partitions are placed with parallel when it is not NULL
+int HashMap_FreezePerfectShards(const HashMap* shards, uint32_t shard_count, HashMapParallelFn parallel, HashMapFrozen* out);
+
 void HashMap_FreeFrozen(HashMapFrozen* map);
 
+int HashMap_FrozenOpen(HashMapFrozen* map, const void* data, uint64_t size);
+
+const HashFrozenElement* HashMap_FrozenFind(const HashMapFrozen* map, const char* key);
+
+// h must be HASHMAP_HASH_FN(key, len)
+const HashFrozenElement* HashMap_FrozenFindHash(const HashMapFrozen* map, const char* key, uint32_t len, uint64_t h);
+
+// Prefetching the bucket of a key, and some time later its element, lets
+// batched lookups overlap their cache misses.
+void HashMap_FrozenPrefetch(const HashMapFrozen* map, uint64_t h);
+
+void HashMap_FrozenPrefetchElement(const HashMapFrozen* map, uint64_t h);
+
+const char* HashMap_FrozenValue(const HashMapFrozen* map, const char* key);
+
+const HashFrozenElement* HashMap_FrozenElements(const HashMapFrozen* map, uint32_t* count);
+
+void HashMap_FrozenStats(const HashMapFrozen* map, HashFrozenStats* stats);
+
 #endif
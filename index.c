@@ -0,0 +1,2662 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+#include <string.h>
+#include "index.h"
+#include "undname.h"
+
+bool index_builder_init(IndexBuilder* builder) {
+    builder->path_list = NULL;
+    builder->path_count = 0;
+    builder->path_capacity = 0;
+    memset(builder->sources, 0, sizeof(builder->sources));
+    builder->flags = 0;
+    builder->parallel = NULL;
+    builder->base = NULL;
+    builder->superseded = NULL;
+    uint32_t created = 0;
+    while (created < INDEX_SHARD_COUNT && HashMap_CreateArena(&builder->symbols[created])) {
+        ++created;
+    }
+    if (created < INDEX_SHARD_COUNT || !HashMap_CreateArena(&builder->paths)) {
+        while (created > 0) {
+            HashMap_Free(&builder->symbols[--created]);
+        }
+        return false;
+    }
+    return true;
+}
+
+void index_builder_free(IndexBuilder* builder) {
+    for (uint32_t i = 0; i < INDEX_SHARD_COUNT; ++i) {
+        HashMap_Free(&builder->symbols[i]);
+    }
+    HashMap_Free(&builder->paths);
+    if (builder->path_list != NULL) {
+        HASHMAP_FREE_FN(builder->path_list);
+    }
+    builder->path_list = NULL;
+    builder->path_count = 0;
+    builder->path_capacity = 0;
+    if (builder->superseded != NULL) {
+        HASHMAP_FREE_FN(builder->superseded);
+    }
+    builder->superseded = NULL;
+}
+
+bool index_builder_set_base(IndexBuilder* builder, const Index* base) {
+    builder->superseded = HASHMAP_ALLOC_FN(base->paths->count * sizeof(uint32_t) + 1);
+    if (builder->superseded == NULL) {
+        return false;
+    }
+    memset(builder->superseded, 0, base->paths->count * sizeof(uint32_t));
+    builder->base = base;
+    return true;
+}
+
+// Library ids of a delta follow those of its base
+uint32_t first_path(const IndexBuilder* builder) {
+    return builder->base == NULL ? 0 : builder->base->paths->count;
+}
+
+uint32_t kind_index(uint32_t kind) {
+    uint32_t ix = 0;
+    while (ix < INDEX_KIND_COUNT && !(kind & (1 << ix))) {
+        ++ix;
+    }
+    return ix;
+}
+
+uint32_t index_add_path(IndexBuilder* builder, const char* path, uint32_t len, uint32_t kinds) {
+    HashElement* elem = HashMap_GetLen(&builder->paths, path, len);
+    if (elem == NULL) {
+        return UINT32_MAX;
+    }
+    if (elem->value != NULL) {
+        uint32_t id = *(uint32_t*)elem->value;
+        builder->path_list[id].kinds |= kinds;
+        return first_path(builder) + id;
+    }
+    if (builder->path_count == builder->path_capacity) {
+        uint32_t capacity = builder->path_capacity == 0 ? 64 : builder->path_capacity * 2;
+        BuilderPath* list;
+        if (builder->path_list == NULL) {
+            list = HASHMAP_ALLOC_FN(capacity * sizeof(BuilderPath));
+        } else {
+            list = HASHMAP_REALLOC_FN(builder->path_list, capacity * sizeof(BuilderPath));
+        }
+        if (list == NULL) {
+            return UINT32_MAX;
+        }
+        builder->path_list = list;
+        builder->path_capacity = capacity;
+    }
+    uint32_t id = builder->path_count++;
+    elem->value = HashMap_ArenaAlloc(&builder->paths, sizeof(uint32_t));
+    *(uint32_t*)elem->value = id;
+    elem->value_len = sizeof(uint32_t);
+    builder->path_list[id].name = elem->key;
+    builder->path_list[id].len = len;
+    builder->path_list[id].kinds = kinds;
+    memset(builder->path_list[id].fingerprints, 0, sizeof(builder->path_list[id].fingerprints));
+    return first_path(builder) + id;
+}
+
+// Values are arrays of library ids, prefixed by their capacity so they
+// can grow geometrically inside the arena.
+bool posting_append(HashMap* map, HashElement* elem, uint32_t id) {
+    uint32_t count = elem->value_len / sizeof(uint32_t);
+    uint32_t* ids = (uint32_t*)elem->value;
+    if (count == 0 || count == ids[-1]) {
+        uint32_t capacity = count == 0 ? 1 : count * 2;
+        uint32_t* block = HashMap_ArenaAlloc(map, (capacity + 1) * sizeof(uint32_t));
+        if (block == NULL) {
+            return false;
+        }
+        block[0] = capacity;
+        if (count > 0) {
+            memcpy(block + 1, ids, count * sizeof(uint32_t));
+        }
+        ids = block + 1;
+        elem->value = (char*)ids;
+    }
+    ids[count] = id;
+    elem->value_len = (count + 1) * sizeof(uint32_t);
+    return true;
+}
+
+// h must be HASHMAP_HASH_FN(name, len)
+bool symbol_add(HashMap* shard, uint32_t path_id, const char* name, uint32_t len, uint64_t h) {
+    HashElement* elem = HashMap_GetHash(shard, name, len, h);
+    if (elem == NULL) {
+        return false;
+    }
+    uint32_t count = elem->value_len / sizeof(uint32_t);
+    if (count > 0 && ((uint32_t*)elem->value)[count - 1] == path_id) {
+        return true;
+    }
+    return posting_append(shard, elem, path_id);
+}
+
+bool index_add_symbol(IndexBuilder* builder, uint32_t path_id, const char* name, uint32_t len) {
+    uint64_t h = HASHMAP_HASH_FN(name, len);
+    return symbol_add(&builder->symbols[INDEX_SHARD(h)], path_id, name, len, h);
+}
+
+bool array_reserve(void** data, uint32_t* capacity, uint32_t count, uint32_t elem_size) {
+    if (count < *capacity) {
+        return true;
+    }
+    uint32_t new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+    void* new_data;
+    if (*data == NULL) {
+        new_data = HASHMAP_ALLOC_FN((uint64_t)new_capacity * elem_size);
+    } else {
+        new_data = HASHMAP_REALLOC_FN(*data, (uint64_t)new_capacity * elem_size);
+    }
+    if (new_data == NULL) {
+        return false;
+    }
+    *data = new_data;
+    *capacity = new_capacity;
+    return true;
+}
+
+typedef struct ParsedPath {
+    const char* name;
+    uint32_t len;
+    uint32_t id; // Set once the path is interned
+    uint64_t fingerprint;
+} ParsedPath;
+
+typedef struct ParsedSymbol {
+    const char* name;
+    uint32_t len;
+    uint32_t path; // Index into the paths of the chunk
+    uint64_t hash;
+} ParsedSymbol;
+
+typedef struct ParsedShard {
+    ParsedSymbol* symbols;
+    uint32_t count;
+    uint32_t capacity;
+} ParsedShard;
+
+// A run of whole library records, or of scanned libraries. Chunks are
+// parsed concurrently, and every symbol is hashed and placed in the list
+// of its shard.
+typedef struct ParseChunk {
+    const char* begin;
+    const char* end;
+    uint32_t first_library; // Position in ParseTask.selected
+    uint32_t library_count;
+    HashArena names; // Copies of scanned names
+    ParsedPath* paths;
+    uint32_t path_count;
+    uint32_t path_capacity;
+    ParsedShard shards[INDEX_SHARD_COUNT];
+    bool failed;
+} ParseChunk;
+
+typedef struct ParseTask {
+    IndexBuilder* builder;
+    ParseChunk* chunks;
+    uint32_t chunk_count;
+    bool failed[INDEX_SHARD_COUNT];
+    const IndexLibrary* libraries;
+    const uint32_t* selected;
+    IndexScanFn scan;
+    void* scan_ctx;
+} ParseTask;
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+uint32_t first_set_bit(uint32_t mask) {
+    unsigned long ix;
+    _BitScanForward(&ix, mask);
+    return ix;
+}
+#else
+#define first_set_bit(mask) ((uint32_t)__builtin_ctz(mask))
+#endif
+
+// Returns the first '\n' or '\r' in [p, end), or end
+const char* line_break(const char* p, const char* end) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, lf), _mm_cmpeq_epi8(block, cr)));
+        if (mask != 0) {
+            return p + first_set_bit(mask);
+        }
+        p += 16;
+    }
+    while (p < end && *p != '\n' && *p != '\r') {
+        ++p;
+    }
+    return p;
+}
+#else
+const char* line_break(const char* p, const char* end) {
+    while (p < end && *p != '\n' && *p != '\r') {
+        ++p;
+    }
+    return p;
+}
+#endif
+
+// Returns the start of the first record after p. Records start with a
+// line that is neither blank nor indented.
+const char* next_record(const char* p, const char* end) {
+    while (p < end) {
+        p = line_break(p, end);
+        while (p < end && (*p == '\r' || *p == '\n')) {
+            ++p;
+        }
+        if (p < end && *p != ' ') {
+            return p;
+        }
+    }
+    return end;
+}
+
+// A record spans from its first line to the start of the next record
+uint64_t record_hash(const char* begin, const char* end) {
+    return HASHMAP_HASH_FN(begin, end - begin);
+}
+
+uint32_t chunk_add_path(ParseChunk* chunk, const char* name, uint32_t len) {
+    if (!array_reserve((void**)&chunk->paths, &chunk->path_capacity, chunk->path_count, sizeof(ParsedPath))) {
+        return UINT32_MAX;
+    }
+    ParsedPath* path = &chunk->paths[chunk->path_count];
+    path->name = name;
+    path->len = len;
+    path->fingerprint = 0;
+    return chunk->path_count++;
+}
+
+bool chunk_add_symbol(ParseChunk* chunk, uint32_t path, const char* name, uint32_t len) {
+    uint64_t h = HASHMAP_HASH_FN(name, len);
+    ParsedShard* shard = &chunk->shards[INDEX_SHARD(h)];
+    if (!array_reserve((void**)&shard->symbols, &shard->capacity, shard->count, sizeof(ParsedSymbol))) {
+        return false;
+    }
+    ParsedSymbol* symbol = &shard->symbols[shard->count++];
+    symbol->name = name;
+    symbol->len = len;
+    symbol->path = path;
+    symbol->hash = h;
+    return true;
+}
+
+void chunk_reset(ParseChunk* chunk) {
+    chunk->path_count = 0;
+    for (uint32_t s = 0; s < INDEX_SHARD_COUNT; ++s) {
+        chunk->shards[s].count = 0;
+    }
+}
+
+void free_chunks(ParseChunk* chunks, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        ParseChunk* chunk = &chunks[i];
+        if (chunk->paths != NULL) {
+            HASHMAP_FREE_FN(chunk->paths);
+        }
+        for (uint32_t s = 0; s < INDEX_SHARD_COUNT; ++s) {
+            if (chunk->shards[s].symbols != NULL) {
+                HASHMAP_FREE_FN(chunk->shards[s].symbols);
+            }
+        }
+        HashArena_Free(&chunk->names);
+    }
+    HASHMAP_FREE_FN(chunks);
+}
+
+bool parse_chunk(ParseChunk* chunk) {
+    const char* end = chunk->end;
+    const char* line = chunk->begin;
+    const char* record = line;
+    uint32_t path = UINT32_MAX;
+
+    while (line < end) {
+        if (*line == '\r' || *line == '\n') {
+            ++line;
+            continue;
+        }
+        const char* line_end = line_break(line, end);
+        if (*line != ' ') {
+            if (path != UINT32_MAX) {
+                chunk->paths[path].fingerprint += record_hash(record, line);
+            }
+            record = line;
+            path = UINT32_MAX;
+        } else {
+            while (line < line_end && *line == ' ') {
+                ++line;
+            }
+            if (line_end - line >= 9 && memcmp(line, "fullpath:", 9) == 0) {
+                const char* name = line + 9;
+                while (name < line_end && (*name == ' ' || *name == '\t')) {
+                    ++name;
+                }
+                path = chunk_add_path(chunk, name, line_end - name);
+                if (path == UINT32_MAX) {
+                    return false;
+                }
+            } else if (line < line_end && *line == '-') {
+                if (path == UINT32_MAX) {
+                    return false;
+                }
+                ++line;
+                while (line < line_end && (*line == ' ' || *line == '\t')) {
+                    ++line;
+                }
+                if (!chunk_add_symbol(chunk, path, line, line_end - line)) {
+                    return false;
+                }
+            }
+        }
+        line = line_end;
+    }
+    if (path != UINT32_MAX) {
+        chunk->paths[path].fingerprint += record_hash(record, end);
+    }
+    return true;
+}
+
+void parse_chunks(void* ctx, uint32_t begin, uint32_t end) {
+    ParseTask* task = ctx;
+    for (uint32_t i = begin; i < end; ++i) {
+        task->chunks[i].failed = !parse_chunk(&task->chunks[i]);
+    }
+}
+
+// Visits the chunks in order, so every posting list ends up in the same
+// order as when parsing serially.
+void insert_shards(void* ctx, uint32_t begin, uint32_t end) {
+    ParseTask* task = ctx;
+    for (uint32_t s = begin; s < end; ++s) {
+        HashMap* map = &task->builder->symbols[s];
+        task->failed[s] = false;
+        for (uint32_t i = 0; i < task->chunk_count && !task->failed[s]; ++i) {
+            const ParseChunk* chunk = &task->chunks[i];
+            const ParsedShard* shard = &chunk->shards[s];
+            for (uint32_t j = 0; j < shard->count; ++j) {
+                const ParsedSymbol* symbol = &shard->symbols[j];
+                if (!symbol_add(map, chunk->paths[symbol->path].id, symbol->name, symbol->len, symbol->hash)) {
+                    task->failed[s] = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void run_task(const IndexBuilder* builder, IndexTask task, void* ctx, uint32_t count, uint32_t grain) {
+    if (builder->parallel != NULL) {
+        builder->parallel(task, ctx, count, grain);
+    } else {
+        task(ctx, 0, count);
+    }
+}
+
+// Interns the paths of the parsed chunks in order, then fills each shard
+// of the symbol table in one task.
+bool insert_chunks(ParseTask* task, uint32_t kind) {
+    for (uint32_t i = 0; i < task->chunk_count; ++i) {
+        ParseChunk* chunk = &task->chunks[i];
+        if (chunk->failed) {
+            return false;
+        }
+        for (uint32_t j = 0; j < chunk->path_count; ++j) {
+            ParsedPath* path = &chunk->paths[j];
+            path->id = index_add_path(task->builder, path->name, path->len, kind);
+            if (path->id == UINT32_MAX) {
+                return false;
+            }
+            BuilderPath* interned = &task->builder->path_list[path->id - first_path(task->builder)];
+            interned->fingerprints[kind_index(kind)] += path->fingerprint;
+        }
+    }
+    run_task(task->builder, insert_shards, task, INDEX_SHARD_COUNT, 1);
+    for (uint32_t s = 0; s < INDEX_SHARD_COUNT; ++s) {
+        if (task->failed[s]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parse_window(ParseTask* task, const char* data, uint64_t size, uint32_t kind) {
+    const char* end = data + size;
+    const char* begin = data;
+    for (uint32_t i = 0; i < task->chunk_count; ++i) {
+        ParseChunk* chunk = &task->chunks[i];
+        const char* chunk_end = end;
+        if (i + 1 < task->chunk_count) {
+            chunk_end = next_record(data + size * (i + 1) / task->chunk_count, end);
+            if (chunk_end < begin) {
+                chunk_end = begin;
+            }
+        }
+        chunk->begin = begin;
+        chunk->end = chunk_end;
+        chunk_reset(chunk);
+        begin = chunk_end;
+    }
+    run_task(task->builder, parse_chunks, task, task->chunk_count, 1);
+    return insert_chunks(task, kind);
+}
+
+uint64_t estimate_keys(const char* data, uint64_t size) {
+    uint64_t sample = size < INDEX_ESTIMATE_SAMPLE ? size : INDEX_ESTIMATE_SAMPLE;
+    const char* end = data + sample;
+    uint64_t lines = 0;
+    for (const char* p = data; p < end; ++p) {
+        p = line_break(p, end);
+        lines += p < end && *p == '\n';
+    }
+    return sample == 0 ? 0 : lines * size / sample / INDEX_LINES_PER_KEY;
+}
+
+// Grows every shard at once, instead of each doubling many times as it
+// is filled
+bool reserve_symbols(IndexBuilder* builder, uint64_t keys) {
+    uint64_t per_shard = keys / INDEX_SHARD_COUNT;
+    if (per_shard > UINT32_MAX) {
+        per_shard = UINT32_MAX;
+    }
+    for (uint32_t s = 0; s < INDEX_SHARD_COUNT; ++s) {
+        if (!HashMap_Reserve(&builder->symbols[s], per_shard)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The source is processed in windows of whole records, so the parsed
+// symbols held at once are bounded by the window size. Within a window
+// chunks are parsed in parallel, paths are then interned in file order,
+// and finally each shard of the symbol table is filled by one task.
+bool index_parse_yaml(IndexBuilder* builder, const char* data, uint64_t size, uint32_t kind) {
+    uint64_t window = size < INDEX_PARSE_WINDOW ? size : INDEX_PARSE_WINDOW;
+    uint64_t chunk_count = 1;
+    if (builder->parallel != NULL) {
+        chunk_count = window / INDEX_PARSE_MIN_CHUNK;
+        if (chunk_count > INDEX_PARSE_CHUNKS) {
+            chunk_count = INDEX_PARSE_CHUNKS;
+        } else if (chunk_count == 0) {
+            chunk_count = 1;
+        }
+    }
+    if (!reserve_symbols(builder, estimate_keys(data, size))) {
+        return false;
+    }
+    ParseTask task;
+    task.builder = builder;
+    task.chunk_count = chunk_count;
+    task.chunks = HASHMAP_ALLOC_FN(chunk_count * sizeof(ParseChunk));
+    if (task.chunks == NULL) {
+        return false;
+    }
+    memset(task.chunks, 0, chunk_count * sizeof(ParseChunk));
+
+    bool success = true;
+    const char* end = data + size;
+    const char* begin = data;
+    while (begin < end && success) {
+        const char* window_end = end;
+        if ((uint64_t)(end - begin) > INDEX_PARSE_WINDOW) {
+            window_end = next_record(begin + INDEX_PARSE_WINDOW, end);
+        }
+        success = parse_window(&task, begin, window_end - begin, kind);
+        begin = window_end;
+    }
+
+    free_chunks(task.chunks, task.chunk_count);
+    return success;
+}
+
+// Finds the library of a record the same way parse_chunk does, the last
+// fullpath line wins.
+bool record_path(const char* line, const char* end, const char** name, uint32_t* len) {
+    bool found = false;
+    while (line < end) {
+        const char* line_end = line_break(line, end);
+        if (*line == ' ') {
+            while (line < line_end && *line == ' ') {
+                ++line;
+            }
+            if (line_end - line >= 9 && memcmp(line, "fullpath:", 9) == 0) {
+                const char* path = line + 9;
+                while (path < line_end && (*path == ' ' || *path == '\t')) {
+                    ++path;
+                }
+                *name = path;
+                *len = line_end - path;
+                found = true;
+            }
+        }
+        line = line_end;
+        while (line < end && (*line == '\r' || *line == '\n')) {
+            ++line;
+        }
+    }
+    return found;
+}
+
+typedef struct DeltaPath {
+    uint64_t fingerprint;
+    bool unchanged;
+} DeltaPath;
+
+typedef struct DeltaRecord {
+    const char* begin;
+    const char* end;
+    DeltaPath* path; // NULL for records without a library
+} DeltaRecord;
+
+// Fingerprinting only hashes and splits lines, the changed records are
+// then parsed in runs of consecutive records.
+bool index_parse_yaml_delta(IndexBuilder* builder, const char* data, uint64_t size, uint32_t kind) {
+    const Index* base = builder->base;
+    uint32_t k = kind_index(kind);
+    HashMap current;
+    if (!HashMap_CreateArena(&current)) {
+        return false;
+    }
+    DeltaRecord* records = NULL;
+    uint32_t record_count = 0;
+    uint32_t record_capacity = 0;
+    bool success = true;
+    const char* end = data + size;
+    const char* begin = data;
+    while (begin < end && success) {
+        const char* record_end = next_record(begin, end);
+        success = array_reserve((void**)&records, &record_capacity, record_count, sizeof(DeltaRecord));
+        if (!success) {
+            break;
+        }
+        DeltaRecord* record = &records[record_count++];
+        record->begin = begin;
+        record->end = record_end;
+        record->path = NULL;
+        const char* name;
+        uint32_t len;
+        if (record_path(begin, record_end, &name, &len)) {
+            HashElement* elem = HashMap_GetLen(&current, name, len);
+            if (elem != NULL && elem->value == NULL) {
+                elem->value = HashMap_ArenaAlloc(&current, sizeof(DeltaPath));
+                if (elem->value != NULL) {
+                    memset(elem->value, 0, sizeof(DeltaPath));
+                }
+            }
+            if (elem == NULL || elem->value == NULL) {
+                success = false;
+                break;
+            }
+            record->path = (DeltaPath*)elem->value;
+            record->path->fingerprint += record_hash(begin, record_end);
+        }
+        begin = record_end;
+    }
+
+    for (uint32_t i = 0; i < base->paths->count && success; ++i) {
+        const IndexPath* path = &base->paths->paths[i];
+        if (!(path->kinds & kind)) {
+            continue;
+        }
+        HashElement* elem = HashMap_Find(&current, (const char*)base->paths + path->name);
+        DeltaPath* delta = elem == NULL ? NULL : (DeltaPath*)elem->value;
+        if (delta != NULL && delta->fingerprint == path->fingerprints[k]) {
+            delta->unchanged = true;
+        } else {
+            builder->superseded[i] |= kind;
+        }
+    }
+
+    uint32_t run = 0;
+    for (uint32_t i = 0; i <= record_count && success; ++i) {
+        if (i < record_count && (records[i].path == NULL || !records[i].path->unchanged)) {
+            continue;
+        }
+        if (run < i) {
+            success = index_parse_yaml(builder, records[run].begin, records[i - 1].end - records[run].begin, kind);
+        }
+        run = i + 1;
+    }
+    if (records != NULL) {
+        HASHMAP_FREE_FN(records);
+    }
+    HashMap_Free(&current);
+    return success;
+}
+
+typedef struct ScanSink {
+    ParseChunk* chunk;
+    uint32_t path;
+} ScanSink;
+
+// Names are copied, so the scanner can release a library once it is read
+bool sink_symbol(void* ctx, const char* name, uint32_t len) {
+    ScanSink* sink = ctx;
+    char* copy = HashArena_Alloc(&sink->chunk->names, len, 1);
+    if (copy == NULL) {
+        return false;
+    }
+    memcpy(copy, name, len);
+    return chunk_add_symbol(sink->chunk, sink->path, copy, len);
+}
+
+void scan_chunks(void* ctx, uint32_t begin, uint32_t end) {
+    ParseTask* task = ctx;
+    for (uint32_t i = begin; i < end; ++i) {
+        ParseChunk* chunk = &task->chunks[i];
+        chunk->failed = false;
+        for (uint32_t j = 0; j < chunk->library_count && !chunk->failed; ++j) {
+            uint32_t library = task->selected[chunk->first_library + j];
+            const IndexLibrary* lib = &task->libraries[library];
+            ScanSink sink;
+            sink.chunk = chunk;
+            sink.path = chunk_add_path(chunk, lib->path, lib->len);
+            if (sink.path == UINT32_MAX || !task->scan(task->scan_ctx, library, sink_symbol, &sink)) {
+                chunk->failed = true;
+            } else {
+                chunk->paths[sink.path].fingerprint = lib->fingerprint;
+            }
+        }
+    }
+}
+
+// Picks the libraries index_scan has to read, and supersedes the base
+// libraries that changed or are gone.
+bool select_libraries(IndexBuilder* builder, const IndexLibrary* libraries, uint32_t count, uint32_t kind,
+                      uint32_t* selected, uint32_t* selected_count) {
+    DeltaPath* states = HASHMAP_ALLOC_FN(count * sizeof(DeltaPath) + 1);
+    HashMap listed;
+    if (states == NULL) {
+        return false;
+    }
+    if (!HashMap_CreateArena(&listed)) {
+        HASHMAP_FREE_FN(states);
+        return false;
+    }
+    bool success = true;
+    for (uint32_t i = 0; i < count; ++i) {
+        HashElement* elem = HashMap_GetLen(&listed, libraries[i].path, libraries[i].len);
+        if (elem == NULL) {
+            success = false;
+            break;
+        }
+        states[i].fingerprint = libraries[i].fingerprint;
+        states[i].unchanged = elem->value != NULL;
+        if (elem->value == NULL) {
+            elem->value = (char*)&states[i];
+        }
+    }
+
+    const Index* base = builder->base;
+    uint32_t k = kind_index(kind);
+    for (uint32_t i = 0; base != NULL && i < base->paths->count && success; ++i) {
+        const IndexPath* path = &base->paths->paths[i];
+        if (!(path->kinds & kind)) {
+            continue;
+        }
+        HashElement* elem = HashMap_Find(&listed, (const char*)base->paths + path->name);
+        DeltaPath* state = elem == NULL ? NULL : (DeltaPath*)elem->value;
+        if (state != NULL && state->fingerprint == path->fingerprints[k]) {
+            state->unchanged = true;
+        } else {
+            builder->superseded[i] |= kind;
+        }
+    }
+    *selected_count = 0;
+    for (uint32_t i = 0; i < count && success; ++i) {
+        if (!states[i].unchanged) {
+            selected[(*selected_count)++] = i;
+        }
+    }
+    HashMap_Free(&listed);
+    HASHMAP_FREE_FN(states);
+    return success;
+}
+
+// Works like index_parse_yaml, with windows of INDEX_SCAN_WINDOW libraries
+// split into chunks of consecutive libraries.
+bool index_scan(IndexBuilder* builder, const IndexLibrary* libraries, uint32_t count, uint32_t kind,
+                IndexScanFn scan, void* ctx) {
+    uint32_t* selected = HASHMAP_ALLOC_FN(count * sizeof(uint32_t) + 1);
+    if (selected == NULL) {
+        return false;
+    }
+    uint32_t selected_count;
+    if (!select_libraries(builder, libraries, count, kind, selected, &selected_count)) {
+        HASHMAP_FREE_FN(selected);
+        return false;
+    }
+    uint32_t chunk_count = builder->parallel != NULL ? INDEX_PARSE_CHUNKS : 1;
+    ParseTask task;
+    task.builder = builder;
+    task.libraries = libraries;
+    task.selected = selected;
+    task.scan = scan;
+    task.scan_ctx = ctx;
+    task.chunks = HASHMAP_ALLOC_FN(chunk_count * sizeof(ParseChunk));
+    if (task.chunks == NULL) {
+        HASHMAP_FREE_FN(selected);
+        return false;
+    }
+    memset(task.chunks, 0, chunk_count * sizeof(ParseChunk));
+
+    bool success = true;
+    for (uint32_t begin = 0; begin < selected_count && success; begin += INDEX_SCAN_WINDOW) {
+        uint32_t window = selected_count - begin;
+        if (window > INDEX_SCAN_WINDOW) {
+            window = INDEX_SCAN_WINDOW;
+        }
+        task.chunk_count = window < chunk_count ? window : chunk_count;
+        for (uint32_t i = 0; i < task.chunk_count; ++i) {
+            ParseChunk* chunk = &task.chunks[i];
+            chunk->first_library = begin + (uint64_t)window * i / task.chunk_count;
+            chunk->library_count = begin + (uint64_t)window * (i + 1) / task.chunk_count - chunk->first_library;
+            chunk_reset(chunk);
+        }
+        run_task(builder, scan_chunks, &task, task.chunk_count, 1);
+        success = insert_chunks(&task, kind);
+        for (uint32_t i = 0; i < task.chunk_count; ++i) {
+            HashArena_Free(&task.chunks[i].names);
+        }
+    }
+
+    free_chunks(task.chunks, chunk_count);
+    HASHMAP_FREE_FN(selected);
+    return success;
+}
+
+bool index_copy_kinds(IndexBuilder* builder, const Index* index, uint32_t kinds) {
+    if (index->delta_info != NULL && builder->superseded != NULL) {
+        for (uint32_t i = 0; i < index->delta_info->base_paths && i < builder->base->paths->count; ++i) {
+            builder->superseded[i] |= index->delta_info->superseded[i] & kinds;
+        }
+    }
+    uint32_t path_count = index->paths->count;
+    uint32_t first = index->paths->first;
+    if (path_count == 0) {
+        return true;
+    }
+    if (!reserve_symbols(builder, index->key_count)) {
+        return false;
+    }
+    uint32_t* ids = HASHMAP_ALLOC_FN(path_count * sizeof(uint32_t));
+    if (ids == NULL) {
+        return false;
+    }
+    // Only the paths of the copied kinds are interned, ids are translated
+    // the first time they are seen.
+    for (uint32_t i = 0; i < path_count; ++i) {
+        ids[i] = UINT32_MAX;
+    }
+    bool success = true;
+    IndexKeyReader reader;
+    reader.index = NULL;
+    for (uint32_t pos = 0; pos < index->key_count && success; ++pos) {
+        const char* name = index_sorted_key(index, pos, &reader);
+        uint64_t h = HASHMAP_HASH_FN(name, reader.len);
+        IndexHit hit = {{reader.ids, NULL}, {reader.count, 0}, {reader.packed, false}};
+        IndexHitIterator it;
+        uint32_t old_id;
+        index_hit_begin(&hit, &it);
+        while (index_hit_next(&it, &old_id)) {
+            uint32_t id = old_id - first;
+            if (old_id < first || id >= path_count) {
+                continue;
+            }
+            uint32_t copied = index->paths->paths[id].kinds & kinds;
+            if (index->delta != NULL) {
+                copied &= ~index->delta->delta_info->superseded[id];
+            }
+            if (copied == 0) {
+                continue;
+            }
+            if (ids[id] == UINT32_MAX) {
+                const IndexPath* path = &index->paths->paths[id];
+                ids[id] = index_add_path(builder, (const char*)index->paths + path->name, path->len, copied);
+                if (ids[id] == UINT32_MAX) {
+                    success = false;
+                    break;
+                }
+                BuilderPath* copy = &builder->path_list[ids[id] - first_path(builder)];
+                for (uint32_t k = 0; k < INDEX_KIND_COUNT; ++k) {
+                    if (copied & (1 << k)) {
+                        copy->fingerprints[k] = path->fingerprints[k];
+                    }
+                }
+            }
+            if (!symbol_add(&builder->symbols[INDEX_SHARD(h)], ids[id], name, reader.len, h)) {
+                success = false;
+                break;
+            }
+        }
+    }
+    HASHMAP_FREE_FN(ids);
+    return success;
+}
+
+bool index_output_add(IndexOutput* out, uint32_t type, void* data, uint64_t size) {
+    uint64_t offset = (out->header.size + INDEX_SECTION_ALIGN - 1) & ~(uint64_t)(INDEX_SECTION_ALIGN - 1);
+    if (out->header.section_count == INDEX_MAX_SECTIONS || offset + size > UINT32_MAX) {
+        HASHMAP_FREE_FN(data);
+        return false;
+    }
+    IndexSection* section = &out->header.sections[out->header.section_count];
+    section->type = type;
+    section->offset = offset;
+    section->size = size;
+    out->data[out->header.section_count++] = data;
+    out->header.size = offset + size;
+    return true;
+}
+
+int index_key_cmp(const char* a, uint32_t a_len, const char* b, uint32_t b_len) {
+    int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (res != 0) {
+        return res;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+typedef int (*ItemCmp)(const void* ctx, uint32_t a, uint32_t b);
+
+// Stable bottom up merge sort of count items, tmp needs count entries
+void merge_sort(uint32_t* items, uint32_t* tmp, uint32_t count, ItemCmp cmp, const void* ctx) {
+    uint32_t* src = items;
+    uint32_t* dst = tmp;
+    for (uint32_t width = 1; width < count; width *= 2) {
+        for (uint32_t start = 0; start < count; start += 2 * width) {
+            uint32_t mid = start + width < count ? start + width : count;
+            uint32_t end = start + 2 * width < count ? start + 2 * width : count;
+            uint32_t i = start, j = mid, k = start;
+            while (i < mid && j < end) {
+                if (cmp(ctx, src[j], src[i]) < 0) {
+                    dst[k++] = src[j++];
+                } else {
+                    dst[k++] = src[i++];
+                }
+            }
+            while (i < mid) {
+                dst[k++] = src[i++];
+            }
+            while (j < end) {
+                dst[k++] = src[j++];
+            }
+        }
+        uint32_t* t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != items) {
+        memcpy(items, src, count * sizeof(uint32_t));
+    }
+}
+
+const char* index_basename(const char* path, uint32_t len) {
+    const char* base = path + len;
+    while (base > path && base[-1] != '/' && base[-1] != '\\') {
+        --base;
+    }
+    return base;
+}
+
+int basename_cmp(const void* ctx, uint32_t a, uint32_t b) {
+    const BuilderPath* paths = ctx;
+    const char* x = index_basename(paths[a].name, paths[a].len);
+    const char* y = index_basename(paths[b].name, paths[b].len);
+    return index_key_cmp(x, paths[a].name + paths[a].len - x, y, paths[b].name + paths[b].len - y);
+}
+
+int id_cmp(const void* ctx, uint32_t a, uint32_t b) {
+    return a < b ? -1 : a > b;
+}
+
+// Orders the paths of builder by basename, keeping the order of paths
+// with the same basename, and rewrites the postings of frozen to the new
+// ids, increasing and without repeats. Returns the builder path of each
+// new id.
+uint32_t* index_order_paths(const IndexBuilder* builder, HashMapFrozen* frozen) {
+    uint32_t count = builder->path_count;
+    uint32_t element_count;
+    HashFrozenElement* elements = (HashFrozenElement*)HashMap_FrozenElements(frozen, &element_count);
+    uint32_t longest = count;
+    for (uint32_t i = 0; i < element_count; ++i) {
+        if (elements[i].value_len / sizeof(uint32_t) > longest) {
+            longest = elements[i].value_len / sizeof(uint32_t);
+        }
+    }
+    uint32_t* order = HASHMAP_ALLOC_FN(2 * (uint64_t)count * sizeof(uint32_t) + 1);
+    uint32_t* tmp = HASHMAP_ALLOC_FN((uint64_t)longest * sizeof(uint32_t) + 1);
+    if (order == NULL || tmp == NULL) {
+        if (order != NULL) {
+            HASHMAP_FREE_FN(order);
+        }
+        if (tmp != NULL) {
+            HASHMAP_FREE_FN(tmp);
+        }
+        return NULL;
+    }
+    uint32_t* remap = order + count;
+    for (uint32_t i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    merge_sort(order, tmp, count, basename_cmp, builder->path_list);
+    for (uint32_t i = 0; i < count; ++i) {
+        remap[order[i]] = i;
+    }
+    uint32_t first = first_path(builder);
+    for (uint32_t i = 0; i < element_count; ++i) {
+        if (elements[i].value == 0) {
+            continue;
+        }
+        uint32_t* ids = (uint32_t*)(frozen->data + elements[i].value);
+        uint32_t id_count = elements[i].value_len / sizeof(uint32_t);
+        for (uint32_t j = 0; j < id_count; ++j) {
+            ids[j] = first + remap[ids[j] - first];
+        }
+        if (id_count <= 16) {
+            for (uint32_t j = 1; j < id_count; ++j) {
+                uint32_t id = ids[j];
+                uint32_t k = j;
+                for (; k > 0 && ids[k - 1] > id; --k) {
+                    ids[k] = ids[k - 1];
+                }
+                ids[k] = id;
+            }
+        } else {
+            merge_sort(ids, tmp, id_count, id_cmp, NULL);
+        }
+        // A library can be added again after other libraries
+        uint32_t kept = id_count > 0;
+        for (uint32_t j = 1; j < id_count; ++j) {
+            if (ids[j] != ids[kept - 1]) {
+                ids[kept++] = ids[j];
+            }
+        }
+        elements[i].value_len = kept * sizeof(uint32_t);
+    }
+    HASHMAP_FREE_FN(tmp);
+    return order;
+}
+
+void* index_build_paths(const IndexBuilder* builder, const uint32_t* order, uint64_t* size) {
+    uint64_t names_offset = sizeof(IndexPathTable) + builder->path_count * sizeof(IndexPath);
+    *size = names_offset;
+    for (uint32_t i = 0; i < builder->path_count; ++i) {
+        *size += builder->path_list[i].len + 1;
+    }
+    IndexPathTable* table = HASHMAP_ALLOC_FN(*size);
+    if (table == NULL) {
+        return NULL;
+    }
+    table->count = builder->path_count;
+    table->first = first_path(builder);
+    uint64_t offset = names_offset;
+    uint32_t basename = 0;
+    for (uint32_t i = 0; i < builder->path_count; ++i) {
+        const BuilderPath* path = &builder->path_list[order[i]];
+        if (i > 0 && basename_cmp(builder->path_list, order[i - 1], order[i]) != 0) {
+            ++basename;
+        }
+        table->paths[i].name = offset;
+        table->paths[i].len = path->len;
+        table->paths[i].kinds = path->kinds;
+        table->paths[i].basename = basename;
+        memcpy(table->paths[i].fingerprints, path->fingerprints, sizeof(table->paths[i].fingerprints));
+        memcpy((char*)table + offset, path->name, path->len + 1);
+        offset += path->len + 1;
+    }
+    return table;
+}
+
+uint32_t filter_block(const IndexFilter* filter, uint64_t h) {
+    return ((h >> 32) * filter->block_count) >> 32;
+}
+
+// The probes take the top bits of the remixed hash, which depend on every
+// bit of h
+uint64_t filter_probes(uint64_t h) {
+    return h * 0x9e3779b97f4a7c15ULL;
+}
+
+void* index_build_filter(const HashMapFrozen* frozen, uint64_t* size) {
+    uint32_t count;
+    const HashFrozenElement* elements = HashMap_FrozenElements(frozen, &count);
+    uint64_t block_bits = INDEX_FILTER_BLOCK_WORDS * 64;
+    uint32_t block_count = ((uint64_t)count * INDEX_FILTER_BITS_PER_KEY + block_bits - 1) / block_bits;
+    if (block_count == 0) {
+        block_count = 1;
+    }
+    *size = sizeof(IndexFilter) + (uint64_t)block_count * INDEX_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+    IndexFilter* filter = HASHMAP_ALLOC_FN(*size);
+    if (filter == NULL) {
+        return NULL;
+    }
+    memset(filter, 0, *size);
+    filter->block_count = block_count;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t* block = filter->blocks + (uint64_t)filter_block(filter, elements[i].hash) * INDEX_FILTER_BLOCK_WORDS;
+        uint64_t probes = filter_probes(elements[i].hash);
+        for (uint32_t p = 0; p < INDEX_FILTER_PROBES; ++p) {
+            uint32_t bit = probes >> 55;
+            probes <<= 9;
+            block[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+    return filter;
+}
+
+int index_element_cmp(const HashMapFrozen* map, const HashFrozenElement* elements, uint32_t a, uint32_t b) {
+    return index_key_cmp((const char*)map->data + elements[a].key, elements[a].key_len,
+                         (const char*)map->data + elements[b].key, elements[b].key_len);
+}
+
+typedef struct ElementOrder {
+    const HashMapFrozen* map;
+    const HashFrozenElement* elements;
+} ElementOrder;
+
+int element_cmp(const void* ctx, uint32_t a, uint32_t b) {
+    const ElementOrder* order = ctx;
+    return index_element_cmp(order->map, order->elements, a, b);
+}
+
+void* index_build_sorted(const HashMapFrozen* map, uint64_t* size) {
+    uint32_t count;
+    const HashFrozenElement* elements = HashMap_FrozenElements(map, &count);
+    *size = sizeof(IndexSortedTable) + count * sizeof(uint32_t);
+    IndexSortedTable* table = HASHMAP_ALLOC_FN(*size);
+    if (table == NULL) {
+        return NULL;
+    }
+    uint32_t* tmp = HASHMAP_ALLOC_FN(count * sizeof(uint32_t) + 1);
+    if (tmp == NULL) {
+        HASHMAP_FREE_FN(table);
+        return NULL;
+    }
+    table->count = count;
+    for (uint32_t i = 0; i < count; ++i) {
+        table->elements[i] = i;
+    }
+    ElementOrder order = {map, elements};
+    merge_sort(table->elements, tmp, count, element_cmp, &order);
+    HASHMAP_FREE_FN(tmp);
+    return table;
+}
+
+unsigned char fold_case(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+uint32_t trigram_byte(unsigned char c) {
+    return c >= 32 && c < 127 ? fold_case(c) - 32 : INDEX_TRIGRAM_ALPHABET - 1;
+}
+
+uint32_t trigram_code(const char* s) {
+    return (trigram_byte(s[0]) * INDEX_TRIGRAM_ALPHABET + trigram_byte(s[1])) * INDEX_TRIGRAM_ALPHABET +
+           trigram_byte(s[2]);
+}
+
+uint32_t varint_size(uint32_t v) {
+    uint32_t size = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+unsigned char* varint_write(unsigned char* p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+const unsigned char* varint_read(const unsigned char* p, uint32_t* v) {
+    uint32_t res = 0;
+    uint32_t shift = 0;
+    while (*p & 0x80) {
+        res |= (uint32_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = res | ((uint32_t)*p++ << shift);
+    return p;
+}
+
+void* index_build_trigrams(const HashMapFrozen* map, const IndexSortedTable* sorted, uint64_t* size) {
+    uint32_t element_count;
+    const HashFrozenElement* elements = HashMap_FrozenElements(map, &element_count);
+    uint32_t* counts = HASHMAP_ALLOC_FN(3 * INDEX_TRIGRAM_CODES * sizeof(uint32_t));
+    if (counts == NULL) {
+        return NULL;
+    }
+    // last holds the position + 1 of the last key added to each list. It
+    // both skips repeated trigrams within a key and gives the next delta.
+    uint32_t* bytes = counts + INDEX_TRIGRAM_CODES;
+    uint32_t* last = bytes + INDEX_TRIGRAM_CODES;
+    memset(counts, 0, 3 * INDEX_TRIGRAM_CODES * sizeof(uint32_t));
+    for (uint32_t pos = 0; pos < sorted->count; ++pos) {
+        const HashFrozenElement* elem = &elements[sorted->elements[pos]];
+        const char* key = (const char*)map->data + elem->key;
+        for (uint32_t j = 0; j + 3 <= elem->key_len; ++j) {
+            uint32_t c = trigram_code(key + j);
+            if (last[c] == pos + 1) {
+                continue;
+            }
+            bytes[c] += varint_size(last[c] == 0 ? pos : pos - (last[c] - 1));
+            counts[c] += 1;
+            last[c] = pos + 1;
+        }
+    }
+    uint32_t distinct = 0;
+    uint64_t postings = 0;
+    for (uint32_t c = 0; c < INDEX_TRIGRAM_CODES; ++c) {
+        if (counts[c] > 0) {
+            ++distinct;
+            postings += bytes[c];
+        }
+    }
+    *size = sizeof(IndexTrigramTable) + distinct * sizeof(IndexTrigram) + postings;
+    IndexTrigramTable* table = NULL;
+    if (*size <= UINT32_MAX) {
+        table = HASHMAP_ALLOC_FN(*size);
+    }
+    if (table == NULL) {
+        HASHMAP_FREE_FN(counts);
+        return NULL;
+    }
+    table->count = 0;
+    uint32_t offset = sizeof(IndexTrigramTable) + distinct * sizeof(IndexTrigram);
+    for (uint32_t c = 0; c < INDEX_TRIGRAM_CODES; ++c) {
+        if (counts[c] > 0) {
+            IndexTrigram* t = &table->trigrams[table->count++];
+            t->code = c;
+            t->count = counts[c];
+            t->offset = offset;
+            offset += bytes[c];
+            // Reused as the write position of the list
+            bytes[c] = t->offset;
+        }
+        last[c] = 0;
+    }
+    for (uint32_t pos = 0; pos < sorted->count; ++pos) {
+        const HashFrozenElement* elem = &elements[sorted->elements[pos]];
+        const char* key = (const char*)map->data + elem->key;
+        for (uint32_t j = 0; j + 3 <= elem->key_len; ++j) {
+            uint32_t c = trigram_code(key + j);
+            if (last[c] == pos + 1) {
+                continue;
+            }
+            unsigned char* p = (unsigned char*)table + bytes[c];
+            bytes[c] = varint_write(p, last[c] == 0 ? pos : pos - (last[c] - 1)) - (unsigned char*)table;
+            last[c] = pos + 1;
+        }
+    }
+    HASHMAP_FREE_FN(counts);
+    return table;
+}
+
+uint32_t zigzag(uint32_t prev, uint32_t id) {
+    int32_t delta = (int32_t)(id - prev);
+    return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+// Encodes the key of elem following the key of prev, which is NULL at the
+// start of a block. Only returns the size of the entry if p is NULL.
+uint64_t block_entry(const HashMapFrozen* map, const HashFrozenElement* prev, const HashFrozenElement* elem, unsigned char* p) {
+    const char* key = (const char*)map->data + elem->key;
+    uint32_t shared = 0;
+    if (prev != NULL) {
+        const char* prev_key = (const char*)map->data + prev->key;
+        while (shared < prev->key_len && shared < elem->key_len && prev_key[shared] == key[shared]) {
+            ++shared;
+        }
+    }
+    uint32_t suffix = elem->key_len - shared;
+    uint32_t count = elem->value == 0 ? 0 : elem->value_len / sizeof(uint32_t);
+    const uint32_t* ids = (const uint32_t*)(map->data + elem->value);
+    uint64_t size = varint_size(shared) + varint_size(suffix) + suffix + varint_size(count);
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        size += varint_size(zigzag(last, ids[i]));
+        last = ids[i];
+    }
+    if (p != NULL) {
+        p = varint_write(p, shared);
+        p = varint_write(p, suffix);
+        memcpy(p, key + shared, suffix);
+        p = varint_write(p + suffix, count);
+        last = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            p = varint_write(p, zigzag(last, ids[i]));
+            last = ids[i];
+        }
+    }
+    return size;
+}
+
+void* index_build_blocks(const HashMapFrozen* map, const IndexSortedTable* sorted, uint64_t* size) {
+    uint32_t element_count;
+    const HashFrozenElement* elements = HashMap_FrozenElements(map, &element_count);
+    uint32_t block_count = (sorted->count + INDEX_BLOCK_KEYS - 1) / INDEX_BLOCK_KEYS;
+    uint64_t offset = sizeof(IndexBlockTable) + (block_count + 1) * sizeof(uint32_t);
+    *size = offset;
+    for (uint32_t pos = 0; pos < sorted->count; ++pos) {
+        const HashFrozenElement* prev = pos % INDEX_BLOCK_KEYS == 0 ? NULL : &elements[sorted->elements[pos - 1]];
+        *size += block_entry(map, prev, &elements[sorted->elements[pos]], NULL);
+    }
+    IndexBlockTable* table = NULL;
+    if (*size <= UINT32_MAX) {
+        table = HASHMAP_ALLOC_FN(*size);
+    }
+    if (table == NULL) {
+        return NULL;
+    }
+    table->count = sorted->count;
+    table->block_count = block_count;
+    for (uint32_t pos = 0; pos < sorted->count; ++pos) {
+        const HashFrozenElement* prev = NULL;
+        if (pos % INDEX_BLOCK_KEYS == 0) {
+            table->blocks[pos / INDEX_BLOCK_KEYS] = offset;
+        } else {
+            prev = &elements[sorted->elements[pos - 1]];
+        }
+        offset += block_entry(map, prev, &elements[sorted->elements[pos]], (unsigned char*)table + offset);
+    }
+    table->blocks[block_count] = offset;
+    return table;
+}
+
+// A front coded block can only hold keys that fit the decode buffer
+bool keys_fit(const HashMapFrozen* map) {
+    uint32_t count;
+    const HashFrozenElement* elements = HashMap_FrozenElements(map, &count);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (elements[i].key_len > INDEX_KEY_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct UndecorateTask {
+    const HashMapFrozen* map;
+    const HashFrozenElement* elements;
+    const uint64_t* offsets;
+    char* names;
+    uint32_t* lengths;
+    uint32_t* name_offsets;
+    uint64_t* hashes; // Of the name with and without its scope
+} UndecorateTask;
+
+void undecorate_range(void* ctx, uint32_t begin, uint32_t end) {
+    UndecorateTask* task = ctx;
+    for (uint32_t i = begin; i < end; ++i) {
+        const HashFrozenElement* elem = &task->elements[i];
+        uint32_t capacity = task->offsets[i + 1] - task->offsets[i];
+        task->lengths[i] = 0;
+        if (capacity > 0) {
+            task->lengths[i] = undecorate((const char*)task->map->data + elem->key, elem->key_len,
+                                          task->names + task->offsets[i], capacity, &task->name_offsets[i]);
+        }
+        if (task->lengths[i] != 0) {
+            const char* name = task->names + task->offsets[i];
+            uint32_t scope = task->name_offsets[i];
+            task->hashes[2 * i] = HASHMAP_HASH_FN(name, task->lengths[i]);
+            if (scope > 0) {
+                task->hashes[2 * i + 1] = HASHMAP_HASH_FN(name + scope, task->lengths[i] - scope);
+            }
+        }
+    }
+}
+
+typedef struct UndecoratedName {
+    uint64_t hash;
+    const char* name;
+    uint32_t len;
+    uint32_t element; // Of the frozen map, which has the ids
+} UndecoratedName;
+
+int undecorated_cmp(const void* ctx, uint32_t a, uint32_t b) {
+    const UndecoratedName* names = ctx;
+    if (names[a].hash != names[b].hash) {
+        return names[a].hash < names[b].hash ? -1 : 1;
+    }
+    return index_key_cmp(names[a].name, names[a].len, names[b].name, names[b].len);
+}
+
+typedef struct PostingTask {
+    const HashMapFrozen* frozen;
+    const HashFrozenElement* elements;
+    const UndecoratedName* names;
+    uint32_t* order; // Names grouped by shard
+    uint32_t* tmp;
+    uint32_t shard_start[INDEX_SHARD_COUNT + 1];
+    HashMap shards[INDEX_SHARD_COUNT];
+    bool failed[INDEX_SHARD_COUNT];
+} PostingTask;
+
+// Sorts the names of a shard so that equal names are next to each other,
+// then inserts each name once with the union of the ids of its keys.
+bool merge_shard(PostingTask* task, uint32_t s) {
+    const UndecoratedName* names = task->names;
+    uint32_t first = task->shard_start[s];
+    uint32_t count = task->shard_start[s + 1] - first;
+    uint32_t* order = task->order + first;
+    HashMap* map = &task->shards[s];
+    if (!HashMap_Reserve(map, count)) {
+        return false;
+    }
+    merge_sort(order, task->tmp + first, count, undecorated_cmp, names);
+    uint32_t* ids = NULL;
+    uint32_t capacity = 0;
+    bool success = true;
+    uint32_t end;
+    for (uint32_t i = 0; i < count && success; i = end) {
+        const UndecoratedName* name = &names[order[i]];
+        uint32_t total = 0;
+        for (end = i; end < count && undecorated_cmp(names, order[i], order[end]) == 0; ++end) {
+            total += task->elements[names[order[end]].element].value_len / sizeof(uint32_t);
+        }
+        // Half for the ids, half for merge_sort
+        if (2 * total > capacity) {
+            if (ids != NULL) {
+                HASHMAP_FREE_FN(ids);
+            }
+            capacity = 2 * total;
+            ids = HASHMAP_ALLOC_FN((uint64_t)capacity * sizeof(uint32_t));
+            if (ids == NULL) {
+                success = false;
+                break;
+            }
+        }
+        uint32_t id_count = 0;
+        for (uint32_t j = i; j < end; ++j) {
+            const HashFrozenElement* elem = &task->elements[names[order[j]].element];
+            memcpy(ids + id_count, task->frozen->data + elem->value, elem->value_len);
+            id_count += elem->value_len / sizeof(uint32_t);
+        }
+        // The ids of a single key are already increasing and unique
+        if (end - i > 1 && id_count > 0) {
+            merge_sort(ids, ids + total, total, id_cmp, NULL);
+            id_count = 1;
+            for (uint32_t k = 1; k < total; ++k) {
+                if (ids[k] != ids[id_count - 1]) {
+                    ids[id_count++] = ids[k];
+                }
+            }
+        }
+        HashElement* elem = HashMap_GetHash(map, name->name, name->len, name->hash);
+        success = elem != NULL;
+        if (success && id_count > 0) {
+            uint32_t* value = HashMap_ArenaAlloc(map, id_count * sizeof(uint32_t));
+            success = value != NULL;
+            if (success) {
+                memcpy(value, ids, id_count * sizeof(uint32_t));
+                elem->value = (char*)value;
+                elem->value_len = id_count * sizeof(uint32_t);
+            }
+        }
+    }
+    if (ids != NULL) {
+        HASHMAP_FREE_FN(ids);
+    }
+    return success;
+}
+
+void merge_shards(void* ctx, uint32_t begin, uint32_t end) {
+    PostingTask* task = ctx;
+    for (uint32_t s = begin; s < end; ++s) {
+        task->failed[s] = !merge_shard(task, s);
+    }
+}
+
+// Undecorating is done in parallel into one slot per element, then the
+// names are split into shards that are merged in parallel.
+bool index_build_undecorated(const IndexBuilder* builder, const HashMapFrozen* frozen, HashMapFrozen* out) {
+    uint32_t count;
+    const HashFrozenElement* elements = HashMap_FrozenElements(frozen, &count);
+    UndecorateTask task;
+    task.map = frozen;
+    task.elements = elements;
+    uint64_t* offsets = HASHMAP_ALLOC_FN((count + 1) * sizeof(uint64_t));
+    uint32_t* lengths = HASHMAP_ALLOC_FN(2 * count * sizeof(uint32_t) + 1);
+    uint64_t* hashes = HASHMAP_ALLOC_FN(2 * count * sizeof(uint64_t) + 1);
+    if (offsets == NULL || lengths == NULL || hashes == NULL) {
+        if (offsets != NULL) {
+            HASHMAP_FREE_FN(offsets);
+        }
+        if (lengths != NULL) {
+            HASHMAP_FREE_FN(lengths);
+        }
+        if (hashes != NULL) {
+            HASHMAP_FREE_FN(hashes);
+        }
+        return false;
+    }
+    offsets[0] = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const char* key = (const char*)frozen->data + elements[i].key;
+        // Names that need more room than this are skipped
+        uint32_t capacity = key[0] == '?' ? elements[i].key_len + INDEX_UNDECORATE_SLACK : 0;
+        offsets[i + 1] = offsets[i] + capacity;
+    }
+    char* names = HASHMAP_ALLOC_FN(offsets[count] + 1);
+    if (names == NULL) {
+        HASHMAP_FREE_FN(offsets);
+        HASHMAP_FREE_FN(lengths);
+        HASHMAP_FREE_FN(hashes);
+        return false;
+    }
+    task.offsets = offsets;
+    task.names = names;
+    task.lengths = lengths;
+    task.name_offsets = lengths + count;
+    task.hashes = hashes;
+    run_task(builder, undecorate_range, &task, count, INDEX_UNDECORATE_GRAIN);
+
+    // Names with and without their scope, grouped by shard
+    uint32_t name_count = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        name_count += (lengths[i] != 0) + (lengths[i] != 0 && task.name_offsets[i] > 0);
+    }
+    PostingTask merge;
+    memset(&merge, 0, sizeof(merge));
+    merge.frozen = frozen;
+    merge.elements = elements;
+    UndecoratedName* list = HASHMAP_ALLOC_FN((uint64_t)name_count * sizeof(UndecoratedName) + 1);
+    merge.order = HASHMAP_ALLOC_FN(2 * (uint64_t)name_count * sizeof(uint32_t) + 1);
+    bool success = list != NULL && merge.order != NULL;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count && success; ++i) {
+        uint32_t variants = lengths[i] == 0 ? 0 : 1 + (task.name_offsets[i] > 0);
+        for (uint32_t v = 0; v < variants; ++v) {
+            uint32_t scope = v == 0 ? 0 : task.name_offsets[i];
+            UndecoratedName* name = &list[n++];
+            name->hash = hashes[2 * i + v];
+            name->name = names + offsets[i] + scope;
+            name->len = lengths[i] - scope;
+            name->element = i;
+            ++merge.shard_start[INDEX_SHARD(name->hash) + 1];
+        }
+    }
+    if (success) {
+        for (uint32_t s = 0; s < INDEX_SHARD_COUNT; ++s) {
+            merge.shard_start[s + 1] += merge.shard_start[s];
+        }
+        uint32_t next[INDEX_SHARD_COUNT];
+        memcpy(next, merge.shard_start, sizeof(next));
+        for (uint32_t i = 0; i < name_count; ++i) {
+            merge.order[next[INDEX_SHARD(list[i].hash)]++] = i;
+        }
+        merge.names = list;
+        merge.tmp = merge.order + name_count;
+    }
+    uint32_t created = 0;
+    while (success && created < INDEX_SHARD_COUNT) {
+        success = HashMap_CreateArena(&merge.shards[created]);
+        created += success;
+    }
+    if (success) {
+        run_task(builder, merge_shards, &merge, INDEX_SHARD_COUNT, 1);
+        for (uint32_t s = 0; s < INDEX_SHARD_COUNT; ++s) {
+            success = success && !merge.failed[s];
+        }
+    }
+    if (list != NULL) {
+        HASHMAP_FREE_FN(list);
+    }
+    if (merge.order != NULL) {
+        HASHMAP_FREE_FN(merge.order);
+    }
+    HASHMAP_FREE_FN(names);
+    HASHMAP_FREE_FN(offsets);
+    HASHMAP_FREE_FN(lengths);
+    HASHMAP_FREE_FN(hashes);
+    if (success) {
+        success = HashMap_FreezePerfectShards(merge.shards, INDEX_SHARD_COUNT, builder->parallel, out) ||
+                  HashMap_FreezeShards(merge.shards, INDEX_SHARD_COUNT, out);
+    }
+    for (uint32_t s = 0; s < created; ++s) {
+        HashMap_Free(&merge.shards[s]);
+    }
+    return success;
+}
+
+bool index_build(IndexBuilder* builder, IndexOutput* out) {
+    memset(out, 0, sizeof(IndexOutput));
+    out->header.magic = INDEX_MAGIC;
+    out->header.version = INDEX_VERSION;
+    out->header.size = sizeof(IndexHeader);
+    memcpy(out->header.sources, builder->sources, sizeof(builder->sources));
+
+    // The key set is final, so prefer a perfect hash and fall back to
+    // the chained layout if no displacement could be found.
+    HashMapFrozen frozen;
+    if (!HashMap_FreezePerfectShards(builder->symbols, INDEX_SHARD_COUNT, builder->parallel, &frozen) &&
+        !HashMap_FreezeShards(builder->symbols, INDEX_SHARD_COUNT, &frozen)) {
+        return false;
+    }
+    uint32_t* order = index_order_paths(builder, &frozen);
+    uint64_t sorted_size;
+    void* sorted = NULL;
+    if (order != NULL) {
+        sorted = index_build_sorted(&frozen, &sorted_size);
+    }
+    if (sorted == NULL) {
+        if (order != NULL) {
+            HASHMAP_FREE_FN(order);
+        }
+        HASHMAP_FREE_FN((void*)frozen.data);
+        return false;
+    }
+    // The filter goes first, next to the header, as lookups read it before
+    // any other section.
+    bool success = true;
+    if (builder->flags & INDEX_BUILD_FILTER) {
+        uint64_t filter_size;
+        void* filter = index_build_filter(&frozen, &filter_size);
+        success = filter != NULL && index_output_add(out, INDEX_SECTION_FILTER, filter, filter_size);
+    }
+    // A compressed index only keeps the frozen map and sorted table until
+    // the other sections are built from them.
+    bool compressed = (builder->flags & INDEX_BUILD_COMPRESSED) && keys_fit(&frozen);
+    if (success && compressed) {
+        uint64_t blocks_size;
+        void* blocks = index_build_blocks(&frozen, sorted, &blocks_size);
+        success = blocks != NULL && index_output_add(out, INDEX_SECTION_BLOCKS, blocks, blocks_size);
+    } else if (success) {
+        success = index_output_add(out, INDEX_SECTION_SYMBOLS, (void*)frozen.data, frozen.data_size);
+        if (success) {
+            success = index_output_add(out, INDEX_SECTION_SORTED, sorted, sorted_size);
+        } else {
+            HASHMAP_FREE_FN(sorted);
+        }
+    } else if (!compressed) {
+        HASHMAP_FREE_FN((void*)frozen.data);
+        HASHMAP_FREE_FN(sorted);
+    }
+    if (success && (builder->flags & INDEX_BUILD_TRIGRAMS)) {
+        uint64_t trigrams_size;
+        void* trigrams = index_build_trigrams(&frozen, sorted, &trigrams_size);
+        success = trigrams != NULL && index_output_add(out, INDEX_SECTION_TRIGRAMS, trigrams, trigrams_size);
+    }
+    if (success && (builder->flags & INDEX_BUILD_UNDECORATED)) {
+        HashMapFrozen undecorated;
+        success = index_build_undecorated(builder, &frozen, &undecorated) &&
+                  index_output_add(out, INDEX_SECTION_UNDECORATED, (void*)undecorated.data, undecorated.data_size);
+    }
+    if (compressed) {
+        HASHMAP_FREE_FN((void*)frozen.data);
+        HASHMAP_FREE_FN(sorted);
+    }
+    uint64_t size;
+    void* paths = NULL;
+    if (success) {
+        paths = index_build_paths(builder, order, &size);
+    }
+    HASHMAP_FREE_FN(order);
+    if (!success || paths == NULL || !index_output_add(out, INDEX_SECTION_PATHS, paths, size)) {
+        index_output_free(out);
+        return false;
+    }
+    if (builder->base != NULL) {
+        const IndexHeader* base_header = (const IndexHeader*)builder->base->data;
+        uint32_t base_paths = builder->base->paths->count;
+        size = sizeof(IndexDelta) + base_paths * sizeof(uint32_t);
+        IndexDelta* delta = HASHMAP_ALLOC_FN(size);
+        if (delta == NULL) {
+            index_output_free(out);
+            return false;
+        }
+        delta->base_size = builder->base->size;
+        delta->base_paths = base_paths;
+        memcpy(delta->base_sources, base_header->sources, sizeof(delta->base_sources));
+        memcpy(delta->superseded, builder->superseded, base_paths * sizeof(uint32_t));
+        if (!index_output_add(out, INDEX_SECTION_DELTA, delta, size)) {
+            index_output_free(out);
+            return false;
+        }
+    }
+    return true;
+}
+
+void index_output_free(IndexOutput* out) {
+    for (uint32_t i = 0; i < out->header.section_count; ++i) {
+        HASHMAP_FREE_FN(out->data[i]);
+        out->data[i] = NULL;
+    }
+    out->header.section_count = 0;
+}
+
+const void* index_section(const Index* index, uint32_t type, uint32_t* size) {
+    const IndexHeader* header = (const IndexHeader*)index->data;
+    for (uint32_t i = 0; i < header->section_count; ++i) {
+        if (header->sections[i].type == type) {
+            *size = header->sections[i].size;
+            return index->data + header->sections[i].offset;
+        }
+    }
+    return NULL;
+}
+
+bool index_open(Index* index, const void* data, uint64_t size) {
+    const IndexHeader* header = data;
+    if (size < sizeof(IndexHeader) || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+        header->size > size || header->section_count > INDEX_MAX_SECTIONS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->section_count; ++i) {
+        if ((uint64_t)header->sections[i].offset + header->sections[i].size > header->size) {
+            return false;
+        }
+    }
+    index->data = data;
+    index->size = header->size;
+
+    uint32_t len;
+    index->symbols.data = NULL;
+    index->sorted = NULL;
+    index->blocks = index_section(index, INDEX_SECTION_BLOCKS, &index->blocks_size);
+    if (index->blocks != NULL) {
+        // Block offsets are checked as the blocks are read
+        if (index->blocks_size < sizeof(IndexBlockTable) ||
+            index->blocks->block_count != index->blocks->count / INDEX_BLOCK_KEYS + (index->blocks->count % INDEX_BLOCK_KEYS != 0) ||
+            sizeof(IndexBlockTable) + ((uint64_t)index->blocks->block_count + 1) * sizeof(uint32_t) > index->blocks_size) {
+            return false;
+        }
+        index->key_count = index->blocks->count;
+    } else {
+        const void* symbols = index_section(index, INDEX_SECTION_SYMBOLS, &len);
+        if (symbols == NULL || !HashMap_FrozenOpen(&index->symbols, symbols, len)) {
+            return false;
+        }
+        uint32_t element_count;
+        HashMap_FrozenElements(&index->symbols, &element_count);
+        index->sorted = index_section(index, INDEX_SECTION_SORTED, &len);
+        if (index->sorted == NULL || len < sizeof(IndexSortedTable) || index->sorted->count != element_count ||
+            sizeof(IndexSortedTable) + (uint64_t)index->sorted->count * sizeof(uint32_t) > len) {
+            return false;
+        }
+        index->key_count = element_count;
+    }
+    index->paths = index_section(index, INDEX_SECTION_PATHS, &len);
+    if (index->paths == NULL || len < sizeof(IndexPathTable) ||
+        sizeof(IndexPathTable) + (uint64_t)index->paths->count * sizeof(IndexPath) > len ||
+        (uint64_t)index->paths->first + index->paths->count > UINT32_MAX) {
+        return false;
+    }
+    index->trigrams = index_section(index, INDEX_SECTION_TRIGRAMS, &index->trigrams_size);
+    if (index->trigrams != NULL && (index->trigrams_size < sizeof(IndexTrigramTable) ||
+        sizeof(IndexTrigramTable) + (uint64_t)index->trigrams->count * sizeof(IndexTrigram) > index->trigrams_size)) {
+        return false;
+    }
+    const void* undecorated = index_section(index, INDEX_SECTION_UNDECORATED, &len);
+    index->undecorated.data = NULL;
+    if (undecorated != NULL && !HashMap_FrozenOpen(&index->undecorated, undecorated, len)) {
+        return false;
+    }
+    index->filter = index_section(index, INDEX_SECTION_FILTER, &len);
+    if (index->filter != NULL && (len < sizeof(IndexFilter) || index->filter->block_count == 0 ||
+        sizeof(IndexFilter) + (uint64_t)index->filter->block_count * INDEX_FILTER_BLOCK_WORDS * sizeof(uint64_t) > len)) {
+        return false;
+    }
+    index->delta_info = index_section(index, INDEX_SECTION_DELTA, &len);
+    if (index->delta_info != NULL && (len < sizeof(IndexDelta) ||
+        sizeof(IndexDelta) + (uint64_t)index->delta_info->base_paths * sizeof(uint32_t) > len)) {
+        return false;
+    }
+    index->delta = NULL;
+    return true;
+}
+
+bool index_attach_delta(Index* index, const Index* delta) {
+    const IndexHeader* header = (const IndexHeader*)index->data;
+    const IndexDelta* info = delta->delta_info;
+    if (info == NULL || info->base_size != index->size || info->base_paths != index->paths->count ||
+        delta->paths->first != index->paths->count ||
+        memcmp(info->base_sources, header->sources, sizeof(info->base_sources)) != 0) {
+        return false;
+    }
+    index->delta = delta;
+    return true;
+}
+
+const uint32_t* find_ids(const HashMapFrozen* map, const char* key, uint32_t* count) {
+    const HashFrozenElement* elem = HashMap_FrozenFind(map, key);
+    *count = 0;
+    if (elem == NULL || elem->value == 0) {
+        return NULL;
+    }
+    *count = elem->value_len / sizeof(uint32_t);
+    return (const uint32_t*)(map->data + elem->value);
+}
+
+void index_hit_begin(const IndexHit* hit, IndexHitIterator* it) {
+    it->hit = hit;
+    it->segment = 0;
+    it->ix = 0;
+    it->p = hit->ids[0];
+    it->id = 0;
+}
+
+bool index_hit_next(IndexHitIterator* it, uint32_t* id) {
+    const IndexHit* hit = it->hit;
+    while (it->segment < INDEX_SEGMENT_COUNT && (hit->ids[it->segment] == NULL || it->ix == hit->count[it->segment])) {
+        if (++it->segment < INDEX_SEGMENT_COUNT) {
+            it->ix = 0;
+            it->p = hit->ids[it->segment];
+            it->id = 0;
+        }
+    }
+    if (it->segment == INDEX_SEGMENT_COUNT) {
+        return false;
+    }
+    if (hit->packed[it->segment]) {
+        uint32_t v;
+        it->p = varint_read(it->p, &v);
+        it->id += (v >> 1) ^ (0 - (v & 1));
+    } else {
+        it->id = ((const uint32_t*)it->p)[it->ix];
+    }
+    ++it->ix;
+    *id = it->id;
+    return true;
+}
+
+// Returns the bytes of a block, an empty range if its offsets are damaged
+const unsigned char* block_range(const Index* index, uint32_t block, const unsigned char** end) {
+    const IndexBlockTable* table = index->blocks;
+    uint32_t begin = table->blocks[block];
+    uint32_t last = table->blocks[block + 1];
+    if (last > index->blocks_size || begin > last) {
+        begin = last = sizeof(IndexBlockTable);
+    }
+    *end = (const unsigned char*)table + last;
+    return (const unsigned char*)table + begin;
+}
+
+// Decodes the key at reader->next, which follows the key in buffer
+void read_entry(IndexKeyReader* reader, const unsigned char* end) {
+    const unsigned char* p = reader->next;
+    uint32_t shared = 0, suffix = 0;
+    reader->count = 0;
+    if (p < end) {
+        p = varint_read(p, &shared);
+    }
+    if (p < end) {
+        p = varint_read(p, &suffix);
+    }
+    // Only a damaged index has lengths out of range
+    if (shared > reader->len) {
+        shared = reader->len;
+    }
+    if (p > end) {
+        p = end;
+    }
+    if (suffix > INDEX_KEY_MAX - shared) {
+        suffix = INDEX_KEY_MAX - shared;
+    }
+    if (suffix > end - p) {
+        suffix = end - p;
+    }
+    memcpy(reader->buffer + shared, p, suffix);
+    reader->len = shared + suffix;
+    reader->buffer[reader->len] = '\0';
+    p += suffix;
+    if (p < end) {
+        p = varint_read(p, &reader->count);
+    }
+    reader->ids = p;
+    uint32_t count = 0;
+    for (; count < reader->count && p < end; ++count) {
+        while (p < end && (*p++ & 0x80)) {
+        }
+    }
+    reader->count = count;
+    reader->next = p;
+}
+
+const char* index_sorted_key(const Index* index, uint32_t pos, IndexKeyReader* reader) {
+    if (index->blocks == NULL) {
+        uint32_t element_count;
+        const HashFrozenElement* elements = HashMap_FrozenElements(&index->symbols, &element_count);
+        const HashFrozenElement* elem = &elements[index->sorted->elements[pos]];
+        reader->index = index;
+        reader->pos = pos;
+        reader->key = (const char*)index->symbols.data + elem->key;
+        reader->len = elem->key_len;
+        reader->ids = index->symbols.data + elem->value;
+        reader->count = elem->value == 0 ? 0 : elem->value_len / sizeof(uint32_t);
+        reader->packed = false;
+        return reader->key;
+    }
+    uint32_t block = pos / INDEX_BLOCK_KEYS;
+    const unsigned char* end;
+    const unsigned char* begin = block_range(index, block, &end);
+    if (reader->index != index || pos < reader->pos || block != reader->pos / INDEX_BLOCK_KEYS) {
+        reader->index = index;
+        reader->pos = block * INDEX_BLOCK_KEYS;
+        reader->len = 0;
+        reader->next = begin;
+        read_entry(reader, end);
+    }
+    while (reader->pos < pos) {
+        ++reader->pos;
+        read_entry(reader, end);
+    }
+    reader->key = reader->buffer;
+    reader->packed = true;
+    return reader->key;
+}
+
+// Compares the first key of a block, which is stored whole, with key
+int block_key_cmp(const Index* index, uint32_t block, const char* key, uint32_t len) {
+    const unsigned char* end;
+    const unsigned char* p = block_range(index, block, &end);
+    uint32_t shared = 0, first_len = 0;
+    if (p < end) {
+        p = varint_read(p, &shared);
+    }
+    if (p < end) {
+        p = varint_read(p, &first_len);
+    }
+    if (p > end) {
+        p = end;
+    }
+    if (first_len > end - p) {
+        first_len = end - p;
+    }
+    return index_key_cmp((const char*)p, first_len, key, len);
+}
+
+// First position whose key is not less than key, in a compressed index.
+// reader is left at that position, unless it is the end of a block.
+uint32_t block_lower_bound(const Index* index, const char* key, uint32_t len, IndexKeyReader* reader) {
+    const IndexBlockTable* table = index->blocks;
+    if (table->block_count == 0) {
+        return 0;
+    }
+    // Last block whose first key is not greater than key, or the first
+    uint32_t low = 0, high = table->block_count;
+    while (high - low > 1) {
+        uint32_t mid = (low + high) / 2;
+        if (block_key_cmp(index, mid, key, len) <= 0) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    uint32_t pos = low * INDEX_BLOCK_KEYS;
+    uint32_t end = pos + INDEX_BLOCK_KEYS < table->count ? pos + INDEX_BLOCK_KEYS : table->count;
+    for (; pos < end; ++pos) {
+        const char* k = index_sorted_key(index, pos, reader);
+        if (index_key_cmp(k, reader->len, key, len) >= 0) {
+            break;
+        }
+    }
+    return pos;
+}
+
+bool filter_contains(const IndexFilter* filter, uint64_t h) {
+    const uint64_t* block = filter->blocks + (uint64_t)filter_block(filter, h) * INDEX_FILTER_BLOCK_WORDS;
+    uint64_t probes = filter_probes(h);
+    for (uint32_t p = 0; p < INDEX_FILTER_PROBES; ++p) {
+        uint32_t bit = probes >> 55;
+        probes <<= 9;
+        if (!(block[bit / 64] & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool index_may_contain(const Index* index, const char* key, uint32_t len) {
+    return index->filter == NULL || filter_contains(index->filter, HASHMAP_HASH_FN(key, len));
+}
+
+// Looks key up in a single segment, filling in segment s of hit
+bool segment_find(const Index* index, const char* key, uint32_t len, uint64_t h, IndexHit* hit, uint32_t s) {
+    hit->ids[s] = NULL;
+    hit->count[s] = 0;
+    hit->packed[s] = index->blocks != NULL;
+    if (index->filter != NULL && !filter_contains(index->filter, h)) {
+        return false;
+    }
+    if (index->blocks == NULL) {
+        const HashFrozenElement* elem = HashMap_FrozenFindHash(&index->symbols, key, len, h);
+        if (elem != NULL && elem->value != 0) {
+            hit->ids[s] = index->symbols.data + elem->value;
+            hit->count[s] = elem->value_len / sizeof(uint32_t);
+        }
+        return hit->ids[s] != NULL;
+    }
+    IndexKeyReader reader;
+    reader.index = NULL;
+    uint32_t pos = block_lower_bound(index, key, len, &reader);
+    if (pos < index->key_count && reader.index != NULL && reader.pos == pos && reader.len == len &&
+        memcmp(reader.key, key, len) == 0 && reader.count > 0) {
+        hit->ids[s] = reader.ids;
+        hit->count[s] = reader.count;
+    }
+    return hit->ids[s] != NULL;
+}
+
+// Counts the comparisons of block_lower_bound and segment_find, the
+// binary search over blocks depends only on which block holds the key.
+void index_stats(const Index* index, IndexStats* stats) {
+    memset(stats, 0, sizeof(IndexStats));
+    stats->key_count = index->key_count;
+    if (index->blocks == NULL) {
+        HashMap_FrozenStats(&index->symbols, &stats->symbols);
+        stats->compares = stats->symbols.compares;
+    } else {
+        const IndexBlockTable* table = index->blocks;
+        stats->block_count = table->block_count;
+        for (uint32_t block = 0; block < table->block_count; ++block) {
+            uint32_t steps = 0;
+            uint32_t low = 0, high = table->block_count;
+            while (high - low > 1) {
+                uint32_t mid = (low + high) / 2;
+                if (mid <= block) {
+                    low = mid;
+                } else {
+                    high = mid;
+                }
+                ++steps;
+            }
+            uint32_t first = block * INDEX_BLOCK_KEYS;
+            if (first >= table->count) {
+                break;
+            }
+            uint32_t keys = first + INDEX_BLOCK_KEYS < table->count ? INDEX_BLOCK_KEYS : table->count - first;
+            // The key at position i of its block is the (i + 1)th compared,
+            // followed by the final match
+            stats->compares += (uint64_t)keys * steps + (uint64_t)keys * (keys + 1) / 2 + keys;
+        }
+    }
+    if (index->undecorated.data != NULL) {
+        HashMap_FrozenStats(&index->undecorated, &stats->undecorated);
+    }
+    if (index->filter != NULL) {
+        stats->filter_blocks = index->filter->block_count;
+        uint64_t words = (uint64_t)index->filter->block_count * INDEX_FILTER_BLOCK_WORDS;
+        for (uint64_t i = 0; i < words; ++i) {
+            for (uint64_t w = index->filter->blocks[i]; w != 0; w &= w - 1) {
+                ++stats->filter_bits;
+            }
+        }
+    }
+}
+
+bool index_lookup(const Index* index, const char* symbol, IndexHit* hit) {
+    uint32_t len = strlen(symbol);
+    uint64_t h = HASHMAP_HASH_FN(symbol, len);
+    bool found = segment_find(index, symbol, len, h, hit, 0);
+    hit->ids[1] = NULL;
+    hit->count[1] = 0;
+    hit->packed[1] = false;
+    if (index->delta != NULL) {
+        found = segment_find(index->delta, symbol, len, h, hit, 1) || found;
+    }
+    return found;
+}
+
+bool index_lookup_undecorated(const Index* index, const char* name, IndexHit* hit) {
+    for (uint32_t s = 0; s < INDEX_SEGMENT_COUNT; ++s) {
+        hit->ids[s] = NULL;
+        hit->count[s] = 0;
+        hit->packed[s] = false;
+    }
+    if (index->undecorated.data != NULL) {
+        hit->ids[0] = find_ids(&index->undecorated, name, &hit->count[0]);
+    }
+    if (index->delta != NULL && index->delta->undecorated.data != NULL) {
+        hit->ids[1] = find_ids(&index->delta->undecorated, name, &hit->count[1]);
+    }
+    return hit->ids[0] != NULL || hit->ids[1] != NULL;
+}
+
+void index_find_batch(const Index* index, IndexQuery* queries, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        queries[i].hash = HASHMAP_HASH_FN(queries[i].symbol, queries[i].len);
+    }
+    // Buckets are fetched two distances ahead of the lookup and elements
+    // one distance ahead, by then the bucket should be in cache. Blocks
+    // are found by binary search, so there is nothing to fetch ahead.
+    for (uint32_t i = 0; index->blocks != NULL && i < count; ++i) {
+        segment_find(index, queries[i].symbol, queries[i].len, queries[i].hash, &queries[i].hit, 0);
+    }
+    for (uint32_t i = 0; index->blocks == NULL && i < count + 2 * INDEX_PREFETCH_DISTANCE; ++i) {
+        if (i < count) {
+            HashMap_FrozenPrefetch(&index->symbols, queries[i].hash);
+        }
+        if (i >= INDEX_PREFETCH_DISTANCE && i - INDEX_PREFETCH_DISTANCE < count) {
+            HashMap_FrozenPrefetchElement(&index->symbols, queries[i - INDEX_PREFETCH_DISTANCE].hash);
+        }
+        if (i < 2 * INDEX_PREFETCH_DISTANCE || i - 2 * INDEX_PREFETCH_DISTANCE >= count) {
+            continue;
+        }
+        IndexQuery* q = &queries[i - 2 * INDEX_PREFETCH_DISTANCE];
+        segment_find(index, q->symbol, q->len, q->hash, &q->hit, 0);
+    }
+    // The delta is small enough to stay in cache
+    for (uint32_t i = 0; i < count; ++i) {
+        IndexQuery* q = &queries[i];
+        q->hit.ids[1] = NULL;
+        q->hit.count[1] = 0;
+        q->hit.packed[1] = false;
+        if (index->delta != NULL) {
+            segment_find(index->delta, q->symbol, q->len, q->hash, &q->hit, 1);
+        }
+    }
+}
+
+const char* segment_path(const Index* index, uint32_t id, uint32_t* len, uint32_t* kinds) {
+    if (id < index->paths->first || id - index->paths->first >= index->paths->count) {
+        return NULL;
+    }
+    const IndexPath* path = &index->paths->paths[id - index->paths->first];
+    *len = path->len;
+    *kinds = path->kinds;
+    return (const char*)index->paths + path->name;
+}
+
+const char* index_path(const Index* index, uint32_t id, uint32_t* len, uint32_t* kinds) {
+    if (index->delta == NULL) {
+        return segment_path(index, id, len, kinds);
+    }
+    if (id >= index->delta->paths->first) {
+        return segment_path(index->delta, id, len, kinds);
+    }
+    const char* path = segment_path(index, id, len, kinds);
+    if (path != NULL) {
+        *kinds &= ~index->delta->delta_info->superseded[id];
+        if (*kinds == 0) {
+            return NULL;
+        }
+    }
+    return path;
+}
+
+bool index_has_kind(const Index* index, const IndexHit* hit, uint32_t kinds) {
+    IndexHitIterator it;
+    uint32_t id;
+    index_hit_begin(hit, &it);
+    while (index_hit_next(&it, &id)) {
+        uint32_t len, path_kinds;
+        if (index_path(index, id, &len, &path_kinds) != NULL && (path_kinds & kinds)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t index_path_basename(const Index* index, uint32_t id) {
+    const IndexPathTable* paths = index->paths;
+    if (index->delta != NULL && id >= index->delta->paths->first) {
+        // Delta basenames are numbered after those of the base
+        uint32_t base_count = paths->count == 0 ? 0 : paths->paths[paths->count - 1].basename + 1;
+        paths = index->delta->paths;
+        return id - paths->first < paths->count ? base_count + paths->paths[id - paths->first].basename : UINT32_MAX;
+    }
+    return id - paths->first < paths->count ? paths->paths[id - paths->first].basename : UINT32_MAX;
+}
+
+// First position in the sorted order whose key is not less than key
+uint32_t index_lower_bound(const Index* index, const char* key, uint32_t len, IndexKeyReader* reader) {
+    if (index->blocks != NULL) {
+        return block_lower_bound(index, key, len, reader);
+    }
+    uint32_t count;
+    const HashFrozenElement* elements = HashMap_FrozenElements(&index->symbols, &count);
+    uint32_t low = 0, high = index->sorted->count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        const HashFrozenElement* elem = &elements[index->sorted->elements[mid]];
+        if (index_key_cmp((const char*)index->symbols.data + elem->key, elem->key_len, key, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void cursor_init(const Index* index, const char* prefix, uint32_t prefix_len, const char* pattern, IndexCursor* cursor) {
+    cursor->segments[0] = index;
+    cursor->segments[1] = index->delta;
+    cursor->prefix = prefix;
+    cursor->prefix_len = prefix_len;
+    cursor->pattern = pattern;
+    for (uint32_t s = 0; s < INDEX_SEGMENT_COUNT; ++s) {
+        cursor->pos[s] = 0;
+        cursor->readers[s].index = NULL;
+        if (cursor->segments[s] != NULL) {
+            cursor->pos[s] = index_lower_bound(cursor->segments[s], prefix, prefix_len, &cursor->readers[s]);
+        }
+    }
+}
+
+void index_match_prefix(const Index* index, const char* prefix, IndexCursor* cursor) {
+    cursor_init(index, prefix, strlen(prefix), NULL, cursor);
+}
+
+void index_match_glob(const Index* index, const char* pattern, IndexCursor* cursor) {
+    uint32_t len = 0;
+    while (pattern[len] != '\0' && pattern[len] != '*' && pattern[len] != '?') {
+        ++len;
+    }
+    cursor_init(index, pattern, len, pattern, cursor);
+}
+
+bool glob_match(const char* pattern, const char* str) {
+    const char* star = NULL;
+    const char* retry = NULL;
+    while (*str != '\0') {
+        if (*pattern == '*') {
+            star = ++pattern;
+            retry = str;
+        } else if (*pattern == '?' || *pattern == *str) {
+            ++pattern;
+            ++str;
+        } else if (star != NULL) {
+            // Let the last star swallow one more character
+            pattern = star;
+            str = ++retry;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') {
+        ++pattern;
+    }
+    return *pattern == '\0';
+}
+
+// Moves the position of a segment to its next matching key, without
+// consuming it. The key is left in the reader of the segment.
+bool cursor_peek(IndexCursor* cursor, uint32_t s) {
+    const Index* index = cursor->segments[s];
+    if (index == NULL) {
+        return false;
+    }
+    IndexKeyReader* reader = &cursor->readers[s];
+    while (cursor->pos[s] < index->key_count) {
+        const char* key = index_sorted_key(index, cursor->pos[s], reader);
+        if (reader->len < cursor->prefix_len || memcmp(key, cursor->prefix, cursor->prefix_len) != 0) {
+            cursor->pos[s] = index->key_count;
+            return false;
+        }
+        if (reader->count > 0 && (cursor->pattern == NULL || glob_match(cursor->pattern, key))) {
+            return true;
+        }
+        ++cursor->pos[s];
+    }
+    return false;
+}
+
+// Merges the matches of all segments by key
+const char* index_next(IndexCursor* cursor, IndexHit* hit) {
+    bool found[INDEX_SEGMENT_COUNT];
+    const IndexKeyReader* first = NULL;
+    for (uint32_t s = 0; s < INDEX_SEGMENT_COUNT; ++s) {
+        found[s] = cursor_peek(cursor, s);
+        const IndexKeyReader* r = &cursor->readers[s];
+        if (found[s] && (first == NULL || index_key_cmp(r->key, r->len, first->key, first->len) < 0)) {
+            first = r;
+        }
+    }
+    if (first == NULL) {
+        return NULL;
+    }
+    for (uint32_t s = 0; s < INDEX_SEGMENT_COUNT; ++s) {
+        const IndexKeyReader* r = &cursor->readers[s];
+        hit->ids[s] = NULL;
+        hit->count[s] = 0;
+        hit->packed[s] = false;
+        if (found[s] && (r == first || index_key_cmp(r->key, r->len, first->key, first->len) == 0)) {
+            hit->ids[s] = r->ids;
+            hit->count[s] = r->count;
+            hit->packed[s] = r->packed;
+            ++cursor->pos[s];
+        }
+    }
+    return first->key;
+}
+
+bool substring_scan(const Index* index, const char* needle, uint32_t** positions, uint32_t* count) {
+    *count = 0;
+    *positions = HASHMAP_ALLOC_FN(index->key_count * sizeof(uint32_t) + 1);
+    if (*positions == NULL) {
+        return false;
+    }
+    IndexKeyReader reader;
+    reader.index = NULL;
+    for (uint32_t pos = 0; pos < index->key_count; ++pos) {
+        if (strstr(index_sorted_key(index, pos, &reader), needle) != NULL) {
+            (*positions)[(*count)++] = pos;
+        }
+    }
+    return true;
+}
+
+const IndexTrigram* index_trigram(const Index* index, uint32_t code) {
+    uint32_t low = 0, high = index->trigrams->count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (index->trigrams->trigrams[mid].code < code) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == index->trigrams->count || index->trigrams->trigrams[low].code != code ||
+        index->trigrams->trigrams[low].offset >= index->trigrams_size) {
+        return NULL;
+    }
+    return &index->trigrams->trigrams[low];
+}
+
+typedef struct TrigramReader {
+    const unsigned char* p;
+    const unsigned char* end;
+    uint32_t left;
+    uint32_t pos;
+    uint32_t key_count;
+} TrigramReader;
+
+void trigram_begin(const Index* index, const IndexTrigram* t, TrigramReader* reader) {
+    reader->p = (const unsigned char*)index->trigrams + t->offset;
+    reader->end = (const unsigned char*)index->trigrams + index->trigrams_size;
+    reader->left = t->count;
+    reader->pos = 0;
+    reader->key_count = index->key_count;
+}
+
+// Only a damaged index has a list past the end of the section or a
+// position out of range, which end the list early
+bool trigram_next(TrigramReader* reader, uint32_t* pos) {
+    if (reader->left == 0) {
+        return false;
+    }
+    const unsigned char* last = reader->p;
+    while (last < reader->end && last - reader->p < 5 && (*last & 0x80)) {
+        ++last;
+    }
+    uint32_t delta;
+    if (last == reader->end || last - reader->p == 5) {
+        reader->left = 0;
+        return false;
+    }
+    reader->p = varint_read(reader->p, &delta);
+    // The first delta is from position 0
+    uint64_t next = (uint64_t)reader->pos + delta;
+    if (next >= reader->key_count) {
+        reader->left = 0;
+        return false;
+    }
+    --reader->left;
+    reader->pos = (uint32_t)next;
+    *pos = reader->pos;
+    return true;
+}
+
+bool substring_positions(const Index* index, const char* needle, uint32_t** positions, uint32_t* count) {
+    uint32_t len = strlen(needle);
+    if (index->trigrams == NULL || len < 3) {
+        return substring_scan(index, needle, positions, count);
+    }
+    *count = 0;
+    *positions = NULL;
+    uint32_t list_count = len - 2;
+    const IndexTrigram** lists = HASHMAP_ALLOC_FN(list_count * sizeof(IndexTrigram*));
+    if (lists == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < list_count; ++i) {
+        const IndexTrigram* t = index_trigram(index, trigram_code(needle + i));
+        if (t == NULL) {
+            HASHMAP_FREE_FN(lists);
+            return true;
+        }
+        // Insertion sort by length, so the shortest list is intersected first
+        uint32_t ix = i;
+        while (ix > 0 && lists[ix - 1]->count > t->count) {
+            lists[ix] = lists[ix - 1];
+            --ix;
+        }
+        lists[ix] = t;
+    }
+
+    uint32_t* candidates = HASHMAP_ALLOC_FN(lists[0]->count * sizeof(uint32_t));
+    if (candidates == NULL) {
+        HASHMAP_FREE_FN(lists);
+        return false;
+    }
+    TrigramReader list;
+    uint32_t pos;
+    uint32_t candidate_count = 0;
+    trigram_begin(index, lists[0], &list);
+    while (trigram_next(&list, &pos)) {
+        candidates[candidate_count++] = pos;
+    }
+    for (uint32_t l = 1; l < list_count && candidate_count > 0; ++l) {
+        // Decoding a long list costs more than verifying a few candidates
+        if (lists[l]->count / INDEX_TRIGRAM_VERIFY_RATIO > candidate_count) {
+            break;
+        }
+        trigram_begin(index, lists[l], &list);
+        uint32_t kept = 0, c = 0;
+        while (c < candidate_count && trigram_next(&list, &pos)) {
+            while (c < candidate_count && candidates[c] < pos) {
+                ++c;
+            }
+            if (c < candidate_count && candidates[c] == pos) {
+                candidates[kept++] = pos;
+                ++c;
+            }
+        }
+        candidate_count = kept;
+    }
+    HASHMAP_FREE_FN(lists);
+
+    // Trigrams only filter, the needle still has to be found in each key
+    IndexKeyReader reader;
+    reader.index = NULL;
+    for (uint32_t i = 0; i < candidate_count; ++i) {
+        if (strstr(index_sorted_key(index, candidates[i], &reader), needle) != NULL) {
+            candidates[(*count)++] = candidates[i];
+        }
+    }
+    *positions = candidates;
+    return true;
+}
+
+typedef bool (*PositionsFn)(const Index* index, const char* needle, uint32_t** positions, uint32_t* count);
+
+// Runs a search on every segment and merges the matching keys in order.
+// The first pass sizes the copies of the keys, the second makes them.
+bool merge_segments(const Index* index, const char* needle, PositionsFn search, const char*** keys, uint32_t* count) {
+    const Index* segments[INDEX_SEGMENT_COUNT] = {index, index->delta};
+    uint32_t* positions[INDEX_SEGMENT_COUNT] = {NULL, NULL};
+    uint32_t counts[INDEX_SEGMENT_COUNT] = {0, 0};
+    bool success = true;
+    for (uint32_t s = 0; s < INDEX_SEGMENT_COUNT && success; ++s) {
+        if (segments[s] != NULL) {
+            success = search(segments[s], needle, &positions[s], &counts[s]);
+        }
+    }
+    *count = 0;
+    *keys = NULL;
+    IndexKeyReader readers[INDEX_SEGMENT_COUNT];
+    uint64_t size = 0;
+    char* copy = NULL;
+    for (uint32_t pass = 0; pass < 2 && success; ++pass) {
+        if (pass == 1) {
+            *keys = HASHMAP_ALLOC_FN(*count * sizeof(const char*) + size + 1);
+            if (*keys == NULL) {
+                success = false;
+                break;
+            }
+            copy = (char*)(*keys + *count);
+            *count = 0;
+        }
+        uint32_t ix[INDEX_SEGMENT_COUNT] = {0, 0};
+        readers[0].index = NULL;
+        readers[1].index = NULL;
+        while (ix[0] < counts[0] || ix[1] < counts[1]) {
+            const char* a = ix[0] < counts[0] ? index_sorted_key(segments[0], positions[0][ix[0]], &readers[0]) : NULL;
+            const char* b = ix[1] < counts[1] ? index_sorted_key(segments[1], positions[1][ix[1]], &readers[1]) : NULL;
+            int cmp = a == NULL ? 1 : b == NULL ? -1 : strcmp(a, b);
+            const IndexKeyReader* r = cmp <= 0 ? &readers[0] : &readers[1];
+            if (pass == 0) {
+                size += r->len + 1;
+            } else {
+                memcpy(copy, r->key, r->len + 1);
+                (*keys)[*count] = copy;
+                copy += r->len + 1;
+            }
+            ++*count;
+            ix[0] += cmp <= 0;
+            ix[1] += cmp >= 0;
+        }
+    }
+    if (!success) {
+        *count = 0;
+    }
+    for (uint32_t s = 0; s < INDEX_SEGMENT_COUNT; ++s) {
+        if (positions[s] != NULL) {
+            HASHMAP_FREE_FN(positions[s]);
+        }
+    }
+    return success;
+}
+
+bool index_substring_scan(const Index* index, const char* needle, const char*** keys, uint32_t* count) {
+    return merge_segments(index, needle, substring_scan, keys, count);
+}
+
+bool index_substring(const Index* index, const char* needle, const char*** keys, uint32_t* count) {
+    return merge_segments(index, needle, substring_positions, keys, count);
+}
+
+// Levenshtein distance ignoring case, only computed within a band of
+// max_distance around the diagonal. Returns max_distance + 1 if the
+// distance is larger. row needs b_len + 1 entries.
+uint32_t bounded_distance(const char* a, uint32_t a_len, const char* b, uint32_t b_len, uint32_t max_distance, uint32_t* row) {
+    uint32_t inf = max_distance + 1;
+    if (a_len > b_len + max_distance || b_len > a_len + max_distance) {
+        return inf;
+    }
+    for (uint32_t j = 0; j <= b_len; ++j) {
+        row[j] = j <= max_distance ? j : inf;
+    }
+    for (uint32_t i = 1; i <= a_len; ++i) {
+        uint32_t lo = i > max_distance ? i - max_distance : 1;
+        uint32_t hi = i + max_distance < b_len ? i + max_distance : b_len;
+        uint32_t diag = row[lo - 1];
+        uint32_t left = inf;
+        if (lo == 1) {
+            left = i <= max_distance ? i : inf;
+            row[0] = left;
+        }
+        uint32_t row_min = inf;
+        for (uint32_t j = lo; j <= hi; ++j) {
+            uint32_t up = row[j];
+            uint32_t v = diag + (fold_case(a[i - 1]) != fold_case(b[j - 1]));
+            if (up + 1 < v) {
+                v = up + 1;
+            }
+            if (left + 1 < v) {
+                v = left + 1;
+            }
+            if (v > inf) {
+                v = inf;
+            }
+            diag = up;
+            row[j] = v;
+            left = v;
+            if (v < row_min) {
+                row_min = v;
+            }
+        }
+        if (hi < b_len) {
+            row[hi + 1] = inf;
+        }
+        if (row_min >= inf) {
+            return inf;
+        }
+    }
+    return row[b_len];
+}
+
+void fuzzy_add(IndexSuggestion* out, uint32_t* count, uint32_t max_count, const IndexKeyReader* reader,
+               uint32_t distance, HashArena* keys) {
+    // The same key can come from more than one segment
+    for (uint32_t i = 0; i < *count; ++i) {
+        if (out[i].distance == distance && strcmp(out[i].key, reader->key) == 0) {
+            return;
+        }
+    }
+    uint32_t ix = *count;
+    if (ix == max_count && out[ix - 1].distance <= distance) {
+        return;
+    }
+    // Compressed keys only live until the reader moves on
+    char* key = HashArena_Alloc(keys, reader->len + 1, 1);
+    if (key == NULL) {
+        return;
+    }
+    memcpy(key, reader->key, reader->len + 1);
+    if (ix == max_count) {
+        --ix;
+    } else {
+        ++*count;
+    }
+    // Candidates arrive in sorted order, so ties keep that order
+    while (ix > 0 && out[ix - 1].distance > distance) {
+        out[ix] = out[ix - 1];
+        --ix;
+    }
+    out[ix].key = key;
+    out[ix].distance = distance;
+}
+
+typedef struct FuzzyQuery {
+    const Index* index; // With the delta attached, for the kinds of a key
+    const char* query;
+    uint32_t len;
+    uint32_t kinds;
+    uint32_t max_distance;
+    uint32_t* row;
+    HashArena* keys;
+} FuzzyQuery;
+
+// Keys of other kinds, or only in superseded libraries, never take a slot
+void fuzzy_check(const FuzzyQuery* q, IndexSuggestion* out, uint32_t* count, uint32_t max_count,
+                 const IndexKeyReader* reader) {
+    uint32_t d = bounded_distance(reader->key, reader->len, q->query, q->len, q->max_distance, q->row);
+    if (d > q->max_distance || (*count == max_count && out[*count - 1].distance <= d)) {
+        return;
+    }
+    IndexHit hit;
+    if (index_lookup(q->index, reader->key, &hit) && index_has_kind(q->index, &hit, q->kinds)) {
+        fuzzy_add(out, count, max_count, reader, d, q->keys);
+    }
+}
+
+uint32_t fuzzy_segment(const FuzzyQuery* q, const Index* index, IndexSuggestion* out, uint32_t count, uint32_t max_count) {
+    const char* query = q->query;
+    uint32_t len = q->len;
+    uint32_t max_distance = q->max_distance;
+    // A key within k edits misses at most 3k of the distinct trigrams of
+    // the query, so it contains at least one of any 3k + 1 of them.
+    uint32_t needed = 3 * max_distance + 1;
+    const IndexTrigram** lists = NULL;
+    uint32_t list_count = 0;
+    if (index->trigrams != NULL && len >= 3) {
+        lists = HASHMAP_ALLOC_FN((len - 2) * sizeof(IndexTrigram*));
+    }
+    if (lists != NULL) {
+        uint32_t missing = 0;
+        for (uint32_t i = 0; i + 3 <= len; ++i) {
+            uint32_t code = trigram_code(query + i);
+            bool duplicate = false;
+            for (uint32_t j = 0; j < i && !duplicate; ++j) {
+                duplicate = trigram_code(query + j) == code;
+            }
+            if (duplicate) {
+                continue;
+            }
+            const IndexTrigram* t = index_trigram(index, code);
+            if (t == NULL) {
+                // Absent trigrams are the rarest of all, with no candidates
+                ++missing;
+                continue;
+            }
+            uint32_t ix = list_count++;
+            while (ix > 0 && lists[ix - 1]->count > t->count) {
+                lists[ix] = lists[ix - 1];
+                --ix;
+            }
+            lists[ix] = t;
+        }
+        if (missing + list_count < needed) {
+            HASHMAP_FREE_FN(lists);
+            lists = NULL;
+        } else if (missing >= needed) {
+            list_count = 0;
+        } else if (list_count > needed - missing) {
+            list_count = needed - missing;
+        }
+    }
+
+    IndexKeyReader reader;
+    reader.index = NULL;
+    if (lists == NULL) {
+        for (uint32_t pos = 0; pos < index->key_count; ++pos) {
+            index_sorted_key(index, pos, &reader);
+            fuzzy_check(q, out, &count, max_count, &reader);
+        }
+    } else {
+        unsigned char* seen = HASHMAP_ALLOC_FN(index->key_count + 1);
+        if (seen != NULL) {
+            memset(seen, 0, index->key_count + 1);
+            for (uint32_t l = 0; l < list_count; ++l) {
+                TrigramReader list;
+                uint32_t pos;
+                trigram_begin(index, lists[l], &list);
+                while (trigram_next(&list, &pos)) {
+                    seen[pos] = 1;
+                }
+            }
+            for (uint32_t pos = 0; pos < index->key_count; ++pos) {
+                if (!seen[pos]) {
+                    continue;
+                }
+                index_sorted_key(index, pos, &reader);
+                fuzzy_check(q, out, &count, max_count, &reader);
+            }
+            HASHMAP_FREE_FN(seen);
+        }
+        HASHMAP_FREE_FN(lists);
+    }
+    return count;
+}
+
+uint32_t index_fuzzy(const Index* index, const char* query, uint32_t kinds, uint32_t max_distance, IndexSuggestion* out,
+                     uint32_t max_count, HashArena* keys) {
+    uint32_t len = strlen(query);
+    uint32_t count = 0;
+    if (max_count == 0) {
+        return 0;
+    }
+    uint32_t* row = HASHMAP_ALLOC_FN((len + max_distance + 1) * sizeof(uint32_t));
+    if (row == NULL) {
+        return 0;
+    }
+    FuzzyQuery q = {index, query, len, kinds, max_distance, row, keys};
+    count = fuzzy_segment(&q, index, out, count, max_count);
+    if (index->delta != NULL) {
+        count = fuzzy_segment(&q, index->delta, out, count, max_count);
+    }
+    HASHMAP_FREE_FN(row);
+    return count;
+}
@@ -0,0 +1,433 @@
+#ifndef INDEX_H_00
+#define INDEX_H_00
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hashmap.h"
+
+#define INDEX_MAGIC 0x58444e49 // "INDX"
+#define INDEX_VERSION 10
+#define INDEX_MAX_SECTIONS 16
+
+#define INDEX_SECTION_SYMBOLS 1
+#define INDEX_SECTION_PATHS 2
+#define INDEX_SECTION_SORTED 3
+#define INDEX_SECTION_TRIGRAMS 4
+#define INDEX_SECTION_UNDECORATED 5
+#define INDEX_SECTION_DELTA 6
+#define INDEX_SECTION_BLOCKS 7
+#define INDEX_SECTION_FILTER 8
+
+// IndexBuilder flags
+#define INDEX_BUILD_TRIGRAMS 1
+// Adds a frozen map from undecorated, and unqualified, names of MSVC
+// symbols to the union of the library ids of their decorated names.
+#define INDEX_BUILD_UNDECORATED 2
+// Stores the symbols as front coded blocks instead of a frozen map and a
+// sorted table. Ignored if a key is longer than INDEX_KEY_MAX.
+#define INDEX_BUILD_COMPRESSED 4
+// Adds a filter over the keys, so most lookups of missing keys only read
+// one cache line of it.
+#define INDEX_BUILD_FILTER 8
+
+// Symbol kinds, one bit per source file
+#define INDEX_KIND_LIB 1
+#define INDEX_KIND_DLL 2
+#define INDEX_KIND_OBJ 4
+#define INDEX_KIND_COUNT 3
+#define INDEX_KIND_ALL ((1 << INDEX_KIND_COUNT) - 1)
+
+// Number of lookups a batch runs ahead when prefetching
+#define INDEX_PREFETCH_DISTANCE 8
+
+// Symbols are partitioned into shards by the top bits of their hash, so
+// shards can be filled concurrently and frozen into one table.
+#define INDEX_SHARD_BITS 4
+#define INDEX_SHARD_COUNT (1 << INDEX_SHARD_BITS)
+#define INDEX_SHARD(h) ((uint32_t)((h) >> (64 - INDEX_SHARD_BITS)))
+
+// A source is split into at most INDEX_PARSE_CHUNKS chunks of at least
+// INDEX_PARSE_MIN_CHUNK bytes when the builder has a parallel function.
+#define INDEX_PARSE_CHUNKS 256
+#define INDEX_PARSE_MIN_CHUNK (1 << 18)
+// Sources are parsed this many bytes at a time
+#define INDEX_PARSE_WINDOW (64 << 20)
+
+// The symbol table is reserved up front from the lines in the first
+// INDEX_ESTIMATE_SAMPLE bytes of a source, scaled to its size. Names occur
+// in several libraries, so INDEX_LINES_PER_KEY lines are counted per key.
+// Reserving too little only costs the last rehashes.
+#define INDEX_ESTIMATE_SAMPLE (1 << 20)
+#define INDEX_LINES_PER_KEY 2
+// Number of libraries index_scan holds the symbols of at once
+#define INDEX_SCAN_WINDOW 1024
+// Marks kinds in IndexHeader.sources that were read with index_scan
+#define INDEX_SOURCE_SCANNED (1ULL << 63)
+// Smallest number of symbols worth undecorating on a separate thread
+#define INDEX_UNDECORATE_GRAIN 4096
+
+// A cache line, so the blocks of INDEX_SECTION_FILTER never straddle two
+#define INDEX_SECTION_ALIGN 64
+
+typedef struct IndexSection {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t size;
+} IndexSection;
+
+// An index file is this header followed by its sections, each aligned to
+// INDEX_SECTION_ALIGN bytes. All offsets are from the start of the file.
+typedef struct IndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t section_count;
+    // Last write time of the source of each kind, 0 if it was missing, or
+    // the time of the scan with INDEX_SOURCE_SCANNED set.
+    uint64_t sources[INDEX_KIND_COUNT];
+    IndexSection sections[INDEX_MAX_SECTIONS];
+} IndexHeader;
+
+typedef struct IndexPath {
+    uint32_t name; // Offset from the start of the path section
+    uint32_t len;
+    uint32_t kinds;
+    uint32_t basename; // Shared by the paths of the segment with the same file name
+    // Sum of the hashes of the source records of the library, per kind
+    uint64_t fingerprints[INDEX_KIND_COUNT];
+} IndexPath;
+
+// INDEX_SECTION_PATHS starts with the path count and the first library id,
+// followed by one IndexPath per library id. Paths are ordered by file name,
+// so paths with the same basename have consecutive ids. The values of
+// INDEX_SECTION_SYMBOLS are arrays of library ids in increasing order.
+typedef struct IndexPathTable {
+    uint32_t count;
+    uint32_t first;
+    IndexPath paths[];
+} IndexPathTable;
+
+// INDEX_SECTION_DELTA marks an index holding only the libraries that
+// changed since its base index was built. Its library ids follow those of
+// the base, and superseded has the kinds of each base library that are
+// replaced by the delta, or were removed.
+typedef struct IndexDelta {
+    uint32_t base_size;
+    uint32_t base_paths;
+    uint64_t base_sources[INDEX_KIND_COUNT];
+    uint32_t superseded[];
+} IndexDelta;
+
+// INDEX_SECTION_SORTED lists the elements of INDEX_SECTION_SYMBOLS in key
+// order. The keys themselves are only stored once, in the frozen map.
+typedef struct IndexSortedTable {
+    uint32_t count;
+    uint32_t elements[];
+} IndexSortedTable;
+
+// Keys per block of INDEX_SECTION_BLOCKS
+#define INDEX_BLOCK_KEYS 16
+// Longest key of a compressed index, keys are decoded into buffers of
+// this size.
+#define INDEX_KEY_MAX 4096
+
+// INDEX_SECTION_BLOCKS replaces INDEX_SECTION_SYMBOLS and
+// INDEX_SECTION_SORTED in compressed indexes. The keys are in sorted
+// order, INDEX_BLOCK_KEYS per block, and blocks has the offset of each
+// block from the start of the section followed by the end of the last.
+// Every key is stored as the LEB128 length of the prefix it shares with
+// the previous key of its block, the LEB128 length of the rest of the key
+// and its bytes, then the LEB128 id count and the ids as zigzag LEB128
+// deltas from the previous id, starting from 0. The first key of a block
+// shares nothing, so a block can be decoded on its own.
+typedef struct IndexBlockTable {
+    uint32_t count;
+    uint32_t block_count;
+    uint32_t blocks[];
+} IndexBlockTable;
+
+#define INDEX_FILTER_BITS_PER_KEY 10
+#define INDEX_FILTER_BLOCK_WORDS 8
+#define INDEX_FILTER_PROBES 6
+
+// INDEX_SECTION_FILTER is a blocked Bloom filter over the keys of the
+// index. The high half of the key hash picks a block of 512 bits, and
+// INDEX_FILTER_PROBES fields of 9 bits of the remixed hash pick the bits
+// set within it. The header fills a block, so every block is aligned.
+typedef struct IndexFilter {
+    uint32_t block_count;
+    uint32_t reserved[15];
+    uint64_t blocks[]; // block_count blocks of INDEX_FILTER_BLOCK_WORDS words
+} IndexFilter;
+
+// Trigrams are built from bytes mapped to 0-95: printable ascii with
+// upper case folded to lower case, and one code shared by all other bytes.
+#define INDEX_TRIGRAM_ALPHABET 96
+#define INDEX_TRIGRAM_CODES (INDEX_TRIGRAM_ALPHABET * INDEX_TRIGRAM_ALPHABET * INDEX_TRIGRAM_ALPHABET)
+// Posting lists longer than this many times the remaining candidates are
+// not intersected, the candidates are verified directly instead.
+#define INDEX_TRIGRAM_VERIFY_RATIO 16
+
+#define INDEX_FUZZY_DISTANCE 2
+
+// Extra room over the decorated length for an undecorated name, which
+// grows by one byte per scope and can repeat back referenced names.
+#define INDEX_UNDECORATE_SLACK 32
+
+typedef struct IndexTrigram {
+    uint32_t code;
+    uint32_t count;
+    uint32_t offset; // Offset from the start of the trigram section
+} IndexTrigram;
+
+// INDEX_SECTION_TRIGRAMS holds the trigrams present in any key, ordered
+// by code. Each posting list is the increasing positions in the sorted
+// table of the keys containing the trigram, stored as LEB128 deltas.
+typedef struct IndexTrigramTable {
+    uint32_t count;
+    IndexTrigram trigrams[];
+} IndexTrigramTable;
+
+typedef struct BuilderPath {
+    const char* name;
+    uint32_t len;
+    uint32_t kinds;
+    uint64_t fingerprints[INDEX_KIND_COUNT];
+} BuilderPath;
+
+typedef void (*IndexTask)(void* ctx, uint32_t begin, uint32_t end);
+
+// Runs task over [0, count), split into ranges of at least grain items
+// that may run concurrently.
+typedef void (*IndexParallelFn)(IndexTask task, void* ctx, uint32_t count, uint32_t grain);
+
+typedef bool (*IndexSymbolFn)(void* ctx, const char* name, uint32_t len);
+
+// Reads library i of index_scan, calling add with add_ctx for each of its
+// symbols. Runs concurrently for different libraries.
+typedef bool (*IndexScanFn)(void* ctx, uint32_t library, IndexSymbolFn add, void* add_ctx);
+
+typedef struct IndexLibrary {
+    const char* path;
+    uint32_t len;
+    uint64_t fingerprint; // Changes whenever the library changes
+} IndexLibrary;
+
+typedef struct IndexBuilder {
+    HashMap symbols[INDEX_SHARD_COUNT]; // Indexed by INDEX_SHARD of the key hash
+    HashMap paths;
+    BuilderPath* path_list;
+    uint32_t path_count;
+    uint32_t path_capacity;
+    uint64_t sources[INDEX_KIND_COUNT];
+    uint32_t flags;
+    IndexParallelFn parallel; // NULL runs tasks on the calling thread
+    const struct Index* base; // Set to build a delta over base
+    uint32_t* superseded;
+} IndexBuilder;
+
+typedef struct IndexOutput {
+    IndexHeader header;
+    void* data[INDEX_MAX_SECTIONS];
+} IndexOutput;
+
+typedef struct Index {
+    const unsigned char* data;
+    uint64_t size;
+    uint32_t key_count;
+    HashMapFrozen symbols; // data is NULL if the index is compressed
+    const IndexPathTable* paths;
+    const IndexSortedTable* sorted;
+    const IndexBlockTable* blocks; // NULL unless the index is compressed
+    uint32_t blocks_size;
+    const IndexTrigramTable* trigrams; // NULL if the index has no trigrams
+    uint32_t trigrams_size;
+    HashMapFrozen undecorated; // data is NULL if the index has no such names
+    const IndexFilter* filter; // NULL if the index has no filter
+    const IndexDelta* delta_info; // NULL unless this index is a delta
+    const struct Index* delta; // Attached delta, merged into every query
+} Index;
+
+// The base index and its delta
+#define INDEX_SEGMENT_COUNT 2
+
+// The library ids of a key in each segment, ids[i] is NULL if segment i
+// does not have the key. ids[i] is an array of uint32_t, or the packed
+// deltas of INDEX_SECTION_BLOCKS if packed[i] is set, so they are read
+// with index_hit_next.
+typedef struct IndexHit {
+    const void* ids[INDEX_SEGMENT_COUNT];
+    uint32_t count[INDEX_SEGMENT_COUNT];
+    bool packed[INDEX_SEGMENT_COUNT];
+} IndexHit;
+
+typedef struct IndexHitIterator {
+    const IndexHit* hit;
+    uint32_t segment;
+    uint32_t ix;
+    const unsigned char* p;
+    uint32_t id;
+} IndexHitIterator;
+
+// A key of one segment in sorted order. Keys of compressed segments are
+// decoded into buffer, key points into the index otherwise.
+typedef struct IndexKeyReader {
+    const struct Index* index; // Must be NULL before the first read
+    uint32_t pos;
+    const char* key;
+    uint32_t len;
+    const void* ids;
+    uint32_t count;
+    bool packed;
+    const unsigned char* next; // Next key in the block
+    char buffer[INDEX_KEY_MAX + 1];
+} IndexKeyReader;
+
+typedef struct IndexCursor {
+    const Index* segments[INDEX_SEGMENT_COUNT];
+    const char* prefix;
+    uint32_t prefix_len;
+    const char* pattern; // NULL for prefix matches
+    uint32_t pos[INDEX_SEGMENT_COUNT];
+    IndexKeyReader readers[INDEX_SEGMENT_COUNT];
+} IndexCursor;
+
+typedef struct IndexSuggestion {
+    const char* key;
+    uint32_t distance;
+} IndexSuggestion;
+
+typedef struct IndexQuery {
+    const char* symbol;
+    uint32_t len;
+    uint64_t hash;
+    IndexHit hit;
+} IndexQuery;
+
+bool index_builder_init(IndexBuilder* builder);
+
+void index_builder_free(IndexBuilder* builder);
+
+uint32_t index_add_path(IndexBuilder* builder, const char* path, uint32_t len, uint32_t kinds);
+
+bool index_add_symbol(IndexBuilder* builder, uint32_t path_id, const char* name, uint32_t len);
+
+// Parses the output of scrape.py in place. data is only read, and does
+// not need to be NUL terminated.
+bool index_parse_yaml(IndexBuilder* builder, const char* data, uint64_t size, uint32_t kind);
+
+// Adds the symbols of the given kinds from an existing index. For a delta
+// the base libraries it supersedes in those kinds are copied as well. Base
+// libraries superseded by an attached delta are skipped.
+bool index_copy_kinds(IndexBuilder* builder, const Index* index, uint32_t kinds);
+
+// Makes builder produce a delta over base. Must be called before anything
+// is added.
+bool index_builder_set_base(IndexBuilder* builder, const Index* base);
+
+// Parses only the records of data whose library has different records in
+// the base, and supersedes the base libraries of this kind that changed
+// or are no longer in data.
+bool index_parse_yaml_delta(IndexBuilder* builder, const char* data, uint64_t size, uint32_t kind);
+
+// Adds the symbols of libraries, read by calling scan. Libraries listed
+// twice are read once. With a base, only the libraries whose fingerprint
+// differs from the base are read, and base libraries of this kind that are
+// not listed are superseded.
+bool index_scan(IndexBuilder* builder, const IndexLibrary* libraries, uint32_t count, uint32_t kind,
+                IndexScanFn scan, void* ctx);
+
+bool index_build(IndexBuilder* builder, IndexOutput* out);
+
+// Appends a section, taking ownership of data.
+bool index_output_add(IndexOutput* out, uint32_t type, void* data, uint64_t size);
+
+void index_output_free(IndexOutput* out);
+
+bool index_open(Index* index, const void* data, uint64_t size);
+
+// Merges delta into every query on index, delta must be a delta over
+// index and outlive it.
+bool index_attach_delta(Index* index, const Index* delta);
+
+const void* index_section(const Index* index, uint32_t type, uint32_t* size);
+
+void index_hit_begin(const IndexHit* hit, IndexHitIterator* it);
+
+// Returns the ids of every segment in turn, false when done.
+bool index_hit_next(IndexHitIterator* it, uint32_t* id);
+
+// Returns false if the key is certainly not in index, without an attached
+// delta. True for every key if index has no filter.
+bool index_may_contain(const Index* index, const char* key, uint32_t len);
+
+// Returns false if no segment has the symbol
+bool index_lookup(const Index* index, const char* symbol, IndexHit* hit);
+
+bool index_lookup_undecorated(const Index* index, const char* name, IndexHit* hit);
+
+// Shape of one segment of an index
+typedef struct IndexStats {
+    uint32_t key_count;
+    uint32_t block_count; // 0 unless the index is compressed
+    uint64_t compares; // Key comparisons to look up every key once
+    HashFrozenStats symbols; // element_count is 0 if the index is compressed
+    HashFrozenStats undecorated; // element_count is 0 if the index has no such names
+    uint32_t filter_blocks; // 0 if the index has no filter
+    uint64_t filter_bits; // Bits set in the filter
+} IndexStats;
+
+// Walks the tables of index, without an attached delta
+void index_stats(const Index* index, IndexStats* stats);
+
+// Resolves symbol and len of every query, overlapping the memory accesses
+// of consecutive lookups.
+void index_find_batch(const Index* index, IndexQuery* queries, uint32_t count);
+
+// Returns NULL for ids that are not in index, or whose kinds are all
+// superseded by an attached delta.
+const char* index_path(const Index* index, uint32_t id, uint32_t* len, uint32_t* kinds);
+
+// True if a library of hit that is not superseded has one of kinds
+bool index_has_kind(const Index* index, const IndexHit* hit, uint32_t kinds);
+
+// Returns the basename id of a library. The ids of a hit are increasing,
+// so within one segment the libraries of a basename follow each other.
+uint32_t index_path_basename(const Index* index, uint32_t id);
+
+// File name part of a path
+const char* index_basename(const char* path, uint32_t len);
+
+void index_match_prefix(const Index* index, const char* prefix, IndexCursor* cursor);
+
+// Matches keys against a pattern where * matches any sequence and ? any
+// single character. Only keys starting with the literal prefix of the
+// pattern are visited.
+void index_match_glob(const Index* index, const char* pattern, IndexCursor* cursor);
+
+// Returns the next matching key in sorted order, or NULL when done. The
+// key is only valid until the next call.
+const char* index_next(IndexCursor* cursor, IndexHit* hit);
+
+// Reads the key at a position in the sorted order of index, without an
+// attached delta. Reading the positions of a block in increasing order
+// with the same reader decodes each key once.
+const char* index_sorted_key(const Index* index, uint32_t pos, IndexKeyReader* reader);
+
+// Finds all keys containing needle, in sorted order. Candidates come
+// from intersecting trigram posting lists and are verified with strstr.
+// keys, and the copies of the keys it points to, must be freed with a
+// single HASHMAP_FREE_FN.
+bool index_substring(const Index* index, const char* needle, const char*** keys, uint32_t* count);
+
+// Same as index_substring, but checks every key.
+bool index_substring_scan(const Index* index, const char* needle, const char*** keys, uint32_t* count);
+
+// Finds up to max_count keys within max_distance case insensitive edits
+// of query, nearest first, that are in a live library of one of kinds.
+// Returns the number of suggestions. The keys are copied into keys, which
+// is freed with HashArena_Free.
+uint32_t index_fuzzy(const Index* index, const char* query, uint32_t kinds, uint32_t max_distance, IndexSuggestion* out,
+                     uint32_t max_count, HashArena* keys);
+
+#endif
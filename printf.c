@@ -1,6 +1,7 @@
 #define UNICODE
 #include "printf.h"
 #include <stdarg.h>
+#include <string.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,8 +15,7 @@ extern int _vsnwprintf(wchar_t *buffer, size_t count, const wchar_t *format,
 }
 #endif
 
-void outputa(HANDLE out, char* data, size_t size) {
-    DWORD type = GetFileType(out);
+void write_bytes(HANDLE out, DWORD type, const char* data, size_t size) {
     if (type == FILE_TYPE_CHAR) {
         // TODO: Convert to UTF-16 and use WriteConsoleW??
         WriteConsoleA(out, data, size, NULL, NULL);
@@ -31,6 +31,10 @@ void outputa(HANDLE out, char* data, size_t size) {
     }
 }
 
+void outputa(HANDLE out, char* data, size_t size) {
+    write_bytes(out, GetFileType(out), data, size);
+}
+
 int _printf_h(HANDLE dest, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -41,7 +45,7 @@ int _printf_h(HANDLE dest, const char *fmt, ...) {
     if (count < 1024) { // Note: not inclusive for NULL terminator
         char buf[1024];
         _vsnprintf(buf, count, fmt, args);
-        WriteConsoleA(dest, buf, count, NULL, NULL);
+        outputa(dest, buf, count);
     } else {
         HANDLE heap = GetProcessHeap();
         char *buf = (char *)HeapAlloc(heap, 0, count);
@@ -111,3 +115,85 @@ int _wprintf_h(HANDLE dest, const wchar_t *fmt, ...) {
     va_end(args);
     return count;
 }
+
+void output_init(OutputBuffer* out, HANDLE handle) {
+    out->handle = handle;
+    out->type = handle != NULL ? GetFileType(handle) : FILE_TYPE_UNKNOWN;
+    out->data = NULL;
+    out->size = 0;
+    out->capacity = 0;
+}
+
+void output_flush(OutputBuffer* out) {
+    if (out->size > 0 && out->handle != NULL) {
+        write_bytes(out->handle, out->type, out->data, out->size);
+        out->size = 0;
+    }
+}
+
+// Makes room for size more bytes, flushing first if they do not fit
+BOOL output_reserve(OutputBuffer* out, size_t size) {
+    if (out->capacity - out->size >= size) {
+        return TRUE;
+    }
+    output_flush(out);
+    if (out->capacity - out->size >= size) {
+        return TRUE;
+    }
+    size_t capacity = out->size + size < OUTPUT_BUFFER_SIZE ? OUTPUT_BUFFER_SIZE : out->size + size;
+    if (out->handle == NULL && capacity < 2 * out->capacity) {
+        capacity = 2 * out->capacity;
+    }
+    char* data;
+    if (out->data == NULL) {
+        data = (char*)HeapAlloc(GetProcessHeap(), 0, capacity);
+    } else {
+        data = (char*)HeapReAlloc(GetProcessHeap(), 0, out->data, capacity);
+    }
+    if (data == NULL) {
+        return FALSE;
+    }
+    out->data = data;
+    out->capacity = capacity;
+    return TRUE;
+}
+
+void output_append(OutputBuffer* out, const char* data, size_t size) {
+    if (out->handle == NULL) {
+        if (output_reserve(out, size)) {
+            memcpy(out->data + out->size, data, size);
+            out->size += size;
+        }
+        return;
+    }
+    if (size > OUTPUT_BUFFER_SIZE || !output_reserve(out, size)) {
+        output_flush(out);
+        write_bytes(out->handle, out->type, data, size);
+        return;
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+int output_printf(OutputBuffer* out, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int count = _vscprintf(fmt, args);
+    if (count == -1 || !output_reserve(out, count + 1)) {
+        va_end(args);
+        return -1;
+    }
+    _vsnprintf(out->data + out->size, count + 1, fmt, args);
+    out->size += count;
+    va_end(args);
+    return count;
+}
+
+void output_free(OutputBuffer* out) {
+    output_flush(out);
+    if (out->data != NULL) {
+        HeapFree(GetProcessHeap(), 0, out->data);
+        out->data = NULL;
+    }
+    out->capacity = 0;
+}
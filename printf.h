@@ -7,3 +7,29 @@
 int _printf_h(HANDLE dest, const char* fmt, ...);
 
 int _wprintf_h(HANDLE dest, const wchar_t* fmt, ...);
+
+// Bytes an OutputBuffer collects before writing them
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Collects output for a handle so it is written in large pieces. The file
+// type of the handle is only looked up once. With a NULL handle nothing is
+// written and data keeps all size bytes of output until output_free.
+typedef struct OutputBuffer {
+    HANDLE handle;
+    DWORD type;
+    char* data;
+    size_t size;
+    size_t capacity;
+} OutputBuffer;
+
+void output_init(OutputBuffer* out, HANDLE handle);
+
+// Appends size bytes of data as they are, without formatting
+void output_append(OutputBuffer* out, const char* data, size_t size);
+
+int output_printf(OutputBuffer* out, const char* fmt, ...);
+
+void output_flush(OutputBuffer* out);
+
+// Flushes the buffer and frees its memory
+void output_free(OutputBuffer* out);
@@ -0,0 +1,284 @@
+#include <string.h>
+#include "scan.h"
+
+#define ARCHIVE_MAGIC "!<arch>\n"
+#define ARCHIVE_HEADER_SIZE 60
+
+#define COFF_HEADER_SIZE 20
+#define COFF_SYMBOL_SIZE 18
+#define BIGOBJ_HEADER_SIZE 56
+#define BIGOBJ_SYMBOL_SIZE 20
+#define SECTION_HEADER_SIZE 40
+#define EXPORT_DIRECTORY_SIZE 40
+
+// {D1BAA1C7-BAEE-4ba9-AF20-FAF66AA4DCB8}, identifies /bigobj objects
+const unsigned char bigobj_class[16] = {
+    0xc7, 0xa1, 0xba, 0xd1, 0xee, 0xba, 0xa9, 0x4b, 0xaf, 0x20, 0xfa, 0xf6, 0x6a, 0xa4, 0xdc, 0xb8
+};
+
+// Symbols scrape.py left out of the object index
+const char* const excluded[] = {
+    "@comp.id", "@feat.00", "@vol.md", ".pdata", ".data", ".xdata", ".chks64", ".drectve", ".bss"
+};
+
+uint32_t read_u16(const unsigned char* p) {
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t read_u32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t read_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint64_t read_be64(const unsigned char* p) {
+    return ((uint64_t)read_be32(p) << 32) | read_be32(p + 4);
+}
+
+// Length of the NUL terminated string at p, which must end before end.
+// Returns UINT32_MAX if it does not.
+uint32_t string_len(const unsigned char* p, const unsigned char* end) {
+    const unsigned char* nul = memchr(p, '\0', end - p);
+    if (nul == NULL) {
+        return UINT32_MAX;
+    }
+    return nul - p;
+}
+
+// Parses the decimal size field of an archive member header
+bool member_size(const unsigned char* header, uint64_t* size) {
+    *size = 0;
+    uint32_t i = 48;
+    while (i < 58 && header[i] >= '0' && header[i] <= '9') {
+        *size = *size * 10 + (header[i] - '0');
+        ++i;
+    }
+    return i > 48 && header[58] == '`' && header[59] == '\n';
+}
+
+// The first linker member is named "/", or "/SYM64/" in GNU archives with
+// 64 bit offsets. It holds the big endian symbol count and member offsets,
+// followed by the NUL terminated symbol names.
+bool scan_archive(const void* data, uint64_t size, ScanSymbolFn add, void* ctx) {
+    const unsigned char* p = data;
+    if (size < 8 || memcmp(p, ARCHIVE_MAGIC, 8) != 0) {
+        return false;
+    }
+    if (size < 8 + ARCHIVE_HEADER_SIZE) {
+        return true;
+    }
+    const unsigned char* header = p + 8;
+    uint32_t width;
+    if (header[0] == '/' && header[1] == ' ') {
+        width = 4;
+    } else if (memcmp(header, "/SYM64/ ", 8) == 0) {
+        width = 8;
+    } else {
+        return true;
+    }
+    uint64_t member;
+    if (!member_size(header, &member) || member > size - 8 - ARCHIVE_HEADER_SIZE || member < width) {
+        return false;
+    }
+    const unsigned char* pos = header + ARCHIVE_HEADER_SIZE;
+    const unsigned char* end = pos + member;
+    uint64_t count = width == 4 ? read_be32(pos) : read_be64(pos);
+    if (count > (member - width) / width) {
+        return false;
+    }
+    pos += width + count * width;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (pos >= end) {
+            return false;
+        }
+        uint32_t len = string_len(pos, end);
+        if (len == UINT32_MAX) {
+            return false;
+        }
+        if (len > 0 && !add(ctx, (const char*)pos, len)) {
+            return false;
+        }
+        pos += len + 1;
+    }
+    return true;
+}
+
+typedef struct Image {
+    const unsigned char* data;
+    uint64_t size;
+    const unsigned char* sections;
+    uint32_t section_count;
+} Image;
+
+// Returns the file data at rva, which has at least *available bytes in
+// the file. Returns NULL if no section holds rva in the file.
+const unsigned char* image_data(const Image* image, uint32_t rva, uint32_t* available) {
+    for (uint32_t i = 0; i < image->section_count; ++i) {
+        const unsigned char* section = image->sections + i * SECTION_HEADER_SIZE;
+        uint32_t va = read_u32(section + 12);
+        uint32_t raw_size = read_u32(section + 16);
+        uint32_t raw = read_u32(section + 20);
+        if (rva < va || rva - va >= raw_size) {
+            continue;
+        }
+        if (raw > image->size || raw_size > image->size - raw) {
+            return NULL;
+        }
+        *available = raw_size - (rva - va);
+        return image->data + raw + (rva - va);
+    }
+    return NULL;
+}
+
+bool scan_exports(const void* data, uint64_t size, ScanSymbolFn add, void* ctx) {
+    const unsigned char* p = data;
+    if (size < 0x40 || p[0] != 'M' || p[1] != 'Z') {
+        return false;
+    }
+    uint32_t pe = read_u32(p + 0x3c);
+    if (pe > size || size - pe < 4 + COFF_HEADER_SIZE || memcmp(p + pe, "PE\0\0", 4) != 0) {
+        return false;
+    }
+    const unsigned char* coff = p + pe + 4;
+    uint32_t optional_size = read_u16(coff + 16);
+    const unsigned char* optional = coff + COFF_HEADER_SIZE;
+    uint64_t optional_offset = optional - p;
+    if (optional_size > size - optional_offset) {
+        return false;
+    }
+    uint32_t directories;
+    switch (optional_size < 2 ? 0 : read_u16(optional)) {
+    case 0x10b:
+        directories = 92;
+        break;
+    case 0x20b:
+        directories = 108;
+        break;
+    default:
+        return false;
+    }
+    if (optional_size < directories + 4 + 8 || read_u32(optional + directories) == 0) {
+        // No export directory
+        return true;
+    }
+    uint32_t export_rva = read_u32(optional + directories + 4);
+    if (export_rva == 0) {
+        return true;
+    }
+
+    Image image;
+    image.data = p;
+    image.size = size;
+    image.sections = optional + optional_size;
+    image.section_count = read_u16(coff + 2);
+    if ((uint64_t)image.section_count * SECTION_HEADER_SIZE > size - optional_offset - optional_size) {
+        return false;
+    }
+    uint32_t available;
+    const unsigned char* directory = image_data(&image, export_rva, &available);
+    if (directory == NULL || available < EXPORT_DIRECTORY_SIZE) {
+        return false;
+    }
+    uint32_t name_count = read_u32(directory + 24);
+    if (name_count == 0) {
+        return true;
+    }
+    const unsigned char* names = image_data(&image, read_u32(directory + 32), &available);
+    if (names == NULL || available / 4 < name_count) {
+        return false;
+    }
+    for (uint32_t i = 0; i < name_count; ++i) {
+        const unsigned char* name = image_data(&image, read_u32(names + 4 * i), &available);
+        if (name == NULL) {
+            return false;
+        }
+        uint32_t len = string_len(name, name + available);
+        if (len == UINT32_MAX) {
+            return false;
+        }
+        if (len > 0 && !add(ctx, (const char*)name, len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool is_excluded(const char* name, uint32_t len) {
+    if ((len >= 6 && memcmp(name, ".text$", 6) == 0) || (len >= 7 && memcmp(name, ".debug$", 7) == 0)) {
+        return true;
+    }
+    for (uint32_t i = 0; i < sizeof(excluded) / sizeof(excluded[0]); ++i) {
+        if (strlen(excluded[i]) == len && memcmp(excluded[i], name, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool scan_object(const void* data, uint64_t size, ScanSymbolFn add, void* ctx) {
+    const unsigned char* p = data;
+    uint64_t table;
+    uint32_t count;
+    uint32_t symbol_size;
+    if (size >= 4 && read_u16(p) == 0 && read_u16(p + 2) == 0xffff) {
+        // Import objects and /GL objects share this header with /bigobj
+        if (size < BIGOBJ_HEADER_SIZE || read_u16(p + 4) < 2 || memcmp(p + 12, bigobj_class, 16) != 0) {
+            return true;
+        }
+        table = read_u32(p + 48);
+        count = read_u32(p + 52);
+        symbol_size = BIGOBJ_SYMBOL_SIZE;
+    } else {
+        if (size < COFF_HEADER_SIZE) {
+            return false;
+        }
+        table = read_u32(p + 8);
+        count = read_u32(p + 12);
+        symbol_size = COFF_SYMBOL_SIZE;
+    }
+    if (table == 0 || count == 0) {
+        return true;
+    }
+    if (table > size || count > (size - table) / symbol_size) {
+        return false;
+    }
+    const unsigned char* strings = p + table + (uint64_t)count * symbol_size;
+    uint64_t strings_size = 0;
+    if (size - (strings - p) >= 4) {
+        strings_size = read_u32(strings);
+        if (strings_size > size - (strings - p)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char* symbol = p + table + (uint64_t)i * symbol_size;
+        const char* name;
+        uint32_t len;
+        if (read_u32(symbol) == 0) {
+            uint32_t offset = read_u32(symbol + 4);
+            if (offset < 4 || offset >= strings_size) {
+                return false;
+            }
+            len = string_len(strings + offset, strings + strings_size);
+            if (len == UINT32_MAX) {
+                return false;
+            }
+            name = (const char*)strings + offset;
+        } else {
+            name = (const char*)symbol;
+            len = 0;
+            while (len < 8 && name[len] != '\0') {
+                ++len;
+            }
+        }
+        if (len > 0 && !is_excluded(name, len) && !add(ctx, name, len)) {
+            return false;
+        }
+        // Auxiliary records follow their symbol
+        i += symbol[symbol_size - 1];
+    }
+    return true;
+}
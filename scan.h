@@ -0,0 +1,28 @@
+#ifndef SCAN_H_00
+#define SCAN_H_00
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Called for every symbol found, name is not NUL terminated and only valid
+// during the call. Returning false stops the scan.
+typedef bool (*ScanSymbolFn)(void* ctx, const char* name, uint32_t len);
+
+// The scanners read files from memory and never read outside of
+// [data, data + size). They return false if the file is malformed, or if
+// add returned false.
+
+// Public symbols of the first linker member of an archive (.lib). An
+// archive without a linker member has no symbols.
+bool scan_archive(const void* data, uint64_t size, ScanSymbolFn add, void* ctx);
+
+// Names in the export directory of a PE image (.dll). Exports by ordinal
+// only are skipped.
+bool scan_exports(const void* data, uint64_t size, ScanSymbolFn add, void* ctx);
+
+// Symbol table of a COFF object, regular or /bigobj. Section symbols of
+// code and debug sections, and compiler bookkeeping symbols, are skipped.
+// Objects without a symbol table, such as /GL objects, have no symbols.
+bool scan_object(const void* data, uint64_t size, ScanSymbolFn add, void* ctx);
+
+#endif
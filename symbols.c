@@ -1,12 +1,182 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <psapi.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "printf.h"
 #include "hashmap.h"
+#include "index.h"
 #include "args.h"
+#include "scan.h"
 
 
+enum Phase {
+    PHASE_CHECK, PHASE_PARSE, PHASE_BUILD, PHASE_WRITE, PHASE_MAP, PHASE_LOOKUP, PHASE_OUTPUT, PHASE_CLOSE,
+    PHASE_COUNT // Time that is not reported
+};
+
+const wchar_t* phase_names[PHASE_COUNT] = {
+    L"check", L"parse", L"build", L"write", L"map", L"lookup", L"output", L"close"
+};
+
+// Collected for --stats. Without the flag stats is NULL and every hook
+// returns right away.
+typedef struct Stats {
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER last;
+    DWORD last_faults;
+    uint32_t phase;
+    uint64_t ticks[PHASE_COUNT + 1];
+    uint64_t faults[PHASE_COUNT + 1];
+    uint64_t mapped;
+    uint64_t written;
+    // Symbol tables of the last index built
+    bool built;
+    uint32_t build_keys;
+    uint32_t build_buckets;
+    uint32_t build_rehashes;
+    bool has_delta;
+    IndexStats base;
+    IndexStats delta;
+} Stats;
+
+Stats* stats = NULL;
+
+DWORD page_faults() {
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PageFaultCount;
+}
+
+void stats_init() {
+    stats = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Stats));
+    if (stats == NULL) {
+        return;
+    }
+    QueryPerformanceFrequency(&stats->frequency);
+    QueryPerformanceCounter(&stats->last);
+    stats->last_faults = page_faults();
+    stats->phase = PHASE_CHECK;
+}
+
+// Charges the time since the last switch to the current phase, and
+// returns that phase so it can be resumed
+uint32_t stats_enter(uint32_t phase) {
+    if (stats == NULL) {
+        return phase;
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    DWORD faults = page_faults();
+    uint32_t previous = stats->phase;
+    stats->ticks[previous] += now.QuadPart - stats->last.QuadPart;
+    stats->faults[previous] += faults - stats->last_faults;
+    stats->phase = phase;
+    stats->last = now;
+    stats->last_faults = faults;
+    return previous;
+}
+
+void stats_build(const IndexBuilder* builder) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->built = true;
+    stats->build_keys = 0;
+    stats->build_buckets = 0;
+    stats->build_rehashes = 0;
+    for (uint32_t i = 0; i < INDEX_SHARD_COUNT; ++i) {
+        stats->build_keys += builder->symbols[i].element_count;
+        stats->build_buckets += builder->symbols[i].bucket_count;
+        stats->build_rehashes += builder->symbols[i].rehash_count;
+    }
+}
+
+// Walks the tables of the index before it is closed, outside any phase
+void stats_index(const Index* index) {
+    if (stats == NULL) {
+        return;
+    }
+    uint32_t phase = stats_enter(PHASE_COUNT);
+    index_stats(index, &stats->base);
+    stats->has_delta = index->delta != NULL;
+    if (stats->has_delta) {
+        index_stats(index->delta, &stats->delta);
+    }
+    stats_enter(phase);
+}
+
+// _wprintf_h has no floating point, fractions are printed with %u.%02u
+uint32_t hundredths(uint64_t num, uint64_t den) {
+    return den == 0 ? 0 : num * 100 / den;
+}
+
+void print_frozen_stats(HANDLE err, const wchar_t* name, const HashFrozenStats* map) {
+    uint32_t load = hundredths(map->element_count, map->bucket_count);
+    uint32_t compares = hundredths(map->compares, map->element_count);
+    _wprintf_h(err, L"%s: %u keys, %s hash with %u buckets, load %u.%02u, longest chain %u, "
+                    L"%u.%02u key comparisons per lookup\n",
+               name, map->element_count, map->layout == HASHMAP_FROZEN_PERFECT ? L"perfect" : L"chained",
+               map->bucket_count, load / 100, load % 100, map->longest, compares / 100, compares % 100);
+    _wprintf_h(err, L"  chain lengths:");
+    for (uint32_t i = 0; i < HASHMAP_STATS_CHAINS; ++i) {
+        _wprintf_h(err, i + 1 == HASHMAP_STATS_CHAINS ? L" %u+: %u" : L" %u: %u", i, map->chains[i]);
+    }
+    _wprintf_h(err, L"\n");
+}
+
+void print_index_stats(HANDLE err, const wchar_t* name, const IndexStats* index) {
+    if (index->block_count > 0) {
+        uint32_t compares = hundredths(index->compares, index->key_count);
+        _wprintf_h(err, L"%s: %u keys in %u blocks, %u.%02u key comparisons per lookup\n", name,
+                   index->key_count, index->block_count, compares / 100, compares % 100);
+    } else if (index->symbols.element_count > 0) {
+        print_frozen_stats(err, name, &index->symbols);
+    }
+    if (index->undecorated.element_count > 0) {
+        print_frozen_stats(err, L"  undecorated", &index->undecorated);
+    }
+    if (index->filter_blocks > 0) {
+        uint64_t bits = (uint64_t)index->filter_blocks * INDEX_FILTER_BLOCK_WORDS * 64;
+        uint32_t fill = hundredths(index->filter_bits * 100, bits);
+        _wprintf_h(err, L"  filter: %u KB in %u blocks, %u.%02u%% of bits set\n",
+                   (uint32_t)(bits / 8 / 1024), index->filter_blocks, fill / 100, fill % 100);
+    }
+}
+
+void stats_print() {
+    if (stats == NULL) {
+        return;
+    }
+    stats_enter(PHASE_COUNT);
+    HANDLE err = GetStdHandle(STD_ERROR_HANDLE);
+    uint64_t total = 0;
+    uint64_t total_faults = 0;
+    _wprintf_h(err, L"phase          ms  page faults\n");
+    for (uint32_t i = 0; i < PHASE_COUNT; ++i) {
+        uint32_t us = stats->ticks[i] * 1000000 / stats->frequency.QuadPart;
+        total += stats->ticks[i];
+        total_faults += stats->faults[i];
+        _wprintf_h(err, L"%-8s %5u.%03u %12u\n", phase_names[i], us / 1000, us % 1000, (uint32_t)stats->faults[i]);
+    }
+    uint32_t us = total * 1000000 / stats->frequency.QuadPart;
+    _wprintf_h(err, L"%-8s %5u.%03u %12u\n", L"total", us / 1000, us % 1000, (uint32_t)total_faults);
+    _wprintf_h(err, L"mapped %u KB, written %u KB\n", (uint32_t)(stats->mapped / 1024), (uint32_t)(stats->written / 1024));
+    print_index_stats(err, L"index", &stats->base);
+    if (stats->has_delta) {
+        print_index_stats(err, L"delta", &stats->delta);
+    }
+    if (stats->built) {
+        uint32_t load = hundredths(stats->build_keys, stats->build_buckets);
+        _wprintf_h(err, L"build: %u keys in %u shards with %u buckets, load %u.%02u, %u rehashes\n",
+                   stats->build_keys, INDEX_SHARD_COUNT, stats->build_buckets, load / 100, load % 100, stats->build_rehashes);
+    }
+    HeapFree(GetProcessHeap(), 0, stats);
+    stats = NULL;
+}
+
 typedef struct Mapping {
     const char* data;
     uint64_t size;
@@ -29,6 +199,8 @@ Mapping create_mapping(HANDLE file) {
     if (m.data == NULL) {
         CloseHandle(m.mapping);
         _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed mapping view\n");
+    } else if (stats != NULL) {
+        stats->mapped += m.size;
     }
 
     return m;
@@ -39,32 +211,39 @@ void close_mapping(Mapping m) {
     CloseHandle(m.mapping);
 }
 
-#define CHECKED_WRITE(out, addr, size, w) if (!WriteFile(out, addr, size, &w, NULL) || w != size) { goto error; }
-
-DWORD write_frozen_map(const HashMapFrozen* map, HANDLE out) {
-    DWORD w;
-    CHECKED_WRITE(out, &(map->map.buckets), sizeof(void*), w);
-    CHECKED_WRITE(out, &(map->map.bucket_count), sizeof(map->map.bucket_count), w);
-    CHECKED_WRITE(out, &(map->map.element_count), sizeof(map->map.element_count), w);
-    uint64_t ptr_count = map->map.bucket_count + map->map.element_count * 2;
-    CHECKED_WRITE(out, &ptr_count, sizeof(ptr_count), w);
-    for (uint32_t i = 0; i < map->map.bucket_count; ++i) {
-        uint64_t data_offset = ((unsigned char*)&map->map.buckets[i].data) - ((unsigned char*)map->map.buckets);
-        CHECKED_WRITE(out, &data_offset, sizeof(data_offset), w);
-        for (uint32_t j = 0; j < map->map.buckets[i].size; ++j) {
-            uint64_t key_offset = ((unsigned char*)&(map->map.buckets[i].data[j].key)) - ((unsigned char*)map->map.buckets);
-            CHECKED_WRITE(out, &key_offset, sizeof(key_offset), w);
-            uint64_t value_offset = ((unsigned char*)&(map->map.buckets[i].data[j].value)) - ((unsigned char*)map->map.buckets);
-            CHECKED_WRITE(out, &value_offset, sizeof(value_offset), w);
-        }
-    }
+DWORD write_index(const IndexOutput* index, HANDLE out) {
+    static const char padding[INDEX_SECTION_ALIGN] = {0};
     uint64_t written = 0;
-    unsigned char* data = (unsigned char*)map->map.buckets;
-    while (written < map->data_size) {
-        if (!WriteFile(out, data + written, map->data_size - written, &w, NULL)) {
-            return 1;
+    for (uint32_t i = 0; i <= index->header.section_count; ++i) {
+        const unsigned char* data;
+        uint64_t start, size;
+        if (i == 0) {
+            data = (const unsigned char*)&index->header;
+            start = 0;
+            size = sizeof(IndexHeader);
+        } else {
+            data = index->data[i - 1];
+            start = index->header.sections[i - 1].offset;
+            size = index->header.sections[i - 1].size;
         }
-        written += w;
+        DWORD w;
+        if (written < start) {
+            if (!WriteFile(out, padding, start - written, &w, NULL) || w != start - written) {
+                goto error;
+            }
+            written = start;
+        }
+        uint64_t pos = 0;
+        while (pos < size) {
+            if (!WriteFile(out, data + pos, size - pos, &w, NULL)) {
+                goto error;
+            }
+            pos += w;
+        }
+        written += size;
+    }
+    if (!SetEndOfFile(out)) {
+        goto error;
     }
     return 0;
 error:
@@ -76,260 +255,1423 @@ error:
     SetLastError(err);
     return err;
 }
-#undef CHECKED_WRITE
 
-bool read_frozen_map(HANDLE in, HashMapFrozen *map) {
+bool read_index(HANDLE in, Mapping* m, Index* index) {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(in, &size) || size.QuadPart < sizeof(IndexHeader)) {
+        return false;
+    }
+    uint32_t phase = stats_enter(PHASE_MAP);
+    *m = create_mapping(in);
+    bool success = m->data != NULL;
+    if (success && !index_open(index, m->data, m->size)) {
+        close_mapping(*m);
+        m->data = NULL;
+        success = false;
+    }
+    stats_enter(phase);
+    return success;
+}
+
+const wchar_t* index_file = L"index\\symbols.bin";
+const wchar_t* delta_file = L"index\\symbols_delta.bin";
+const wchar_t* compact_file = L"index\\symbols_compact.bin";
+const wchar_t* kind_files[INDEX_KIND_COUNT] = {L"index\\symbols_lib.yaml", L"index\\symbols_dll.yaml", L"index\\symbols_obj.yaml"};
+const char* kind_names[INDEX_KIND_COUNT] = {"lib", "dll", "object"};
+
+// Set by --compress. Compressed indexes are smaller but every exact lookup
+// decodes a block, so the hashed layout is the default.
+bool compress_index = false;
+
+uint64_t source_time(const wchar_t* filename) {
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExW(filename, GetFileExInfoStandard, &attr)) {
+        return 0;
+    }
+    return ((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+}
+
+// Parses a source into builder, only the changed libraries if builder
+// has a base. A missing source removes all libraries of its kind.
+bool parse_source(IndexBuilder* builder, const wchar_t* filename, uint32_t kind) {
+    if (builder->base != NULL && source_time(filename) == 0) {
+        return index_parse_yaml_delta(builder, NULL, 0, kind);
+    }
+    HANDLE in = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (in == INVALID_HANDLE_VALUE) {
+        return false;
+    }
     Mapping m = create_mapping(in);
+    CloseHandle(in);
     if (m.data == NULL) {
         return false;
     }
 
-    uint64_t alloc_size = 0;
-    uint32_t element_count = 0;
-    uint32_t bucket_count = 0;
-    unsigned char* dest = NULL;
-    uint64_t base;
-    memcpy(&base, m.data, sizeof(uint64_t));
-    memcpy(&bucket_count, m.data + sizeof(uint64_t), sizeof(uint32_t));
-    memcpy(&element_count, m.data + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
-    uint64_t ptr_count;
-    memcpy(&ptr_count, m.data + sizeof(uint64_t) + 2 * sizeof(uint32_t), sizeof(uint64_t));
-    alloc_size = m.size - 2 * sizeof(uint32_t) - (2 + ptr_count) * sizeof(uint64_t);
-    dest = HeapAlloc(GetProcessHeap(), 0, alloc_size);
-    memcpy(dest, m.data + (m.size - alloc_size), alloc_size);
-    for (uint64_t i = 0; i < ptr_count; ++i) {
-        uint64_t prev;
-        uint64_t offset;
-        memcpy(&offset, m.data + 2 * sizeof(uint32_t) + (2 + i) * sizeof(uint64_t), sizeof(uint64_t));
-        memcpy(&prev, m.data + (m.size - alloc_size) + offset, sizeof(uint64_t));
-        unsigned char* addr = dest + prev - base;
-        memcpy(dest + offset, &addr, sizeof(char*));
+    bool success;
+    uint32_t phase = stats_enter(PHASE_PARSE);
+    if (builder->base != NULL) {
+        success = index_parse_yaml_delta(builder, m.data, m.size, kind);
+    } else {
+        success = index_parse_yaml(builder, m.data, m.size, kind);
     }
+    stats_enter(phase);
     close_mapping(m);
-    map->data_size = alloc_size;
-    map->map.buckets = (HashBucket*)dest;
-    map->map.element_count = element_count;
-    map->map.bucket_count = bucket_count;
+    return success;
+}
+
+#define MAX_THREADS 64
+
+typedef struct ParallelRange {
+    IndexTask task;
+    void* ctx;
+    uint32_t begin;
+    uint32_t end;
+} ParallelRange;
+
+DWORD WINAPI parallel_worker(LPVOID param) {
+    ParallelRange* range = param;
+    range->task(range->ctx, range->begin, range->end);
+    return 0;
+}
+
+// Splits count over one thread per processor, the calling thread
+// takes the first range.
+void run_parallel(IndexTask task, void* ctx, uint32_t count, uint32_t grain) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uint32_t threads = info.dwNumberOfProcessors;
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+    if (threads > count / grain) {
+        threads = count / grain;
+    }
+    if (threads <= 1) {
+        task(ctx, 0, count);
+        return;
+    }
+    ParallelRange ranges[MAX_THREADS];
+    HANDLE handles[MAX_THREADS];
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < threads; ++i) {
+        ranges[i].task = task;
+        ranges[i].ctx = ctx;
+        ranges[i].begin = (uint64_t)count * i / threads;
+        ranges[i].end = (uint64_t)count * (i + 1) / threads;
+    }
+    for (uint32_t i = 1; i < threads; ++i) {
+        handles[started] = CreateThread(NULL, 0, parallel_worker, &ranges[i], 0, NULL);
+        if (handles[started] == NULL) {
+            // Run it here instead
+            task(ctx, ranges[i].begin, ranges[i].end);
+            continue;
+        }
+        ++started;
+    }
+    task(ctx, ranges[0].begin, ranges[0].end);
+    WaitForMultipleObjects(started, handles, TRUE, INFINITE);
+    for (uint32_t i = 0; i < started; ++i) {
+        CloseHandle(handles[i]);
+    }
+}
+
+bool builder_init(IndexBuilder* builder, const uint64_t* sources) {
+    if (!index_builder_init(builder)) {
+        return false;
+    }
+    memcpy(builder->sources, sources, sizeof(builder->sources));
+    builder->flags = INDEX_BUILD_TRIGRAMS | INDEX_BUILD_UNDECORATED | INDEX_BUILD_FILTER;
+    if (compress_index) {
+        builder->flags |= INDEX_BUILD_COMPRESSED;
+    }
+    builder->parallel = run_parallel;
     return true;
 }
 
-enum MapStatus {
-    MAP_EXISTS, MAP_NEEDED, MAP_MISSING_FILE, MAP_PARSE_ERROR
-};
+// Builds the index, frees builder and writes the index to the start of out
+bool builder_write(IndexBuilder* builder, bool success, HANDLE out) {
+    IndexOutput index;
+    uint32_t phase = stats_enter(PHASE_BUILD);
+    if (success) {
+        stats_build(builder);
+        success = index_build(builder, &index);
+    }
 
-enum MapStatus check_map_file(const wchar_t* target, wchar_t* outname, HANDLE* target_handle, HANDLE* out_handle) {
-    wchar_t name[244];
-    if (_wsplitpath_s(target, NULL, 0, NULL, 0, name, 240, NULL, 0) != 0) {
-        return MAP_PARSE_ERROR;
+    index_builder_free(builder);
+    if (!success) {
+        stats_enter(phase);
+        return false;
     }
-    if (_wmakepath_s(outname, 256, NULL, L"index", name, L".bin") != 0) {
-        return MAP_PARSE_ERROR;
+    stats_enter(PHASE_WRITE);
+    LARGE_INTEGER start = {0};
+    DWORD status = 1;
+    if (SetFilePointerEx(out, start, NULL, FILE_BEGIN)) {
+        status = write_index(&index, out);
     }
-    *target_handle = CreateFileW(target, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (*target_handle == INVALID_HANDLE_VALUE) {
-        return MAP_MISSING_FILE;
+    if (status == 0 && stats != NULL) {
+        stats->written += index.header.size;
     }
+    index_output_free(&index);
+    stats_enter(phase);
+
+    return status == 0;
+}
 
-    *out_handle = CreateFileW(outname, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (*out_handle == INVALID_HANDLE_VALUE) {
-        *out_handle = CreateFileW(outname, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (*out_handle == INVALID_HANDLE_VALUE) {
-            CloseHandle(*target_handle);
-            return MAP_PARSE_ERROR;
+bool create_index(HANDLE out, const uint64_t* sources) {
+    IndexBuilder builder;
+    if (!builder_init(&builder, sources)) {
+        return false;
+    }
+    bool success = true;
+    for (uint32_t i = 0; i < INDEX_KIND_COUNT && success; ++i) {
+        if (sources[i] != 0) {
+            success = parse_source(&builder, kind_files[i], 1 << i);
         }
-        return MAP_NEEDED;
     }
+    return builder_write(&builder, success, out);
+}
 
-    FILETIME in_time;
-    if (!GetFileTime(*target_handle, NULL, NULL, &in_time)) {
-        return MAP_NEEDED;
+// The base index, and the delta with the libraries changed since the base
+// was built. Index.delta points into this struct, so it must not be moved.
+typedef struct IndexFiles {
+    Mapping base;
+    Mapping delta; // data is NULL if no delta is attached
+    Index index;
+    Index delta_index;
+} IndexFiles;
+
+void close_index(IndexFiles* files) {
+    if (files->delta.data != NULL) {
+        close_mapping(files->delta);
     }
+    close_mapping(files->base);
+}
 
-    FILETIME out_time;
-    if (!GetFileTime(*out_handle, NULL, NULL, &out_time)) {
-        return MAP_NEEDED;
+// Writes a new delta over files->index for the stale kinds. The other kinds
+// are copied from the current delta, which is unmapped before the new delta
+// is written.
+bool create_delta(HANDLE out, IndexFiles* files, uint32_t stale, const uint64_t* sources) {
+    IndexBuilder builder;
+    bool initialized = builder_init(&builder, sources);
+    bool success = initialized && index_builder_set_base(&builder, &files->index);
+    if (success && files->delta.data != NULL) {
+        success = index_copy_kinds(&builder, &files->delta_index, INDEX_KIND_ALL & ~stale);
     }
+    if (files->delta.data != NULL) {
+        close_mapping(files->delta);
+        files->delta.data = NULL;
+        files->index.delta = NULL;
+    }
+    for (uint32_t i = 0; i < INDEX_KIND_COUNT && success; ++i) {
+        if (stale & (1 << i)) {
+            success = parse_source(&builder, kind_files[i], 1 << i);
+        }
+    }
+    if (!initialized) {
+        return false;
+    }
+    return builder_write(&builder, success, out);
+}
 
-    if (in_time.dwHighDateTime > out_time.dwHighDateTime) {
-        return MAP_NEEDED;
+bool open_delta(HANDLE file, IndexFiles* files) {
+    if (!read_index(file, &files->delta, &files->delta_index)) {
+        files->delta.data = NULL;
+        return false;
+    }
+    if (!index_attach_delta(&files->index, &files->delta_index)) {
+        close_mapping(files->delta);
+        files->delta.data = NULL;
+        return false;
     }
-    if (in_time.dwHighDateTime == out_time.dwHighDateTime && in_time.dwLowDateTime > out_time.dwLowDateTime) {
-        return MAP_NEEDED;
+    return true;
+}
+
+// Sources that changed since the base index was built are parsed into the
+// delta file, only the libraries whose records changed are indexed again.
+// Kinds read by --scan are only updated by another scan, the others follow
+// their YAML source.
+uint64_t kind_source(uint32_t kind, uint64_t indexed) {
+    if (indexed & INDEX_SOURCE_SCANNED) {
+        return indexed;
     }
-    return MAP_EXISTS;
+    return source_time(kind_files[kind]);
 }
 
-bool create_map_file(HANDLE in, HANDLE out) {
-    Mapping m = create_mapping(in);
-    if (m.data == NULL) {
+bool load_index(IndexFiles* files, uint64_t* sources) {
+    HANDLE file = CreateFileW(index_file, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
         return false;
     }
+    files->delta.data = NULL;
 
-    char* data = HeapAlloc(GetProcessHeap(), 0, m.size + 1);
-    data[m.size] = '\0';
-    memcpy(data, m.data, m.size);
-    close_mapping(m);
-    char* end = data + m.size;
-    char* line = data;
-    HashMap map;
-    HashMap_Create(&map);
-    const char* dll = NULL;
-    uint32_t dll_len = 0;
+    // Index files written by an older version are rebuilt completely
+    if (!read_index(file, &files->base, &files->index)) {
+        for (uint32_t i = 0; i < INDEX_KIND_COUNT; ++i) {
+            sources[i] = source_time(kind_files[i]);
+        }
+        bool success = create_index(file, sources) && read_index(file, &files->base, &files->index);
+        if (success) {
+            DeleteFileW(delta_file);
+        }
+        CloseHandle(file);
+        return success;
+    }
+    HANDLE delta = CreateFileW(delta_file, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (delta == INVALID_HANDLE_VALUE) {
+        close_mapping(files->base);
+        CloseHandle(file);
+        return false;
+    }
+    // A delta over an older base is ignored, and replaced below
+    open_delta(delta, files);
+
+    const Index* current = files->delta.data != NULL ? &files->delta_index : &files->index;
+    const IndexHeader* header = (const IndexHeader*)current->data;
+    uint32_t stale = 0;
+    for (uint32_t i = 0; i < INDEX_KIND_COUNT; ++i) {
+        sources[i] = kind_source(i, header->sources[i]);
+        if (header->sources[i] != sources[i]) {
+            stale |= 1 << i;
+        }
+    }
     bool success = true;
+    if (stale != 0) {
+        success = create_delta(delta, files, stale, sources) && open_delta(delta, files);
+        if (!success) {
+            close_mapping(files->base);
+        }
+    }
+    CloseHandle(delta);
+    CloseHandle(file);
+    return success;
+}
 
-    while (line < end) {
-        if (*line == '\r' || *line == '\n') {
-            ++line;
-            continue;
+// Compact once the delta is larger than this fraction of the base
+#define COMPACT_RATIO 8
+#define COMPACT_RETRIES 50
+#define COMPACT_RETRY_MS 100
+
+bool needs_compaction(const Index* index) {
+    return index->delta != NULL && index->delta->size > index->size / COMPACT_RATIO;
+}
+
+// Merges the delta into the base index and removes it. The new index is
+// written to a separate file first, so queries are only blocked while it
+// replaces the old one.
+bool compact_index() {
+    HANDLE file = CreateFileW(compact_file, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        // Another compaction is running
+        return false;
+    }
+    IndexFiles files;
+    uint64_t sources[INDEX_KIND_COUNT];
+    if (!load_index(&files, sources)) {
+        CloseHandle(file);
+        DeleteFileW(compact_file);
+        return false;
+    }
+    if (files.delta.data == NULL) {
+        close_index(&files);
+        CloseHandle(file);
+        DeleteFileW(compact_file);
+        return true;
+    }
+    IndexBuilder builder;
+    bool success = builder_init(&builder, sources);
+    if (success) {
+        // Compaction runs in its own process, so it keeps the layout of
+        // the base
+        if (files.index.blocks != NULL) {
+            builder.flags |= INDEX_BUILD_COMPRESSED;
         }
-        char* b = strchr(line, '\n');
-        char* line_end = strchr(line, '\r');
-        if (line_end == NULL || (b != NULL && b < line_end)) {
-            line_end = b;
+        success = index_copy_kinds(&builder, &files.index, INDEX_KIND_ALL) &&
+                  index_copy_kinds(&builder, &files.delta_index, INDEX_KIND_ALL);
+        success = builder_write(&builder, success, file);
+    }
+    close_index(&files);
+    CloseHandle(file);
+    if (!success) {
+        DeleteFileW(compact_file);
+        return false;
+    }
+    // The index is only opened exclusively for the length of a load
+    for (uint32_t i = 0; i < COMPACT_RETRIES; ++i) {
+        if (MoveFileExW(compact_file, index_file, MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFileW(delta_file);
+            return true;
+        }
+        Sleep(COMPACT_RETRY_MS);
+    }
+    DeleteFileW(compact_file);
+    return false;
+}
+
+// Runs symbols --compact as a detached process, so queries never wait for
+// a compaction.
+void start_compaction() {
+    wchar_t path[MAX_PATH];
+    DWORD len = GetModuleFileNameW(NULL, path, MAX_PATH);
+    if (len == 0 || len == MAX_PATH) {
+        return;
+    }
+    wchar_t command[] = L"symbols --compact";
+    STARTUPINFOW startup = {0};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION process;
+    if (CreateProcessW(path, command, NULL, NULL, FALSE, DETACHED_PROCESS, NULL, NULL, &startup, &process)) {
+        CloseHandle(process.hThread);
+        CloseHandle(process.hProcess);
+    }
+}
+
+// Loads the index for a single command
+bool open_index(IndexFiles* files, uint64_t* sources) {
+    if (!load_index(files, sources)) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed reading symbol hash file\n");
+        return false;
+    }
+    if (needs_compaction(&files->index)) {
+        start_compaction();
+    }
+    return true;
+}
+
+// Directories searched by --scan, and the extensions of each kind
+const wchar_t* scan_variables[INDEX_KIND_COUNT] = {L"LIB", L"PATH", L"LIB"};
+const wchar_t* scan_extensions[INDEX_KIND_COUNT][2] = {{L".lib", NULL}, {L".dll", NULL}, {L".obj", L".o"}};
+
+typedef struct ScanList {
+    IndexLibrary* libraries;
+    wchar_t** files;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t kind; // Index of the kind
+} ScanList;
+
+void free_scan_list(ScanList* list) {
+    for (uint32_t i = 0; i < list->count; ++i) {
+        HeapFree(GetProcessHeap(), 0, (char*)list->libraries[i].path);
+        HeapFree(GetProcessHeap(), 0, list->files[i]);
+    }
+    if (list->libraries != NULL) {
+        HeapFree(GetProcessHeap(), 0, list->libraries);
+    }
+    if (list->files != NULL) {
+        HeapFree(GetProcessHeap(), 0, list->files);
+    }
+}
+
+bool has_extension(const wchar_t* name, const wchar_t* ext) {
+    uint32_t len = wcslen(name);
+    uint32_t ext_len = wcslen(ext);
+    if (len <= ext_len) {
+        return false;
+    }
+    for (uint32_t i = 0; i < ext_len; ++i) {
+        wchar_t c = name[len - ext_len + i];
+        if (c >= L'A' && c <= L'Z') {
+            c += L'a' - L'A';
         }
-        if (!line_end) {
-            line_end = end;
+        if (c != ext[i]) {
+            return false;
         }
-        *line_end = '\0';
-        unsigned len = line_end - line;
-        if (*line != ' ') {
-            dll = NULL;
-            dll_len = 0;
+    }
+    return true;
+}
+
+bool scan_list_add(ScanList* list, const wchar_t* dir, uint32_t dir_len, const WIN32_FIND_DATAW* data) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        IndexLibrary* libraries;
+        wchar_t** files;
+        if (list->capacity == 0) {
+            libraries = HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(IndexLibrary));
+            files = HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(wchar_t*));
         } else {
-            while (*line == ' ') {
-                ++line;
-            }
-            if (strncmp(line, "fullpath:", 9) == 0) {
-                dll = line + 9;
-                while (*dll == ' ' || *dll == '\t') {
-                    ++dll;
+            libraries = HeapReAlloc(GetProcessHeap(), 0, list->libraries, capacity * sizeof(IndexLibrary));
+            files = HeapReAlloc(GetProcessHeap(), 0, list->files, capacity * sizeof(wchar_t*));
+        }
+        if (libraries != NULL) {
+            list->libraries = libraries;
+        }
+        if (files != NULL) {
+            list->files = files;
+        }
+        if (libraries == NULL || files == NULL) {
+            return false;
+        }
+        list->capacity = capacity;
+    }
+    uint32_t name_len = wcslen(data->cFileName);
+    wchar_t* file = HeapAlloc(GetProcessHeap(), 0, (dir_len + name_len + 2) * sizeof(wchar_t));
+    if (file == NULL) {
+        return false;
+    }
+    memcpy(file, dir, dir_len * sizeof(wchar_t));
+    file[dir_len] = L'\\';
+    memcpy(file + dir_len + 1, data->cFileName, (name_len + 1) * sizeof(wchar_t));
+    int len = WideCharToMultiByte(CP_UTF8, 0, file, -1, NULL, 0, NULL, NULL);
+    char* path = len > 0 ? HeapAlloc(GetProcessHeap(), 0, len) : NULL;
+    if (path == NULL) {
+        HeapFree(GetProcessHeap(), 0, file);
+        return false;
+    }
+    WideCharToMultiByte(CP_UTF8, 0, file, -1, path, len, NULL, NULL);
+
+    IndexLibrary* library = &list->libraries[list->count];
+    library->path = path;
+    library->len = len - 1;
+    uint32_t stamp[4] = {data->nFileSizeLow, data->nFileSizeHigh,
+                         data->ftLastWriteTime.dwLowDateTime, data->ftLastWriteTime.dwHighDateTime};
+    library->fingerprint = HASHMAP_HASH_FN(stamp, sizeof(stamp));
+    list->files[list->count++] = file;
+    return true;
+}
+
+// Lists the files of a kind in the directories of its environment
+// variable, without descending into subdirectories.
+bool scan_list(ScanList* list, uint32_t kind, wchar_t* dirs) {
+    list->libraries = NULL;
+    list->files = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    list->kind = kind;
+    wchar_t* dir = dirs;
+    while (*dir != L'\0') {
+        wchar_t* end = dir;
+        while (*end != L'\0' && *end != L';') {
+            ++end;
+        }
+        wchar_t* next = *end == L'\0' ? end : end + 1;
+        while (end > dir && (end[-1] == L'\\' || end[-1] == L'/')) {
+            --end;
+        }
+        uint32_t dir_len = end - dir;
+        if (dir_len == 0 || dir_len + 3 > MAX_PATH) {
+            dir = next;
+            continue;
+        }
+        wchar_t pattern[MAX_PATH];
+        memcpy(pattern, dir, dir_len * sizeof(wchar_t));
+        memcpy(pattern + dir_len, L"\\*", 3 * sizeof(wchar_t));
+        WIN32_FIND_DATAW data;
+        HANDLE find = FindFirstFileW(pattern, &data);
+        if (find != INVALID_HANDLE_VALUE) {
+            do {
+                if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                    continue;
                 }
-                dll_len = strlen(dll);
-            } else if (*line == '-') {
-                if (dll == NULL) {
-                    success = false;
-                    break;
+                for (uint32_t i = 0; i < 2 && scan_extensions[kind][i] != NULL; ++i) {
+                    if (has_extension(data.cFileName, scan_extensions[kind][i]) &&
+                        !scan_list_add(list, dir, dir_len, &data)) {
+                        FindClose(find);
+                        return false;
+                    }
                 }
-                ++line;
-                while (*line == ' ' || *line == '\t') {
-                    ++line;
+            } while (FindNextFileW(find, &data));
+            FindClose(find);
+        }
+        dir = next;
+    }
+    return true;
+}
+
+typedef struct ScanSymbols {
+    IndexSymbolFn add;
+    void* ctx;
+    bool failed;
+} ScanSymbols;
+
+bool scan_symbol(void* ctx, const char* name, uint32_t len) {
+    ScanSymbols* symbols = ctx;
+    if (!symbols->add(symbols->ctx, name, len)) {
+        symbols->failed = true;
+        return false;
+    }
+    return true;
+}
+
+// Files that cannot be read are reported and indexed without symbols
+bool scan_library(void* ctx, uint32_t library, IndexSymbolFn add, void* add_ctx) {
+    const ScanList* list = ctx;
+    const wchar_t* file = list->files[library];
+    HANDLE in = CreateFileW(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (in == INVALID_HANDLE_VALUE) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed opening '%s'\n", file);
+        return true;
+    }
+    Mapping m = create_mapping(in);
+    CloseHandle(in);
+    if (m.data == NULL) {
+        return true;
+    }
+    ScanSymbols symbols;
+    symbols.add = add;
+    symbols.ctx = add_ctx;
+    symbols.failed = false;
+    bool read;
+    if (list->kind == 0) {
+        read = scan_archive(m.data, m.size, scan_symbol, &symbols);
+    } else if (list->kind == 1) {
+        read = scan_exports(m.data, m.size, scan_symbol, &symbols);
+    } else {
+        read = scan_object(m.data, m.size, scan_symbol, &symbols);
+    }
+    close_mapping(m);
+    if (!read && !symbols.failed) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed reading '%s'\n", file);
+    }
+    return !symbols.failed;
+}
+
+// Reads the libraries in LIB and PATH directly, replacing scrape.py. Only
+// files whose size or write time changed since the last scan are read.
+// The result is written as a delta, then merged into the base index.
+bool scan_index() {
+    IndexFiles files;
+    uint64_t sources[INDEX_KIND_COUNT];
+    if (!load_index(&files, sources)) {
+        return false;
+    }
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    uint64_t scanned = INDEX_SOURCE_SCANNED | ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    IndexBuilder builder;
+    bool initialized = builder_init(&builder, sources);
+    bool success = initialized && index_builder_set_base(&builder, &files.index);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < INDEX_KIND_COUNT && success; ++i) {
+        DWORD size = GetEnvironmentVariableW(scan_variables[i], NULL, 0);
+        wchar_t* dirs = size == 0 ? NULL : HeapAlloc(GetProcessHeap(), 0, size * sizeof(wchar_t));
+        if (dirs == NULL || GetEnvironmentVariableW(scan_variables[i], dirs, size) == 0) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"%s is not set, skipping %s files\n",
+                       scan_variables[i], scan_extensions[i][0]);
+            kept |= 1 << i;
+            if (dirs != NULL) {
+                HeapFree(GetProcessHeap(), 0, dirs);
+            }
+            continue;
+        }
+        ScanList list;
+        success = scan_list(&list, i, dirs);
+        HeapFree(GetProcessHeap(), 0, dirs);
+        if (success) {
+            _printf("Scanning %u %s files\n", list.count, kind_names[i]);
+            success = index_scan(&builder, list.libraries, list.count, 1 << i, scan_library, &list);
+            builder.sources[i] = scanned;
+        }
+        free_scan_list(&list);
+    }
+    if (success && kept != 0 && files.delta.data != NULL) {
+        success = index_copy_kinds(&builder, &files.delta_index, kept);
+    }
+    if (files.delta.data != NULL) {
+        close_mapping(files.delta);
+    }
+    HANDLE delta = CreateFileW(delta_file, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (delta == INVALID_HANDLE_VALUE) {
+        success = false;
+    }
+    if (initialized) {
+        success = builder_write(&builder, success, delta);
+    }
+    if (delta != INVALID_HANDLE_VALUE) {
+        CloseHandle(delta);
+    }
+    close_mapping(files.base);
+    return success && compact_index();
+}
+
+#define SUGGESTION_COUNT 5
+
+// Only runs after an exact lookup failed, so hits never pay for it
+void print_suggestions(OutputBuffer* out, const Index* index, uint32_t kinds, const char* arg) {
+    IndexSuggestion suggestions[SUGGESTION_COUNT];
+    HashArena keys = {0};
+    uint32_t count = index_fuzzy(index, arg, kinds, INDEX_FUZZY_DISTANCE, suggestions, SUGGESTION_COUNT, &keys);
+    if (count > 0) {
+        output_append(out, "Did you mean:\n", 14);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        output_printf(out, "  %s\n", suggestions[i].key);
+    }
+    HashArena_Free(&keys);
+}
+
+bool find_symbols(uint32_t kinds, const char* arg, bool full_names, bool undecorated) {
+    IndexFiles files;
+    uint64_t sources[INDEX_KIND_COUNT];
+    if (!open_index(&files, sources)) {
+        return false;
+    }
+    const Index* index = &files.index;
+
+    // All kinds share one entry, so a single lookup serves every kind
+    stats_enter(PHASE_LOOKUP);
+    IndexHit hit;
+    bool hit_found;
+    if (undecorated) {
+        hit_found = index_lookup_undecorated(index, arg, &hit);
+    } else {
+        hit_found = index_lookup(index, arg, &hit);
+    }
+    stats_enter(PHASE_OUTPUT);
+    // Paths sharing a basename have consecutive ids, so only hits that
+    // span a delta need a map to drop repeated basenames
+    bool use_seen = !full_names && hit.count[1] != 0;
+    HashMap seen;
+    if (use_seen) {
+        HashMap_Create(&seen);
+    }
+    OutputBuffer out;
+    output_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+    for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+        if (!(kinds & (1 << kind))) {
+            continue;
+        }
+        if (sources[kind] == 0) {
+            output_flush(&out);
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Missing symbol file '%s'\n", kind_files[kind]);
+            continue;
+        }
+        bool found = false;
+        uint32_t last = UINT32_MAX;
+        IndexHitIterator it;
+        uint32_t id;
+        index_hit_begin(&hit, &it);
+        while (index_hit_next(&it, &id)) {
+            uint32_t len, path_kinds;
+            const char* path = index_path(index, id, &len, &path_kinds);
+            if (path == NULL || !(path_kinds & (1 << kind))) {
+                continue;
+            }
+            if (!found) {
+                output_printf(&out, "%s matches for '%s':\n", kind_names[kind], arg);
+                found = true;
+            }
+            const char* base = path;
+            if (!full_names) {
+                base = index_basename(path, len);
+                if (!use_seen) {
+                    uint32_t basename = index_path_basename(index, id);
+                    if (basename == last) {
+                        continue;
+                    }
+                    last = basename;
+                } else {
+                    HashElement* el = HashMap_GetLen(&seen, base, path + len - base);
+                    if (el->value != NULL) {
+                        continue;
+                    }
+                    el->value = "";
                 }
-                HashElement* elem = HashMap_Get(&map, line);
-                if (elem->value == NULL) {
-                    elem->value = HeapAlloc(GetProcessHeap(), 0, dll_len + 1);
-                    memcpy(elem->value, dll, dll_len + 1);
+            }
+            output_append(&out, base, path + len - base);
+            output_append(&out, "\n", 1);
+        }
+        if (!found) {
+            output_printf(&out, "No %s matches found for '%s'\n", kind_names[kind], arg);
+        }
+        if (use_seen) {
+            HashMap_Clear(&seen);
+        }
+    }
+    if (use_seen) {
+        HashMap_Free(&seen);
+    }
+    if (!hit_found && !undecorated) {
+        print_suggestions(&out, index, kinds, arg);
+    }
+    output_free(&out);
+
+    stats_index(index);
+    stats_enter(PHASE_CLOSE);
+    close_index(&files);
+    return true;
+}
+
+
+// Prints the symbol followed by a tab separated kind:library field for
+// every match of the given kinds. Returns false without printing anything
+// if require_match is set and nothing matched.
+bool print_record(OutputBuffer* out, const Index* index, uint32_t kinds, const char* symbol, const IndexHit* hit,
+                  bool full_names, bool require_match, HashMap* seen) {
+    if (require_match && !index_has_kind(index, hit, kinds)) {
+        return false;
+    }
+    output_append(out, symbol, strlen(symbol));
+    for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+        if (!(kinds & (1 << kind))) {
+            continue;
+        }
+        uint32_t last = UINT32_MAX;
+        IndexHitIterator it;
+        uint32_t id;
+        index_hit_begin(hit, &it);
+        while (index_hit_next(&it, &id)) {
+            uint32_t len, path_kinds;
+            const char* path = index_path(index, id, &len, &path_kinds);
+            if (path == NULL || !(path_kinds & (1 << kind))) {
+                continue;
+            }
+            if (!full_names) {
+                const char* base = index_basename(path, len);
+                len -= base - path;
+                path = base;
+                if (hit->count[1] == 0) {
+                    uint32_t basename = index_path_basename(index, id);
+                    if (basename == last) {
+                        continue;
+                    }
+                    last = basename;
                 } else {
-                    uint32_t old_len = strlen(elem->value);
-                    char* s = HeapAlloc(GetProcessHeap(), 0, dll_len + 2 + old_len);
-                    memcpy(s, elem->value, old_len);
-                    s[old_len] = '\n';
-                    memcpy(s + old_len + 1, dll, dll_len + 1);
-                    HeapFree(GetProcessHeap(), 0, elem->value);
-                    elem->value = s;
+                    HashElement* el = HashMap_GetLen(seen, path, len);
+                    if (el->value != NULL) {
+                        continue;
+                    }
+                    el->value = "";
                 }
             }
+            output_append(out, "\t", 1);
+            output_append(out, kind_names[kind], strlen(kind_names[kind]));
+            output_append(out, ":", 1);
+            output_append(out, path, len);
+        }
+        if (!full_names && hit->count[1] != 0) {
+            HashMap_Clear(seen);
         }
-        line = line_end + 1;
     }
-    HeapFree(GetProcessHeap(), 0, data);
-    HashMapFrozen frozen;
-    if (success) {
-        HashMap_Freeze(&map, &frozen);
+    output_append(out, "\n", 1);
+    return true;
+}
+
+// Prints one record per query, in the same order as the queries.
+void print_batch(OutputBuffer* out, const Index* index, uint32_t kinds, const IndexQuery* queries, uint32_t count, bool full_names) {
+    HashMap seen;
+    HashMap_Create(&seen);
+    for (uint32_t i = 0; i < count; ++i) {
+        print_record(out, index, kinds, queries[i].symbol, &queries[i].hit, full_names, false, &seen);
     }
+    HashMap_Free(&seen);
+}
 
-    for (uint32_t i = 0; i < map.bucket_count; ++i) {
-        for (uint32_t j = 0; j < map.buckets[i].size; ++j) {
-            HeapFree(GetProcessHeap(), 0, map.buckets[i].data[j].value);
+bool find_batch(uint32_t kinds, IndexQuery* queries, uint32_t count, bool full_names) {
+    IndexFiles files;
+    uint64_t sources[INDEX_KIND_COUNT];
+    if (!open_index(&files, sources)) {
+        return false;
+    }
+    const Index* index = &files.index;
+    for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+        if ((kinds & (1 << kind)) && sources[kind] == 0) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Missing symbol file '%s'\n", kind_files[kind]);
+            kinds &= ~(1 << kind);
         }
     }
-    HashMap_Free(&map);
-    if (!success) {
+
+    stats_enter(PHASE_LOOKUP);
+    index_find_batch(index, queries, count);
+    stats_enter(PHASE_OUTPUT);
+    OutputBuffer out;
+    output_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+    print_batch(&out, index, kinds, queries, count, full_names);
+    output_free(&out);
+
+    stats_index(index);
+    stats_enter(PHASE_CLOSE);
+    close_index(&files);
+    return true;
+}
+
+enum MatchMode {
+    MATCH_EXACT, MATCH_PREFIX, MATCH_GLOB, MATCH_SUBSTRING, MATCH_FUZZY
+};
+
+#define FUZZY_RESULTS 32
+
+// Streams one record per matching symbol, in sorted order, or nearest
+// first for fuzzy matches.
+bool find_matching(uint32_t kinds, const char* arg, enum MatchMode mode, uint32_t distance, bool full_names) {
+    IndexFiles files;
+    uint64_t sources[INDEX_KIND_COUNT];
+    if (!open_index(&files, sources)) {
         return false;
     }
-    if (write_frozen_map(&frozen, out) != 0) {
+    const Index* index = &files.index;
+    for (uint32_t kind = 0; kind < INDEX_KIND_COUNT; ++kind) {
+        if ((kinds & (1 << kind)) && sources[kind] == 0) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Missing symbol file '%s'\n", kind_files[kind]);
+            kinds &= ~(1 << kind);
+        }
+    }
+
+    // Records are written as the keys are found, so the lookup phase
+    // includes formatting them
+    stats_enter(PHASE_LOOKUP);
+    HashMap seen;
+    HashMap_Create(&seen);
+    OutputBuffer out;
+    output_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+    uint32_t matches = 0;
+    const char* symbol;
+    IndexHit hit;
+    if (mode == MATCH_FUZZY) {
+        IndexSuggestion suggestions[FUZZY_RESULTS];
+        HashArena keys = {0};
+        uint32_t suggestion_count = index_fuzzy(index, arg, kinds, distance, suggestions, FUZZY_RESULTS, &keys);
+        for (uint32_t i = 0; i < suggestion_count; ++i) {
+            symbol = suggestions[i].key;
+            if (index_lookup(index, symbol, &hit) &&
+                print_record(&out, index, kinds, symbol, &hit, full_names, true, &seen)) {
+                ++matches;
+            }
+        }
+        HashArena_Free(&keys);
+    } else if (mode == MATCH_SUBSTRING) {
+        const char** keys;
+        uint32_t key_count;
+        if (!index_substring(index, arg, &keys, &key_count)) {
+            output_flush(&out);
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Out of memory\n");
+        }
+        for (uint32_t i = 0; i < key_count; ++i) {
+            if (index_lookup(index, keys[i], &hit) &&
+                print_record(&out, index, kinds, keys[i], &hit, full_names, true, &seen)) {
+                ++matches;
+            }
+        }
+        if (keys != NULL) {
+            HASHMAP_FREE_FN(keys);
+        }
+    } else {
+        IndexCursor cursor;
+        if (mode == MATCH_PREFIX) {
+            index_match_prefix(index, arg, &cursor);
+        } else {
+            index_match_glob(index, arg, &cursor);
+        }
+        while ((symbol = index_next(&cursor, &hit)) != NULL) {
+            if (print_record(&out, index, kinds, symbol, &hit, full_names, true, &seen)) {
+                ++matches;
+            }
+        }
+    }
+    HashMap_Free(&seen);
+    stats_enter(PHASE_OUTPUT);
+    if (matches == 0) {
+        output_printf(&out, "No matches found for '%s'\n", arg);
+    }
+    output_free(&out);
+
+    stats_index(index);
+    stats_enter(PHASE_CLOSE);
+    close_index(&files);
+    return true;
+}
+
+bool add_query(IndexQuery** queries, uint32_t* count, uint32_t* capacity, const char* symbol, uint32_t len) {
+    if (*count == *capacity) {
+        uint32_t new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+        IndexQuery* q;
+        if (*queries == NULL) {
+            q = HeapAlloc(GetProcessHeap(), 0, new_capacity * sizeof(IndexQuery));
+        } else {
+            q = HeapReAlloc(GetProcessHeap(), 0, *queries, new_capacity * sizeof(IndexQuery));
+        }
+        if (q == NULL) {
+            return false;
+        }
+        *queries = q;
+        *capacity = new_capacity;
+    }
+    (*queries)[*count].symbol = symbol;
+    (*queries)[*count].len = len;
+    *count += 1;
+    return true;
+}
+
+// Reads a whole file, or stdin if filename is "-", into a NUL terminated
+// buffer. Pipes can not be mapped, so this reads in chunks.
+char* read_input(const wchar_t* filename, uint64_t* size) {
+    HANDLE in;
+    if (wcscmp(filename, L"-") == 0) {
+        in = GetStdHandle(STD_INPUT_HANDLE);
+    } else {
+        in = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (in == INVALID_HANDLE_VALUE) {
+            return NULL;
+        }
+    }
+    uint64_t capacity = 4096;
+    char* data = HeapAlloc(GetProcessHeap(), 0, capacity);
+    *size = 0;
+    while (data != NULL) {
+        if (*size + 1 == capacity) {
+            char* d = HeapReAlloc(GetProcessHeap(), 0, data, capacity * 2);
+            if (d == NULL) {
+                HeapFree(GetProcessHeap(), 0, data);
+                data = NULL;
+                break;
+            }
+            data = d;
+            capacity *= 2;
+        }
+        DWORD r;
+        if (!ReadFile(in, data + *size, capacity - *size - 1, &r, NULL) || r == 0) {
+            // A closed pipe reports ERROR_BROKEN_PIPE at the end of input
+            data[*size] = '\0';
+            break;
+        }
+        *size += r;
+    }
+    if (in != GetStdHandle(STD_INPUT_HANDLE)) {
+        CloseHandle(in);
+    }
+    return data;
+}
+
+char* to_ascii(const wchar_t* arg) {
+    int len = wcslen(arg);
+    char* res = HeapAlloc(GetProcessHeap(), 0, len + 1);
+    res[len] = '\0';
+    for (int i = 0; i < len; ++i) {
+        wchar_t c = arg[i];
+        // Only allow ascii
+        if (c > 127) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Invalid argument '%s'\n", arg);
+            HeapFree(GetProcessHeap(), 0, res);
+            return NULL;
+        }
+        res[i] = c;
+    }
+    return res;
+}
+
+// Adds one query per non-empty line, the lines are NUL terminated in place
+bool add_lines(IndexQuery** queries, uint32_t* count, uint32_t* capacity, char* data, uint64_t size) {
+    char* line = data;
+    while (line < data + size) {
+        char* line_end = line;
+        while (*line_end != '\n' && *line_end != '\0') {
+            ++line_end;
+        }
+        char* next = line_end + 1;
+        while (line_end > line && (line_end[-1] == '\r' || line_end[-1] == ' ' || line_end[-1] == '\t')) {
+            --line_end;
+        }
+        while (line < line_end && (*line == ' ' || *line == '\t')) {
+            ++line;
+        }
+        *line_end = '\0';
+        if (line < line_end && !add_query(queries, count, capacity, line, line_end - line)) {
+            return false;
+        }
+        line = next;
+    }
+    return true;
+}
+
+#define SERVER_PIPE L"\\\\.\\pipe\\symbols"
+#define SERVER_BUFFER_SIZE 4096
+// Milliseconds a client may take for each read or write of a message
+#define SERVER_TIMEOUT 10000
+
+// The server keeps a private copy of the index, so the file can be
+// rebuilt while requests are being served.
+typedef struct Server {
+    SRWLOCK lock;
+    unsigned char* data;
+    unsigned char* delta_data; // NULL if there is no delta
+    Index index;
+    Index delta;
+    uint64_t sources[INDEX_KIND_COUNT];
+    uint64_t index_time; // Write time of the index file when it was loaded
+} Server;
+
+bool server_load(Server* server) {
+    IndexFiles files;
+    uint64_t sources[INDEX_KIND_COUNT];
+    if (!load_index(&files, sources)) {
+        return false;
+    }
+    uint64_t size = files.index.size;
+    uint64_t delta_size = files.delta.data != NULL ? files.delta_index.size : 0;
+    unsigned char* data = HeapAlloc(GetProcessHeap(), 0, size);
+    unsigned char* delta_data = NULL;
+    if (data != NULL && delta_size != 0) {
+        delta_data = HeapAlloc(GetProcessHeap(), 0, delta_size);
+    }
+    if (data == NULL || (delta_size != 0 && delta_data == NULL)) {
+        if (data != NULL) {
+            HeapFree(GetProcessHeap(), 0, data);
+        }
+        close_index(&files);
+        return false;
+    }
+    memcpy(data, files.index.data, size);
+    if (delta_data != NULL) {
+        memcpy(delta_data, files.delta_index.data, delta_size);
+    }
+    close_index(&files);
+    // A copy that does not open keeps the index that is being served
+    Index index, delta;
+    if (!index_open(&index, data, size) ||
+        (delta_data != NULL && (!index_open(&delta, delta_data, delta_size) || !index_attach_delta(&index, &delta)))) {
+        HeapFree(GetProcessHeap(), 0, data);
+        if (delta_data != NULL) {
+            HeapFree(GetProcessHeap(), 0, delta_data);
+        }
         return false;
     }
 
+    AcquireSRWLockExclusive(&server->lock);
+    unsigned char* old = server->data;
+    unsigned char* old_delta = server->delta_data;
+    server->data = data;
+    server->delta_data = delta_data;
+    server->index = index;
+    if (delta_data != NULL) {
+        server->delta = delta;
+        index_attach_delta(&server->index, &server->delta);
+    }
+    memcpy(server->sources, sources, sizeof(sources));
+    server->index_time = source_time(index_file);
+    ReleaseSRWLockExclusive(&server->lock);
+    if (old != NULL) {
+        HeapFree(GetProcessHeap(), 0, old);
+    }
+    if (old_delta != NULL) {
+        HeapFree(GetProcessHeap(), 0, old_delta);
+    }
     return true;
 }
 
-bool find_symbols(const wchar_t* filename, const char* type, const char* arg, bool full_names) {
-    wchar_t name[256];
-    HANDLE in, out;
-    enum MapStatus ms = check_map_file(filename, name, &in, &out);
-    if (ms == MAP_PARSE_ERROR) {
-        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed creating symbol hash file\n");
+// Reloads the index when one of its sources changes. Only this thread
+// writes server->sources after startup.
+DWORD WINAPI server_watch(LPVOID arg) {
+    Server* server = arg;
+    HANDLE change = FindFirstChangeNotificationW(L"index", FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (change == INVALID_HANDLE_VALUE) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed watching index directory\n");
+        return 1;
+    }
+    while (WaitForSingleObject(change, INFINITE) == WAIT_OBJECT_0) {
+        // The index file itself changes when it is compacted or scanned
+        bool stale = source_time(index_file) != server->index_time;
+        for (uint32_t i = 0; i < INDEX_KIND_COUNT; ++i) {
+            if (kind_source(i, server->sources[i]) != server->sources[i]) {
+                stale = true;
+            }
+        }
+        // A source that is still being written fails to parse, the next
+        // change notification retries.
+        if (stale && !server_load(server)) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed reloading symbol hash file\n");
+        } else if (stale && needs_compaction(&server->index) && compact_index() && !server_load(server)) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed reloading compacted symbol hash file\n");
+        }
+        if (!FindNextChangeNotification(change)) {
+            break;
+        }
+    }
+    FindCloseChangeNotification(change);
+    return 0;
+}
+
+// Reads or writes once. With ov the handle is overlapped and the transfer
+// fails after SERVER_TIMEOUT milliseconds.
+bool pipe_transfer(HANDLE h, OVERLAPPED* ov, void* data, DWORD size, DWORD* done, bool write) {
+    if (ov == NULL) {
+        return write ? WriteFile(h, data, size, done, NULL) : ReadFile(h, data, size, done, NULL);
+    }
+    BOOL ok = write ? WriteFile(h, data, size, NULL, ov) : ReadFile(h, data, size, NULL, ov);
+    if (!ok && GetLastError() != ERROR_IO_PENDING) {
         return false;
-    } else if (ms == MAP_MISSING_FILE) {
-        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Missing symbol file '%S'", filename);
+    }
+    if (WaitForSingleObject(ov->hEvent, SERVER_TIMEOUT) != WAIT_OBJECT_0) {
+        CancelIo(h);
+        GetOverlappedResult(h, ov, done, TRUE);
         return false;
-    } else if (ms == MAP_NEEDED) {
-        if (!create_map_file(in, out)) {
-            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed creating symbol hash file\n");
-            CloseHandle(in);
-            CloseHandle(out);
+    }
+    return GetOverlappedResult(h, ov, done, FALSE);
+}
+
+// Reads from h until the data ends with an empty line.
+char* read_message(HANDLE h, OVERLAPPED* ov, uint64_t* size) {
+    uint64_t capacity = SERVER_BUFFER_SIZE;
+    char* data = HeapAlloc(GetProcessHeap(), 0, capacity);
+    *size = 0;
+    while (data != NULL) {
+        if (*size + 1 == capacity) {
+            char* d = HeapReAlloc(GetProcessHeap(), 0, data, capacity * 2);
+            if (d == NULL) {
+                break;
+            }
+            data = d;
+            capacity *= 2;
+        }
+        DWORD r;
+        if (!pipe_transfer(h, ov, data + *size, capacity - *size - 1, &r, false) || r == 0) {
+            break;
+        }
+        *size += r;
+        if ((*size == 1 && data[0] == '\n') || (*size >= 2 && data[*size - 2] == '\n' && data[*size - 1] == '\n')) {
+            data[*size] = '\0';
+            return data;
+        }
+    }
+    if (data != NULL) {
+        HeapFree(GetProcessHeap(), 0, data);
+    }
+    return NULL;
+}
+
+bool write_all(HANDLE h, OVERLAPPED* ov, const char* data, uint64_t size) {
+    uint64_t written = 0;
+    while (written < size) {
+        DWORD w;
+        if (!pipe_transfer(h, ov, (char*)data + written, size - written, &w, true)) {
             return false;
         }
+        written += w;
+    }
+    return true;
+}
+
+// A request is a "kinds full_names" line followed by one symbol per line
+// and an empty line. The response is the batch output followed by an
+// empty line, it is collected before writing so that a slow client does
+// not hold the lock.
+void server_respond(Server* server, HANDLE pipe, OVERLAPPED* ov) {
+    uint64_t size;
+    char* request = read_message(pipe, ov, &size);
+    if (request == NULL) {
+        return;
+    }
+    uint32_t kinds = 0;
+    bool full_names = false;
+    char* line = request;
+    while (*line >= '0' && *line <= '9') {
+        kinds = kinds * 10 + (*line - '0');
+        ++line;
+    }
+    if (*line == ' ') {
+        full_names = line[1] == '1';
     }
+    while (*line != '\n') {
+        ++line;
+    }
+    IndexQuery* queries = NULL;
+    uint32_t count = 0, capacity = 0;
+    OutputBuffer out;
+    output_init(&out, NULL);
+    if (add_lines(&queries, &count, &capacity, line + 1, request + size - line - 1)) {
+        AcquireSRWLockShared(&server->lock);
+        index_find_batch(&server->index, queries, count);
+        print_batch(&out, &server->index, kinds & INDEX_KIND_ALL, queries, count, full_names);
+        ReleaseSRWLockShared(&server->lock);
+    }
+    output_append(&out, "\n", 1);
+    if (write_all(pipe, ov, out.data, out.size)) {
+        // The client closes its end once it has read the whole response
+        char c;
+        DWORD r;
+        pipe_transfer(pipe, ov, &c, 1, &r, false);
+    }
+    output_free(&out);
+    if (queries != NULL) {
+        HeapFree(GetProcessHeap(), 0, queries);
+    }
+    HeapFree(GetProcessHeap(), 0, request);
+}
+
+typedef struct Connection {
+    Server* server;
+    HANDLE pipe;
+} Connection;
+
+DWORD WINAPI server_connection(LPVOID arg) {
+    Connection* conn = arg;
+    OVERLAPPED ov = {0};
+    ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (ov.hEvent != NULL) {
+        server_respond(conn->server, conn->pipe, &ov);
+        CloseHandle(ov.hEvent);
+    }
+    DisconnectNamedPipe(conn->pipe);
+    CloseHandle(conn->pipe);
+    HeapFree(GetProcessHeap(), 0, conn);
+    return 0;
+}
+
+// Blocks until a client connects to pipe
+bool server_accept(HANDLE pipe, OVERLAPPED* ov) {
+    if (ConnectNamedPipe(pipe, ov)) {
+        return true;
+    }
+    DWORD err = GetLastError();
+    DWORD n;
+    if (err == ERROR_IO_PENDING) {
+        return GetOverlappedResult(pipe, ov, &n, TRUE);
+    }
+    return err == ERROR_PIPE_CONNECTED;
+}
 
-    HashMapFrozen map;
-    if (!read_frozen_map(out, &map)) {
+int run_server() {
+    Server server;
+    InitializeSRWLock(&server.lock);
+    server.data = NULL;
+    server.delta_data = NULL;
+    if (!server_load(&server)) {
         _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed reading symbol hash file\n");
-        CloseHandle(in);
-        CloseHandle(out);
-        return false;
+        return 1;
+    }
+    HANDLE watcher = CreateThread(NULL, 0, server_watch, &server, 0, NULL);
+    if (watcher == NULL) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed starting index watcher\n");
+        return 1;
     }
+    CloseHandle(watcher);
 
-    char* res = HashMap_Value(&map.map, arg);
-    if (res == NULL) {
-        _printf("No %s matches found for '%s'\n", type, arg);
-    } else {
-        _printf("%s matches for '%s':\n", type, arg);
-        if (full_names) {
-            _printf("%s\n", res);
+    OVERLAPPED ov = {0};
+    ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (ov.hEvent == NULL) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed creating pipe event\n");
+        return 1;
+    }
+    // Each client gets its own pipe instance and thread, a new instance
+    // is created as soon as the previous one is connected.
+    DWORD first = FILE_FLAG_FIRST_PIPE_INSTANCE;
+    while (1) {
+        HANDLE pipe = CreateNamedPipeW(SERVER_PIPE, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | first,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                       PIPE_UNLIMITED_INSTANCES, SERVER_BUFFER_SIZE, SERVER_BUFFER_SIZE, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed creating pipe '%s'\n", SERVER_PIPE);
+            return 1;
+        }
+        first = 0;
+        Connection* conn = NULL;
+        if (server_accept(pipe, &ov)) {
+            conn = HeapAlloc(GetProcessHeap(), 0, sizeof(Connection));
+        }
+        if (conn == NULL) {
+            DisconnectNamedPipe(pipe);
+            CloseHandle(pipe);
+            continue;
+        }
+        conn->server = &server;
+        conn->pipe = pipe;
+        HANDLE thread = CreateThread(NULL, 0, server_connection, conn, 0, NULL);
+        if (thread == NULL) {
+            server_connection(conn);
         } else {
-            int len = strlen(res);
-            char* pos = HeapAlloc(GetProcessHeap(), 0, len + 1);
-            char* tmp = pos;
-            memcpy(tmp, res, len + 1);
-            HashMap seen;
-            HashMap_Create(&seen);
-            while (1) {
-                char* c = strchr(pos, '\n');
-                char* base;
-                if (c != NULL) {
-                    *c = '\0';
-                    base = c;
-                } else {
-                    base = strchr(pos, '\0');
-                }
-                while (base > tmp && *base != '/' && *base != '\\') {
-                    --base;
-                }
-                if (*base == '/' || *base == '\\') {
-                    ++base;
-                }
-                HashElement* el = HashMap_Get(&seen, base);
-                if (el->value == NULL) {
-                    _printf("%s\n", base);
-                    el->value = "";
-                }
-                if (c == NULL) {
-                    break;
-                } else {
-                    pos = c + 1;
-                }
-            }
-            HashMap_Free(&seen);
-            HeapFree(GetProcessHeap(), 0, tmp);
+            CloseHandle(thread);
         }
     }
+    return 0;
+}
 
-    CloseHandle(in);
-    CloseHandle(out);
+bool query_server(const IndexQuery* queries, uint32_t count, uint32_t kinds, bool full_names) {
+    HANDLE pipe;
+    while (1) {
+        pipe = CreateFileW(SERVER_PIPE, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE) {
+            break;
+        }
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(SERVER_PIPE, NMPWAIT_USE_DEFAULT_WAIT)) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed connecting to symbol server\n");
+            return false;
+        }
+    }
+    uint64_t size = 16;
+    for (uint32_t i = 0; i < count; ++i) {
+        size += queries[i].len + 1;
+    }
+    char* request = HeapAlloc(GetProcessHeap(), 0, size);
+    if (request == NULL) {
+        CloseHandle(pipe);
+        return false;
+    }
+    uint64_t pos = 0;
+    request[pos++] = '0' + kinds;
+    request[pos++] = ' ';
+    request[pos++] = full_names ? '1' : '0';
+    request[pos++] = '\n';
+    for (uint32_t i = 0; i < count; ++i) {
+        memcpy(request + pos, queries[i].symbol, queries[i].len);
+        pos += queries[i].len;
+        request[pos++] = '\n';
+    }
+    request[pos++] = '\n';
+    bool success = write_all(pipe, NULL, request, pos);
+    HeapFree(GetProcessHeap(), 0, request);
+
+    char* response = success ? read_message(pipe, NULL, &size) : NULL;
+    CloseHandle(pipe);
+    if (response == NULL) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed querying symbol server\n");
+        return false;
+    }
+    // Drop the terminating empty line
+    write_all(GetStdHandle(STD_OUTPUT_HANDLE), NULL, response, size - 1);
+    HeapFree(GetProcessHeap(), 0, response);
     return true;
 }
 
+int run_batch(LPWSTR* argv, int argc, const wchar_t* input, uint32_t kinds, bool full_names, bool client) {
+    IndexQuery* queries = NULL;
+    uint32_t count = 0, capacity = 0;
+    char* data = NULL;
+    int status = 1;
+    // Reading the queries is not part of any phase
+    stats_enter(PHASE_COUNT);
+
+    for (int i = 1; i < argc; ++i) {
+        char* arg = to_ascii(argv[i]);
+        if (arg == NULL || !add_query(&queries, &count, &capacity, arg, strlen(arg))) {
+            goto end;
+        }
+    }
+    if (input == NULL && argc <= 1) {
+        input = L"-";
+    }
+    if (input != NULL) {
+        uint64_t size;
+        data = read_input(input, &size);
+        if (data == NULL) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed reading '%s'\n", input);
+            goto end;
+        }
+        if (!add_lines(&queries, &count, &capacity, data, size)) {
+            goto end;
+        }
+    }
+
+    stats_enter(PHASE_CHECK);
+    if (client) {
+        // The round trip to the server
+        stats_enter(PHASE_LOOKUP);
+        if (query_server(queries, count, kinds, full_names)) {
+            status = 0;
+        }
+    } else if (find_batch(kinds, queries, count, full_names)) {
+        status = 0;
+    }
+end:
+    for (int i = 1; i < argc && i <= count; ++i) {
+        HeapFree(GetProcessHeap(), 0, (char*)queries[i - 1].symbol);
+    }
+    if (queries != NULL) {
+        HeapFree(GetProcessHeap(), 0, queries);
+    }
+    if (data != NULL) {
+        HeapFree(GetProcessHeap(), 0, data);
+    }
+    return status;
+}
 
 int main() {
     wchar_t* args = GetCommandLineW();
@@ -337,59 +1679,124 @@ int main() {
     int status = 1;
     wchar_t** argv = parse_command_line(args, &argc);
 
-    bool lib_type[3] = {true, false, false};
-    const wchar_t* lib_type_files[3] = {L"index\\symbols_lib.yaml", L"index\\symbols_dll.yaml", L"index\\symbols_obj.yaml"};
-    const char* lib_type_names[3] = {"lib", "dll", "object"};
-
+    uint32_t kinds = INDEX_KIND_LIB;
     bool full_names = false;
+    bool batch = false;
+    bool client = false;
+    bool undecorated = false;
+    LPWSTR input = NULL;
 
     if (find_flag(argv, &argc, L"--dlls", L"-d") > 0) {
-        lib_type[1] = true;
-        lib_type[0] = false;
+        kinds = (kinds & ~INDEX_KIND_LIB) | INDEX_KIND_DLL;
     }
     if (find_flag(argv, &argc, L"--objects", L"-o") > 0) {
-        lib_type[2] = true;
-        lib_type[0] = false;
+        kinds = (kinds & ~INDEX_KIND_LIB) | INDEX_KIND_OBJ;
     }
     if (find_flag(argv, &argc, L"--libs", L"-l") > 0) {
-        lib_type[0] = true;
+        kinds |= INDEX_KIND_LIB;
     }
     if (find_flag(argv, &argc, L"--all", L"-a") > 0) {
-        for (int i = 0; i < 3; ++i) {
-            lib_type[i] = true;
-        }
+        kinds = INDEX_KIND_ALL;
     }
     if (find_flag(argv, &argc, L"--full", L"-f") > 0) {
         full_names = true;
     }
-
-    if (argc <= 1) {
-        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Missing argument\n");
-        return 1;
+    if (find_flag(argv, &argc, L"--undecorated", L"-u") > 0) {
+        undecorated = true;
     }
-    int len = wcslen(argv[1]);
-    char* arg = HeapAlloc(GetProcessHeap(), 0, len + 1);
-    arg[len] = '\0';
-    for (int i = 0; i < len; ++i) {
-        wchar_t c = argv[1][i];
-        // Only allow ascii
-        if (c > 127) {
-            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Invalid argument '%s'\n", argv[1]);
-            goto end;
+    if (find_flag(argv, &argc, L"--compress", L"--compress") > 0) {
+        compress_index = true;
+    }
+    if (find_flag(argv, &argc, L"--stats", L"--stats") > 0) {
+        stats_init();
+    }
+    if (find_flag(argv, &argc, L"--batch", L"-b") > 0) {
+        batch = true;
+    }
+    if (find_flag_value(argv, &argc, L"--input", L"-i", &input) > 0) {
+        if (input == NULL) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Missing value for --input\n");
+            HeapFree(GetProcessHeap(), 0, argv);
+            return 1;
         }
-        arg[i] = c;
+        batch = true;
     }
 
-    status = 0;
-    for (int i = 0; i < 3; ++i) {
-        if (!lib_type[i]) {
-            continue;
+    LPWSTR match = NULL;
+    enum MatchMode mode = MATCH_EXACT;
+    if (find_flag_value(argv, &argc, L"--match", L"-m", &match) > 0) {
+        if (match != NULL && wcscmp(match, L"exact") == 0) {
+            mode = MATCH_EXACT;
+        } else if (match != NULL && wcscmp(match, L"prefix") == 0) {
+            mode = MATCH_PREFIX;
+        } else if (match != NULL && wcscmp(match, L"glob") == 0) {
+            mode = MATCH_GLOB;
+        } else if (match != NULL && wcscmp(match, L"substring") == 0) {
+            mode = MATCH_SUBSTRING;
+        } else if (match != NULL && wcscmp(match, L"fuzzy") == 0) {
+            mode = MATCH_FUZZY;
+        } else {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"--match must be one of exact, prefix, glob, substring or fuzzy\n");
+            HeapFree(GetProcessHeap(), 0, argv);
+            return 1;
+        }
+    }
+    LPWSTR distance_arg = NULL;
+    uint32_t distance = INDEX_FUZZY_DISTANCE;
+    if (find_flag_value(argv, &argc, L"--distance", L"-k", &distance_arg) > 0) {
+        if (distance_arg == NULL || distance_arg[0] < L'0' || distance_arg[0] > L'9' || distance_arg[1] != L'\0') {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"--distance must be a number from 0 to 9\n");
+            HeapFree(GetProcessHeap(), 0, argv);
+            return 1;
         }
-        find_symbols(lib_type_files[i], lib_type_names[i], arg, full_names);
+        distance = distance_arg[0] - L'0';
+    }
+    if (find_flag(argv, &argc, L"--scan", L"--scan") > 0) {
+        status = 0;
+        if (!scan_index()) {
+            _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Failed scanning libraries\n");
+            status = 1;
+        }
+        HeapFree(GetProcessHeap(), 0, argv);
+        return status;
+    }
+    if (find_flag(argv, &argc, L"--compact", L"--compact") > 0) {
+        status = compact_index() ? 0 : 1;
+        HeapFree(GetProcessHeap(), 0, argv);
+        return status;
+    }
+    if (find_flag(argv, &argc, L"--server", L"-s") > 0) {
+        status = run_server();
+        HeapFree(GetProcessHeap(), 0, argv);
+        return status;
+    }
+    if (find_flag(argv, &argc, L"--client", L"-c") > 0) {
+        client = true;
+        batch = true;
     }
 
-end:
-    HeapFree(GetProcessHeap(), 0, arg);
+    if (batch) {
+        status = run_batch(argv, argc, input, kinds, full_names, client);
+        stats_print();
+        HeapFree(GetProcessHeap(), 0, argv);
+        return status;
+    }
+
+    if (argc <= 1) {
+        _wprintf_h(GetStdHandle(STD_ERROR_HANDLE), L"Missing argument\n");
+        return 1;
+    }
+    char* arg = to_ascii(argv[1]);
+    if (arg != NULL) {
+        status = 0;
+        if (mode == MATCH_EXACT) {
+            find_symbols(kinds, arg, full_names, undecorated);
+        } else {
+            find_matching(kinds, arg, mode, distance, full_names);
+        }
+        HeapFree(GetProcessHeap(), 0, arg);
+        stats_print();
+    }
     HeapFree(GetProcessHeap(), 0, argv);
 
     return status;
@@ -0,0 +1,192 @@
+#include <string.h>
+#include "undname.h"
+
+#define UNDNAME_MAX_SCOPES 16
+#define UNDNAME_MAX_BACKREFS 10
+
+typedef struct Fragment {
+    const char* str;
+    uint32_t len;
+} Fragment;
+
+typedef struct Parser {
+    const char* pos;
+    const char* end;
+    Fragment backrefs[UNDNAME_MAX_BACKREFS];
+    uint32_t backref_count;
+} Parser;
+
+enum SpecialName {
+    NAME_PLAIN, NAME_CONSTRUCTOR, NAME_DESTRUCTOR, NAME_OPERATOR
+};
+
+const char* const operators[36] = {
+    NULL, NULL, "operator new", "operator delete", "operator=", "operator>>", "operator<<", "operator!",
+    "operator==", "operator!=", "operator[]", NULL, "operator->", "operator*", "operator++", "operator--",
+    "operator-", "operator+", "operator&", "operator->*", "operator/", "operator%", "operator<", "operator<=",
+    "operator>", "operator>=", "operator,", "operator()", "operator~", "operator^", "operator|", "operator&&",
+    "operator||", "operator*=", "operator+=", "operator-="
+};
+
+// Codes following ?_
+const char* const underscore_operators[32] = {
+    "operator/=", "operator%=", "operator>>=", "operator<<=", "operator&=", "operator|=", "operator^=",
+    "`vftable'", "`vbtable'", "`vcall'", NULL, NULL, NULL, NULL, "`vector deleting destructor'", NULL,
+    "`scalar deleting destructor'", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    "operator new[]", "operator delete[]"
+};
+
+int code_index(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Parses an identifier ending with '@', or a back reference to one
+int parse_fragment(Parser* p, Fragment* f) {
+    if (p->pos == p->end) {
+        return 0;
+    }
+    if (*p->pos >= '0' && *p->pos <= '9') {
+        uint32_t ix = *p->pos - '0';
+        if (ix >= p->backref_count) {
+            return 0;
+        }
+        *f = p->backrefs[ix];
+        ++p->pos;
+        return 1;
+    }
+    const char* start = p->pos;
+    while (p->pos < p->end && *p->pos != '@') {
+        if (*p->pos == '?' || *p->pos == '$') {
+            return 0;
+        }
+        ++p->pos;
+    }
+    if (p->pos == p->end || p->pos == start) {
+        return 0;
+    }
+    f->str = start;
+    f->len = p->pos - start;
+    ++p->pos;
+    if (p->backref_count < UNDNAME_MAX_BACKREFS) {
+        p->backrefs[p->backref_count++] = *f;
+    }
+    return 1;
+}
+
+int append(char* out, uint32_t capacity, uint32_t* size, const char* str, uint32_t len) {
+    if (*size + len > capacity) {
+        return 0;
+    }
+    memcpy(out + *size, str, len);
+    *size += len;
+    return 1;
+}
+
+uint32_t undecorate(const char* symbol, uint32_t len, char* out, uint32_t capacity, uint32_t* name_offset) {
+    Parser p;
+    p.pos = symbol;
+    p.end = symbol + len;
+    p.backref_count = 0;
+    if (len < 2 || *p.pos != '?') {
+        return 0;
+    }
+    ++p.pos;
+
+    enum SpecialName special = NAME_PLAIN;
+    Fragment name;
+    if (*p.pos == '?') {
+        ++p.pos;
+        if (p.pos + 1 >= p.end) {
+            return 0;
+        }
+        const char* op = NULL;
+        if (*p.pos == '0') {
+            special = NAME_CONSTRUCTOR;
+        } else if (*p.pos == '1') {
+            special = NAME_DESTRUCTOR;
+        } else if (*p.pos == '_') {
+            ++p.pos;
+            int ix = code_index(*p.pos);
+            if (ix >= 0 && ix < 32) {
+                op = underscore_operators[ix];
+            }
+        } else {
+            int ix = code_index(*p.pos);
+            if (ix >= 0) {
+                op = operators[ix];
+            }
+        }
+        if (special == NAME_PLAIN) {
+            if (op == NULL) {
+                return 0;
+            }
+            special = NAME_OPERATOR;
+            name.str = op;
+            name.len = strlen(op);
+        }
+        ++p.pos;
+    } else if (!parse_fragment(&p, &name)) {
+        return 0;
+    }
+
+    Fragment scopes[UNDNAME_MAX_SCOPES];
+    uint32_t scope_count = 0;
+    while (p.pos < p.end && *p.pos != '@') {
+        if (scope_count == UNDNAME_MAX_SCOPES) {
+            return 0;
+        }
+        Fragment* scope = &scopes[scope_count++];
+        if (*p.pos == '?') {
+            static const char anonymous[] = "`anonymous namespace'";
+            if (p.end - p.pos < 4 || memcmp(p.pos, "?A0x", 4) != 0) {
+                return 0;
+            }
+            while (p.pos < p.end && *p.pos != '@') {
+                ++p.pos;
+            }
+            if (p.pos == p.end) {
+                return 0;
+            }
+            ++p.pos;
+            scope->str = anonymous;
+            scope->len = sizeof(anonymous) - 1;
+            // Back references count the namespace like any other name
+            if (p.backref_count < UNDNAME_MAX_BACKREFS) {
+                p.backrefs[p.backref_count++] = *scope;
+            }
+        } else if (!parse_fragment(&p, scope)) {
+            return 0;
+        }
+    }
+    if (p.pos == p.end) {
+        return 0;
+    }
+    if ((special == NAME_CONSTRUCTOR || special == NAME_DESTRUCTOR) && scope_count == 0) {
+        return 0;
+    }
+
+    uint32_t size = 0;
+    for (uint32_t i = scope_count; i > 0; --i) {
+        if (!append(out, capacity, &size, scopes[i - 1].str, scopes[i - 1].len) ||
+            !append(out, capacity, &size, "::", 2)) {
+            return 0;
+        }
+    }
+    *name_offset = size;
+    if (special == NAME_DESTRUCTOR && !append(out, capacity, &size, "~", 1)) {
+        return 0;
+    }
+    if (special == NAME_CONSTRUCTOR || special == NAME_DESTRUCTOR) {
+        name = scopes[0];
+    }
+    if (!append(out, capacity, &size, name.str, name.len)) {
+        return 0;
+    }
+    return size;
+}
@@ -0,0 +1,14 @@
+#ifndef UNDNAME_H_00
+#define UNDNAME_H_00
+
+#include <stdint.h>
+
+// Writes the qualified name of an MSVC decorated symbol, such as
+// bar::foo for ?foo@bar@@YAXH@Z, to out. Only the name is undecorated,
+// the signature is ignored. *name_offset is set to the start of the
+// unqualified name in out. Returns the length of the name, or 0 if
+// symbol is not decorated, uses unsupported constructs such as template
+// names, or does not fit in capacity. Does not allocate.
+uint32_t undecorate(const char* symbol, uint32_t len, char* out, uint32_t capacity, uint32_t* name_offset);
+
+#endif